@@ -0,0 +1,49 @@
+#ifndef SUBA_NET_ARENA
+#define SUBA_NET_ARENA
+
+// Per packet scratch for parsers:  the strings and byte vectors one packet's parse needs are handed out in order, and
+// reset() takes them all back at once (a bump allocator over reusable objects).  they keep their capacity, so once the
+// arena has seen a packet's worth of names and records, parsing allocates nothing.
+// not thread safe:  one per parsing thread
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+class PacketArena {
+public:
+  PacketArena() = default;
+  PacketArena( const PacketArena& ) = delete;
+  PacketArena& operator=( const PacketArena& ) = delete;
+
+  // an empty string / byte vector, valid until reset()
+  std::string& string() {
+    if (next_string == strings.size())
+      strings.emplace_back();
+    std::string& s = strings[next_string++];
+    s.clear();
+    return s;
+  }
+  std::vector<uint8_t>& bytes() {
+    if (next_bytes == vectors.size())
+      vectors.emplace_back();
+    std::vector<uint8_t>& v = vectors[next_bytes++];
+    v.clear();
+    return v;
+  }
+
+  // everything handed out since the last reset() is free again
+  void reset() {
+    next_string = 0;
+    next_bytes = 0;
+  }
+
+private:
+  std::deque<std::string> strings;  // (a deque:  growing it doesn't move what was handed out)
+  std::deque<std::vector<uint8_t>> vectors;
+  size_t next_string = 0;
+  size_t next_bytes = 0;
+};
+
+#endif
@@ -0,0 +1,769 @@
+#ifndef SUBA_NET_ASYNC
+#define SUBA_NET_ASYNC
+
+// C++20 coroutine API for TCP and UDP  (needs -std=c++20, see the tcp_async target)
+//
+// A reactor runs many coroutines on one thread.  Each socket operation is awaitable and suspends the coroutine
+// (instead of blocking the thread) until the socket is ready, so thousands of flows can share a few threads
+// (one reactor per thread).
+//
+//   Task<void> echo( AsyncTCP conn ) {
+//     char buf[4096];
+//     int64_t n;
+//     while (0 < (n = co_await conn.async_read( buf, sizeof( buf ) )))
+//       co_await conn.async_write( buf, n );
+//   }
+//   ...
+//   spawn( reactor, echo( co_await listener.async_accept() ) );
+//
+// - posix:  non blocking sockets on an edge triggered epoll reactor (Linux), or poll() elsewhere
+// - asio:   Task is asio::awaitable, the reactor is an asio::io_context, operations use asio::use_awaitable
+//
+// Errors are returned, not thrown:  connect/listen/bind return 0 on success, 1 on failure.
+// read/recv return the byte count, 0 at end of stream, or -1 on error.  write/send return the byte count or -1.
+
+#include <cstdint>
+#include <string>
+#include "platform_check.h"
+
+#if defined( __cpp_impl_coroutine ) && (HAS_ASIO==1 || IS_POSIX==1)
+#define HAS_COROUTINES 1
+#else
+#define HAS_COROUTINES 0
+#endif
+
+#if HAS_COROUTINES==1
+#include <coroutine>
+#include <utility>
+
+#if HAS_ASIO==1
+#include <iostream>
+#include <asio.hpp>
+
+template <typename T = void>
+using Task = asio::awaitable<T>;
+
+// event loop, one per thread
+class AsyncReactor {
+public:
+  // run coroutines until there is no more work (or stop() is called)
+  int run() { io.run(); return 0; }
+  // make run() return, callable from any thread
+  void stop() { io.stop(); }
+
+  asio::io_context io;
+};
+
+// start a coroutine on the reactor, without waiting for it.  it begins running inside run().
+inline void spawn( AsyncReactor& reactor, Task<void> task ) {
+  asio::co_spawn( reactor.io, std::move( task ), []( std::exception_ptr e ) {
+    if (e) {
+      try { std::rethrow_exception( e ); } catch (std::exception& ex) { std::cerr << "Exception: " << ex.what() << std::endl; }
+    }
+  });
+}
+
+// TCP stream socket
+class AsyncTCP {
+public:
+  AsyncTCP( AsyncReactor& reactor ) : socket( reactor.io ) {}
+  AsyncTCP( asio::ip::tcp::socket s ) : socket( std::move( s ) ) {}
+
+  Task<int> async_connect( std::string host, uint16_t port ) {
+    asio::error_code ec;
+    asio::ip::tcp::resolver resolver( socket.get_executor() );
+    auto endpoints = co_await resolver.async_resolve( host, std::to_string( port ), asio::redirect_error( asio::use_awaitable, ec ) );
+    if (!ec)
+      co_await asio::async_connect( socket, endpoints, asio::redirect_error( asio::use_awaitable, ec ) );
+    if (ec) {
+      std::cerr << "Connection failed: " << ec.message() << std::endl;
+      co_return 1;
+    }
+    co_return 0;
+  }
+
+  // read whatever is available (at least 1 byte), up to size
+  Task<int64_t> async_read( char* buffer, size_t size ) {
+    asio::error_code ec;
+    size_t n = co_await socket.async_read_some( asio::buffer( buffer, size ), asio::redirect_error( asio::use_awaitable, ec ) );
+    if (ec == asio::error::eof)
+      co_return 0;
+    co_return ec ? -1 : (int64_t)n;
+  }
+
+  // write all of msg
+  Task<int64_t> async_write( const char* msg, size_t size ) {
+    asio::error_code ec;
+    size_t n = co_await asio::async_write( socket, asio::buffer( msg, size ), asio::redirect_error( asio::use_awaitable, ec ) );
+    co_return ec ? -1 : (int64_t)n;
+  }
+
+  bool valid() const { return socket.is_open(); }
+  void close() { asio::error_code ec; socket.close( ec ); }
+
+  asio::ip::tcp::socket socket;
+};
+
+// TCP listening socket
+class AsyncTCPListener {
+public:
+  AsyncTCPListener( AsyncReactor& reactor ) : acceptor( reactor.io ) {}
+
+  // reuseport:  several listeners (e.g. one per reactor thread) can share the port
+  int listen( uint16_t port, bool reuseport = false ) {
+    asio::error_code ec;
+    asio::ip::tcp::endpoint endpoint( asio::ip::tcp::v4(), port );
+    acceptor.open( endpoint.protocol(), ec );
+    if (!ec) acceptor.set_option( asio::socket_base::reuse_address( true ), ec );
+#if defined( SO_REUSEPORT )
+    if (!ec && reuseport) acceptor.set_option( asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>( true ), ec );
+#endif
+    if (!ec) acceptor.bind( endpoint, ec );
+    if (!ec) acceptor.listen( asio::socket_base::max_listen_connections, ec );
+    if (ec) {
+      std::cerr << "Listen failed: " << ec.message() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  // next client connection (check valid(), it's closed on failure)
+  Task<AsyncTCP> async_accept() {
+    asio::error_code ec;
+    asio::ip::tcp::socket s( acceptor.get_executor() );
+    co_await acceptor.async_accept( s, asio::redirect_error( asio::use_awaitable, ec ) );
+    co_return AsyncTCP( std::move( s ) );
+  }
+
+  void close() { asio::error_code ec; acceptor.close( ec ); }
+
+  asio::ip::tcp::acceptor acceptor;
+};
+
+// UDP socket
+class AsyncUDP {
+public:
+  using Address = asio::ip::udp::endpoint;
+
+  AsyncUDP( AsyncReactor& reactor ) : socket( reactor.io ) {}
+
+  // open the socket, bound to port (0: any port, for sending)
+  int bind( uint16_t port = 0 ) {
+    asio::error_code ec;
+    socket.open( asio::ip::udp::v4(), ec );
+    if (!ec) socket.bind( Address( asio::ip::udp::v4(), port ), ec );
+    if (ec) {
+      std::cerr << "Bind failed: " << ec.message() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  // next datagram, and who sent it
+  Task<int64_t> async_recv_from( char* buffer, size_t size, Address& from ) {
+    asio::error_code ec;
+    size_t n = co_await socket.async_receive_from( asio::buffer( buffer, size ), from, asio::redirect_error( asio::use_awaitable, ec ) );
+    co_return ec ? -1 : (int64_t)n;
+  }
+
+  Task<int64_t> async_send_to( const char* msg, size_t size, const Address& to ) {
+    asio::error_code ec;
+    size_t n = co_await socket.async_send_to( asio::buffer( msg, size ), to, asio::redirect_error( asio::use_awaitable, ec ) );
+    co_return ec ? -1 : (int64_t)n;
+  }
+
+  Task<int64_t> async_send_to( const char* msg, size_t size, const std::string& host, uint16_t port ) {
+    asio::error_code ec;
+    Address to( asio::ip::make_address( host, ec ), port );
+    if (ec)
+      co_return -1;
+    co_return co_await async_send_to( msg, size, to );
+  }
+
+  bool valid() const { return socket.is_open(); }
+  void close() { asio::error_code ec; socket.close( ec ); }
+
+  asio::ip::udp::socket socket;
+};
+
+#elif IS_POSIX==1
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#if HAS_EPOLL==1
+#include <sys/epoll.h>
+#endif
+
+// coroutine type for the async API:  lazy (starts when awaited, or spawn()ed), resumes its awaiter when done.
+template <typename T = void>
+class Task;
+
+namespace detail {
+  struct TaskPromiseBase {
+    std::coroutine_handle<> continuation;  // who is awaiting us
+    bool detached = false;                 // spawn()ed:  nobody awaits, free ourselves at the end
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      template <typename P>
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<P> h ) noexcept {
+        TaskPromiseBase& promise = h.promise();
+        if (promise.continuation)
+          return promise.continuation;
+        if (promise.detached) {
+          if (promise.exception) {
+            try { std::rethrow_exception( promise.exception ); }
+            catch (std::exception& e) { fprintf( stderr, "Unhandled exception in spawned task: %s\n", e.what() ); }
+            catch (...) { fprintf( stderr, "Unhandled exception in spawned task\n" ); }
+          }
+          h.destroy();
+        }
+        return std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+  template <typename T>
+  struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+    Task<T> get_return_object();
+    template <typename U>
+    void return_value( U&& v ) { value.emplace( std::forward<U>( v ) ); }
+    T result() {
+      if (exception)
+        std::rethrow_exception( exception );
+      return std::move( *value );
+    }
+  };
+
+  template <>
+  struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {
+      if (exception)
+        std::rethrow_exception( exception );
+    }
+  };
+}
+
+template <typename T>
+class Task {
+public:
+  using promise_type = detail::TaskPromise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  explicit Task( Handle h ) : handle( h ) {}
+  Task( Task&& other ) noexcept : handle( std::exchange( other.handle, nullptr ) ) {}
+  Task& operator=( Task&& other ) noexcept {
+    if (this != &other) {
+      if (handle) handle.destroy();
+      handle = std::exchange( other.handle, nullptr );
+    }
+    return *this;
+  }
+  Task( const Task& ) = delete;
+  Task& operator=( const Task& ) = delete;
+  ~Task() { if (handle) handle.destroy(); }
+
+  // co_await task:  run it, and continue here with its result when it's done
+  bool await_ready() const noexcept { return !handle || handle.done(); }
+  std::coroutine_handle<> await_suspend( std::coroutine_handle<> awaiter ) noexcept {
+    handle.promise().continuation = awaiter;
+    return handle;
+  }
+  T await_resume() { return handle.promise().result(); }
+
+  // hand over ownership (spawn)
+  Handle release() { return std::exchange( handle, nullptr ); }
+
+private:
+  Handle handle;
+};
+
+namespace detail {
+  template <typename T>
+  Task<T> TaskPromise<T>::get_return_object() { return Task<T>( std::coroutine_handle<TaskPromise<T>>::from_promise( *this ) ); }
+  inline Task<void> TaskPromise<void>::get_return_object() { return Task<void>( std::coroutine_handle<TaskPromise<void>>::from_promise( *this ) ); }
+}
+
+// event loop, one per thread.  suspended coroutines are resumed when their socket is ready.
+// not thread safe:  use a reactor (and its sockets) from the thread that runs it, except for stop().
+class AsyncReactor {
+public:
+  AsyncReactor() {
+#if HAS_EPOLL==1
+    poller = ::epoll_create1( EPOLL_CLOEXEC );
+    if (poller < 0)
+      fprintf( stderr, "epoll_create1 failed.  Error code: %s\n", strerror(errno) );
+#endif
+    if (::pipe( wake ) < 0) {
+      fprintf( stderr, "pipe failed.  Error code: %s\n", strerror(errno) );
+      wake[0] = wake[1] = -1;
+    }
+    for (int fd : wake) {
+      ::fcntl( fd, F_SETFL, ::fcntl( fd, F_GETFL, 0 ) | O_NONBLOCK );
+      ::fcntl( fd, F_SETFD, FD_CLOEXEC );
+    }
+#if HAS_EPOLL==1
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wake[0];
+    ::epoll_ctl( poller, EPOLL_CTL_ADD, wake[0], &ev );
+#endif
+  }
+  ~AsyncReactor() {
+#if HAS_EPOLL==1
+    if (0 <= poller) ::close( poller );
+#endif
+    for (int fd : wake)
+      if (0 <= fd) ::close( fd );
+  }
+  AsyncReactor( const AsyncReactor& ) = delete;
+  AsyncReactor& operator=( const AsyncReactor& ) = delete;
+
+  // run coroutines until there is no more work (nothing ready, nothing waiting on a socket), or stop() is called
+  int run() {
+    stopped = false;
+    while (!stopped) {
+      while (!ready.empty() && !stopped) {
+        std::coroutine_handle<> h = ready.front();
+        ready.pop_front();
+        h.resume();
+      }
+      if (stopped || (ready.empty() && waiting == 0))
+        break;
+      if (poll() != 0)
+        return 1;
+    }
+    return 0;
+  }
+
+  // make run() return, callable from any thread
+  void stop() {
+    stopped = true;
+    char c = 0;
+    if (0 <= wake[1])
+      (void)!::write( wake[1], &c, 1 );
+  }
+
+  // queue a coroutine to be resumed by run()
+  void post( std::coroutine_handle<> h ) { ready.push_back( h ); }
+
+  // awaitable:  suspend until fd is readable (or writable)
+  struct Wait {
+    AsyncReactor& reactor;
+    int fd;
+    bool write;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend( std::coroutine_handle<> h ) { reactor.wait( fd, write, h ); }
+    void await_resume() const noexcept {}
+  };
+  Wait readable( int fd ) { return Wait{ *this, fd, false }; }
+  Wait writable( int fd ) { return Wait{ *this, fd, true }; }
+
+  // stop watching fd, before closing it.  with resume, coroutines waiting on it are resumed (and their operation fails)
+  void forget( int fd, bool resume ) {
+    auto it = waiters.find( fd );
+    if (it == waiters.end())
+      return;
+    if (resume)
+      wakeup( fd, true, true );
+    waiting -= (it->second.reader ? 1 : 0) + (it->second.writer ? 1 : 0);
+    waiters.erase( it );
+#if HAS_EPOLL==1
+    ::epoll_ctl( poller, EPOLL_CTL_DEL, fd, nullptr );
+#endif
+  }
+
+private:
+  struct Waiters {
+    std::coroutine_handle<> reader, writer;
+  };
+
+  void wait( int fd, bool write, std::coroutine_handle<> h ) {
+    auto it = waiters.find( fd );
+    if (it == waiters.end()) {
+      it = waiters.emplace( fd, Waiters{} ).first;
+#if HAS_EPOLL==1
+      // registered once, edge triggered.  every operation tries the syscall before waiting, so no edge is missed:
+      // an edge that arrives with nobody waiting just means the next attempt succeeds.
+      epoll_event ev{};
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.fd = fd;
+      if (::epoll_ctl( poller, EPOLL_CTL_ADD, fd, &ev ) < 0)
+        fprintf( stderr, "epoll_ctl(ADD) failed.  Error code: %s\n", strerror(errno) );
+#endif
+    }
+    (write ? it->second.writer : it->second.reader) = h;
+    ++waiting;
+  }
+
+  // resume fd's waiters for the ready directions
+  void wakeup( int fd, bool in, bool out ) {
+    auto it = waiters.find( fd );
+    if (it == waiters.end())
+      return;
+    if (in && it->second.reader) {
+      ready.push_back( std::exchange( it->second.reader, nullptr ) );
+      --waiting;
+    }
+    if (out && it->second.writer) {
+      ready.push_back( std::exchange( it->second.writer, nullptr ) );
+      --waiting;
+    }
+  }
+
+  void drainWake() {
+    char buf[64];
+    while (0 < ::read( wake[0], buf, sizeof( buf ) )) {}
+  }
+
+  int poll() {
+#if HAS_EPOLL==1
+    epoll_event events[256];
+    int n = ::epoll_wait( poller, events, 256, -1 );
+    if (n < 0) {
+      if (errno == EINTR)
+        return 0;
+      fprintf( stderr, "epoll_wait failed.  Error code: %s\n", strerror(errno) );
+      return 1;
+    }
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      uint32_t e = events[i].events;
+      if (fd == wake[0]) {
+        drainWake();
+        continue;
+      }
+      bool err = e & (EPOLLERR | EPOLLHUP);
+      wakeup( fd, err || (e & (EPOLLIN | EPOLLRDHUP)), err || (e & EPOLLOUT) );
+    }
+#else
+    // level triggered, so only watch the directions someone is waiting for
+    fds.clear();
+    fds.push_back( pollfd{ wake[0], POLLIN, 0 } );
+    for (auto& w : waiters) {
+      short events = (w.second.reader ? POLLIN : 0) | (w.second.writer ? POLLOUT : 0);
+      if (events)
+        fds.push_back( pollfd{ w.first, events, 0 } );
+    }
+    int n = ::poll( fds.data(), (nfds_t)fds.size(), -1 );
+    if (n < 0) {
+      if (errno == EINTR)
+        return 0;
+      fprintf( stderr, "poll failed.  Error code: %s\n", strerror(errno) );
+      return 1;
+    }
+    if (fds[0].revents)
+      drainWake();
+    for (size_t i = 1; i < fds.size(); ++i) {
+      short e = fds[i].revents;
+      bool err = e & (POLLERR | POLLHUP | POLLNVAL);
+      if (e)
+        wakeup( fds[i].fd, err || (e & POLLIN), err || (e & POLLOUT) );
+    }
+    for (auto it = waiters.begin(); it != waiters.end();)
+      it = (!it->second.reader && !it->second.writer) ? waiters.erase( it ) : std::next( it );
+    fds.clear();
+#endif
+    return 0;
+  }
+
+#if HAS_EPOLL==1
+  int poller = -1;
+#else
+  std::vector<pollfd> fds;
+#endif
+  int wake[2] = { -1, -1 };  // stop() pipe
+  std::deque<std::coroutine_handle<>> ready;
+  std::unordered_map<int, Waiters> waiters;
+  size_t waiting = 0;        // suspended coroutines
+  std::atomic<bool> stopped{ false };
+};
+
+// start a coroutine on the reactor, without waiting for it.  it begins running inside run().
+// call from the reactor's thread (or before run()).
+inline void spawn( AsyncReactor& reactor, Task<void> task ) {
+  auto h = task.release();
+  h.promise().detached = true;
+  reactor.post( h );
+}
+
+namespace detail {
+  inline int setNonBlocking( int fd ) {
+    return ::fcntl( fd, F_SETFL, ::fcntl( fd, F_GETFL, 0 ) | O_NONBLOCK );
+  }
+
+  // owns a non blocking socket registered with a reactor
+  class AsyncSocket {
+  public:
+    AsyncSocket( AsyncReactor& r, int fd = -1 ) : reactor( &r ), sock( fd ) {}
+    AsyncSocket( AsyncSocket&& other ) noexcept : reactor( other.reactor ), sock( std::exchange( other.sock, -1 ) ) {}
+    AsyncSocket& operator=( AsyncSocket&& other ) noexcept {
+      if (this != &other) {
+        release( false );
+        reactor = other.reactor;
+        sock = std::exchange( other.sock, -1 );
+      }
+      return *this;
+    }
+    ~AsyncSocket() { release( false ); }
+
+    bool valid() const { return 0 <= sock; }
+    int fd() const { return sock; }
+
+    // close the socket.  a coroutine suspended on it is resumed, and its operation fails.
+    void close() { release( true ); }
+
+  protected:
+    // (from the destructor, nobody is resumed:  the waiting coroutine may be the one being destroyed)
+    void release( bool resume ) {
+      if (sock < 0)
+        return;
+      reactor->forget( sock, resume );
+      ::close( sock );
+      sock = -1;
+    }
+
+    // open a non blocking socket
+    int open( int type ) {
+      close();
+      sock = ::socket( AF_INET, type, 0 );
+      if (sock < 0) {
+        fprintf( stderr, "Socket creation failed.  Error code: %s\n", strerror(errno) );
+        return 1;
+      }
+      ::fcntl( sock, F_SETFD, FD_CLOEXEC );
+      setNonBlocking( sock );
+#if defined( SO_NOSIGPIPE )
+      int opt = 1;
+      ::setsockopt( sock, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof( opt ) );
+#endif
+      return 0;
+    }
+
+    static int sendFlags() {
+#if defined( MSG_NOSIGNAL )
+      return MSG_NOSIGNAL;
+#else
+      return 0;
+#endif
+    }
+
+    AsyncReactor* reactor;
+    int sock;
+  };
+}
+
+// TCP stream socket
+class AsyncTCP : public detail::AsyncSocket {
+public:
+  AsyncTCP( AsyncReactor& reactor, int fd = -1 ) : AsyncSocket( reactor, fd ) {}
+
+  // connect to host:port  (the name lookup itself is blocking)
+  Task<int> async_connect( std::string host, uint16_t port ) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    int rc = ::getaddrinfo( host.c_str(), std::to_string( port ).c_str(), &hints, &res );
+    if (rc != 0 || res == nullptr) {
+      fprintf( stderr, "getaddrinfo(%s) failed.  Error code: %s\n", host.c_str(), gai_strerror( rc ) );
+      co_return 1;
+    }
+    sockaddr_in addr;
+    memcpy( &addr, res->ai_addr, sizeof( addr ) );
+    ::freeaddrinfo( res );
+
+    if (open( SOCK_STREAM ) != 0)
+      co_return 1;
+    if (::connect( sock, (sockaddr*)&addr, sizeof( addr ) ) < 0) {
+      if (errno != EINPROGRESS) {
+        fprintf( stderr, "Connection failed.  Error code: %s\n", strerror(errno) );
+        close();
+        co_return 1;
+      }
+      co_await reactor->writable( sock );
+      int err = 0;
+      socklen_t len = sizeof( err );
+      ::getsockopt( sock, SOL_SOCKET, SO_ERROR, &err, &len );
+      if (err != 0) {
+        fprintf( stderr, "Connection failed.  Error code: %s\n", strerror(err) );
+        close();
+        co_return 1;
+      }
+    }
+    co_return 0;
+  }
+
+  // read whatever is available (at least 1 byte), up to size
+  Task<int64_t> async_read( char* buffer, size_t size ) {
+    while (true) {
+      ssize_t n = ::recv( sock, buffer, size, 0 );
+      if (0 <= n)
+        co_return n;
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        co_return -1;
+      co_await reactor->readable( sock );
+    }
+  }
+
+  // write all of msg
+  Task<int64_t> async_write( const char* msg, size_t size ) {
+    size_t sent = 0;
+    while (sent < size) {
+      ssize_t n = ::send( sock, msg + sent, size - sent, sendFlags() );
+      if (0 <= n) {
+        sent += n;
+        continue;
+      }
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        co_return -1;
+      co_await reactor->writable( sock );
+    }
+    co_return (int64_t)sent;
+  }
+};
+
+// TCP listening socket
+class AsyncTCPListener : public detail::AsyncSocket {
+public:
+  AsyncTCPListener( AsyncReactor& reactor ) : AsyncSocket( reactor ) {}
+
+  // reuseport:  several listeners (e.g. one per reactor thread) can share the port
+  int listen( uint16_t port, bool reuseport = false ) {
+    if (open( SOCK_STREAM ) != 0)
+      return 1;
+    int opt = 1;
+    ::setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof( opt ) );
+#if defined( SO_REUSEPORT )
+    if (reuseport && ::setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, (char*)&opt, sizeof( opt ) ) < 0) {
+      fprintf( stderr, "setsockopt(SO_REUSEPORT) failed.  Error code: %s\n", strerror(errno) );
+      close();
+      return 1;
+    }
+#endif
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (::bind( sock, (sockaddr*)&addr, sizeof( addr ) ) < 0 || ::listen( sock, SOMAXCONN ) < 0) {
+      fprintf( stderr, "Bind/listen failed.  Error code: %s\n", strerror(errno) );
+      close();
+      return 1;
+    }
+    return 0;
+  }
+
+  // next client connection (check valid(), it's closed on failure)
+  Task<AsyncTCP> async_accept() {
+    while (valid()) {
+      int client = ::accept( sock, nullptr, nullptr );
+      if (0 <= client) {
+        ::fcntl( client, F_SETFD, FD_CLOEXEC );
+        detail::setNonBlocking( client );
+#if defined( SO_NOSIGPIPE )
+        int opt = 1;
+        ::setsockopt( client, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof( opt ) );
+#endif
+        co_return AsyncTCP( *reactor, client );
+      }
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf( stderr, "accept failed.  Error code: %s\n", strerror(errno) );
+        co_return AsyncTCP( *reactor );
+      }
+      co_await reactor->readable( sock );
+    }
+    co_return AsyncTCP( *reactor );  // closed
+  }
+};
+
+// UDP socket
+class AsyncUDP : public detail::AsyncSocket {
+public:
+  using Address = sockaddr_in;
+
+  AsyncUDP( AsyncReactor& reactor ) : AsyncSocket( reactor ) {}
+
+  // open the socket, bound to port (0: any port, for sending)
+  int bind( uint16_t port = 0 ) {
+    if (open( SOCK_DGRAM ) != 0)
+      return 1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (::bind( sock, (sockaddr*)&addr, sizeof( addr ) ) < 0) {
+      fprintf( stderr, "Bind failed.  Error code: %s\n", strerror(errno) );
+      close();
+      return 1;
+    }
+    return 0;
+  }
+
+  // next datagram, and who sent it
+  Task<int64_t> async_recv_from( char* buffer, size_t size, Address& from ) {
+    while (true) {
+      socklen_t len = sizeof( from );
+      ssize_t n = ::recvfrom( sock, buffer, size, 0, (sockaddr*)&from, &len );
+      if (0 <= n)
+        co_return n;
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        co_return -1;
+      co_await reactor->readable( sock );
+    }
+  }
+
+  Task<int64_t> async_send_to( const char* msg, size_t size, const Address& to ) {
+    while (true) {
+      ssize_t n = ::sendto( sock, msg, size, sendFlags(), (const sockaddr*)&to, sizeof( to ) );
+      if (0 <= n)
+        co_return n;
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        co_return -1;
+      co_await reactor->writable( sock );
+    }
+  }
+
+  Task<int64_t> async_send_to( const char* msg, size_t size, const std::string& host, uint16_t port ) {
+    Address to{};
+    to.sin_family = AF_INET;
+    to.sin_port = htons( port );
+    if (::inet_pton( AF_INET, host.c_str(), &to.sin_addr ) != 1)
+      co_return -1;
+    co_return co_await async_send_to( msg, size, to );
+  }
+};
+
+#endif // HAS_ASIO / IS_POSIX
+#endif // HAS_COROUTINES
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SUBA_NET_BUSYPOLL
+#define SUBA_NET_BUSYPOLL
+
+// Busy poll receive mode:  trade a cpu for latency.
+// Instead of sleeping in the kernel until data arrives (and paying a scheduler wakeup for every message), the receive
+// loop spins on non-blocking reads for a time budget, and only falls back to a blocking wait once the budget passes
+// with nothing to read.  Sockets also get SO_BUSY_POLL / SO_PREFER_BUSY_POLL (Linux), so the kernel itself polls the
+// device queue instead of waiting for an interrupt, where it allows it (raising them past the net.core.busy_read
+// sysctl needs CAP_NET_ADMIN).  Pin the polling thread (cpu) so the spin doesn't migrate or fight other threads.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "platform_check.h"
+#include "utils.h"
+
+#if IS_POSIX==1
+#include <sys/socket.h>
+#include <errno.h>
+#endif
+
+struct BusyPoll {
+  bool enabled = false;
+  std::chrono::microseconds budget{ 200 };  // spin this long without data before blocking
+  int socket_busy_poll_us = 50;             // SO_BUSY_POLL:  kernel polls the device queue this long per read (0: leave it)
+  bool prefer_busy_poll = true;             // SO_PREFER_BUSY_POLL:  keep interrupts off while we're polling
+  int cpu = -1;                             // pin the receive thread to this cpu (-1: don't)
+
+  // call attempt() until it returns true (got something), or the budget passes without it.  returns the last result
+  template <typename F>
+  bool spin( F&& attempt ) const {
+    auto deadline = std::chrono::steady_clock::now() + budget;
+    do {
+      if (attempt())
+        return true;
+    } while (std::chrono::steady_clock::now() < deadline);
+    return false;
+  }
+
+  // pin the calling thread to cpu, if set.  returns 0 on success (or nothing to do)
+  int pin() const {
+    if (!enabled || cpu < 0)
+      return 0;
+    if (pinThread( cpu ) != 0) {
+      fprintf( stderr, "Could not pin the busy poll thread to cpu %d.\n", cpu );
+      return 1;
+    }
+    return 0;
+  }
+
+#if IS_POSIX==1
+  // set the kernel's busy poll options on a socket.  failures are reported once, and are not fatal (spinning still works)
+  void apply( int fd ) const {
+    if (!enabled)
+      return;
+#if defined( SO_BUSY_POLL )
+    if (0 < socket_busy_poll_us && ::setsockopt( fd, SOL_SOCKET, SO_BUSY_POLL, (char*)&socket_busy_poll_us, sizeof(socket_busy_poll_us) ) < 0)
+      warnOnce( "SO_BUSY_POLL" );
+#endif
+#if defined( SO_PREFER_BUSY_POLL )
+    int opt = prefer_busy_poll ? 1 : 0;
+    if (prefer_busy_poll && ::setsockopt( fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, (char*)&opt, sizeof(opt) ) < 0)
+      warnOnce( "SO_PREFER_BUSY_POLL" );
+#endif
+  }
+
+private:
+  static void warnOnce( const char* option ) {
+    static std::atomic<bool> warned{ false };
+    if (!warned.exchange( true ))
+      fprintf( stderr, "setsockopt(%s) failed, busy polling in userspace only.  Error code: %s\n", option, strerror(errno) );
+  }
+#endif
+};
+
+#endif
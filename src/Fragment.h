@@ -0,0 +1,240 @@
+#ifndef SUBA_NET_FRAGMENT
+#define SUBA_NET_FRAGMENT
+
+// Messages larger than a datagram, split and reassembled by the application (instead of IP fragmentation, where
+// losing any one fragment silently loses the whole datagram, and which many paths drop outright)
+// - fragmentMessage():  split a message into datagrams of at most fragment_size bytes, each with a fragment header
+// - Reassembler:        collect fragments per (source, message id) until the message is complete.  bounded:  at most
+//                       max_pending messages in progress (the oldest is evicted), each dropped after timeout.
+//                       message buffers are reused from a small pool
+//
+//   fragment:  [magic: u8 0xFA][version: u8 1][id: u32][index: u16][count: u16][offset: u32][total: u32][payload]
+//   (big endian)
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "UDPBatch.h"
+
+namespace fragment_detail {
+  static const uint8_t MAGIC = 0xFA;
+  static const uint8_t VERSION = 1;
+  static const size_t HEADER = 18;
+
+  inline void put16( char* p, uint16_t v ) { p[0] = (char)(v >> 8); p[1] = (char)v; }
+  inline void put32( char* p, uint32_t v ) { p[0] = (char)(v >> 24); p[1] = (char)(v >> 16); p[2] = (char)(v >> 8); p[3] = (char)v; }
+  inline uint16_t get16( const char* p ) { return (uint16_t)(((uint8_t)p[0] << 8) | (uint8_t)p[1]); }
+  inline uint32_t get32( const char* p ) { return ((uint32_t)(uint8_t)p[0] << 24) | ((uint32_t)(uint8_t)p[1] << 16) | ((uint32_t)(uint8_t)p[2] << 8) | (uint8_t)p[3]; }
+}
+
+// does this datagram carry a fragment header?
+inline bool isFragment( const char* data, size_t size ) {
+  return fragment_detail::HEADER <= size && (uint8_t)data[0] == fragment_detail::MAGIC && (uint8_t)data[1] == fragment_detail::VERSION;
+}
+
+// split msg into datagrams of at most fragment_size bytes (header included), written into scratch, and listed in out
+// (pointing into scratch, so send them before scratch changes).  returns the fragment count, or 0 if fragment_size
+// leaves no room for payload, or the message needs more than 65535 fragments
+inline size_t fragmentMessage( uint32_t id, const char* msg, size_t msg_size, size_t fragment_size, std::vector<char>& scratch, std::vector<Datagram>& out ) {
+  using namespace fragment_detail;
+  out.clear();
+  if (fragment_size <= HEADER || 0xFFFFFFFFu < msg_size)
+    return 0;
+  size_t payload = fragment_size - HEADER;
+  size_t count = msg_size == 0 ? 1 : (msg_size + payload - 1) / payload;
+  if (0xFFFF < count)
+    return 0;
+  scratch.resize( count * HEADER + msg_size );
+  char* p = scratch.data();
+  for (size_t i = 0; i < count; ++i) {
+    size_t offset = i * payload;
+    size_t n = msg_size - offset < payload ? msg_size - offset : payload;
+    p[0] = (char)MAGIC;
+    p[1] = (char)VERSION;
+    put32( p + 2, id );
+    put16( p + 6, (uint16_t)i );
+    put16( p + 8, (uint16_t)count );
+    put32( p + 10, (uint32_t)offset );
+    put32( p + 14, (uint32_t)msg_size );
+    if (n)
+      memcpy( p + HEADER, msg + offset, n );
+    out.push_back( Datagram{ p, HEADER + n } );
+    p += HEADER + n;
+  }
+  return count;
+}
+
+class Reassembler {
+public:
+  struct Options {
+    size_t max_pending = 64;                      // messages being reassembled at once (more:  the oldest is dropped)
+    size_t max_message = 1 << 20;                 // larger messages are refused
+    std::chrono::milliseconds timeout{ 2000 };    // a message still missing fragments this long after its first is dropped
+    size_t pooled = 16;                           // buffers kept for reuse
+  };
+  Options options;
+
+  struct Stats {
+    uint64_t completed = 0;
+    uint64_t expired = 0;      // timed out
+    uint64_t evicted = 0;      // pushed out by newer messages (max_pending)
+    uint64_t duplicates = 0;
+    uint64_t malformed = 0;    // inconsistent headers (or offsets), or over max_message
+  };
+
+  Reassembler() = default;
+  Reassembler( const Reassembler& ) = delete;
+  Reassembler& operator=( const Reassembler& ) = delete;
+
+  // take a fragment from source (e.g. the sender's address and port).  once it completes its message, calls
+  // done( const char* msg, size_t size ) (msg is only valid during the call).  thread safe
+  template <typename F>
+  void add( uint64_t source, const char* data, size_t size, F&& done ) {
+    using namespace fragment_detail;
+    if (!isFragment( data, size )) {
+      std::lock_guard<std::mutex> lock( mutex );
+      ++counters.malformed;
+      return;
+    }
+    Key key{ source, get32( data + 2 ) };
+    uint16_t index = get16( data + 6 ), count = get16( data + 8 );
+    uint32_t offset = get32( data + 10 ), total = get32( data + 14 );
+    const char* payload = data + HEADER;
+    size_t n = size - HEADER;
+
+    std::unique_lock<std::mutex> lock( mutex );
+    auto now = std::chrono::steady_clock::now();
+    expire( now );
+    if (count == 0 || count <= index || options.max_message < total || total < offset || total - offset < n || (count == 1 && n != total)) {
+      ++counters.malformed;
+      return;
+    }
+    // a single fragment message:  straight through
+    if (count == 1) {
+      ++counters.completed;
+      lock.unlock();
+      done( payload, n );
+      return;
+    }
+    // every fragment but the last carries the same payload size, at index * that size, and the last ends the message.
+    // whichever arrives first sets the size for its message (the last one gives it by its offset)
+    bool last = index + 1 == count;
+    uint32_t size_each = last ? offset / (count - 1) : (uint32_t)n;
+    if (n == 0 || size_each < n || (uint64_t)index * size_each != offset || (last && total - offset != n)) {
+      ++counters.malformed;
+      return;
+    }
+
+    auto found = table.find( key );
+    if (found == table.end()) {
+      if (options.max_pending <= table.size() && !order.empty()) {
+        ++counters.evicted;
+        drop( order.begin() );
+      }
+      order.emplace_back();
+      Pending& p = order.back();
+      p.key = key;
+      p.count = count;
+      p.size_each = size_each;
+      p.started = now;
+      p.have.assign( (count + 63) / 64, 0 );
+      p.data = acquire();
+      p.data.resize( total );
+      found = table.emplace( key, std::prev( order.end() ) ).first;
+    }
+    Pending& p = *found->second;
+    if (p.count != count || p.data.size() != total || p.size_each != size_each) {
+      ++counters.malformed;
+      return;
+    }
+    uint64_t bit = 1ull << (index % 64);
+    if (p.have[index / 64] & bit) {
+      ++counters.duplicates;
+      return;
+    }
+    p.have[index / 64] |= bit;
+    if (n)
+      memcpy( &p.data[offset], payload, n );
+    if (++p.received < p.count)
+      return;
+
+    // complete:  out of the table, deliver without holding the lock, then back to the pool
+    std::vector<char> message = std::move( p.data );
+    order.erase( found->second );
+    table.erase( found );
+    ++counters.completed;
+    lock.unlock();
+    done( message.data(), message.size() );
+    lock.lock();
+    release( std::move( message ) );
+  }
+
+  size_t pending() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return table.size();
+  }
+  Stats stats() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return counters;
+  }
+
+private:
+  struct Key {
+    uint64_t source;
+    uint32_t id;
+    bool operator==( const Key& o ) const { return source == o.source && id == o.id; }
+  };
+  struct KeyHash {
+    size_t operator()( const Key& k ) const { return std::hash<uint64_t>()( k.source * 0x9e3779b97f4a7c15ull ^ k.id ); }
+  };
+  struct Pending {
+    Key key;
+    uint16_t count = 0;
+    uint16_t received = 0;
+    uint32_t size_each = 0;      // payload size of every fragment but the last
+    std::chrono::steady_clock::time_point started;
+    std::vector<uint64_t> have;  // bitmap of the fragments received
+    std::vector<char> data;
+  };
+  using Iterator = std::list<Pending>::iterator;
+
+  // order is oldest first:  drop from the front while timed out
+  void expire( std::chrono::steady_clock::time_point now ) {
+    while (!order.empty() && options.timeout <= now - order.front().started) {
+      ++counters.expired;
+      drop( order.begin() );
+    }
+  }
+  void drop( Iterator it ) {
+    release( std::move( it->data ) );
+    table.erase( it->key );
+    order.erase( it );
+  }
+  std::vector<char> acquire() {
+    if (pool.empty())
+      return std::vector<char>();
+    std::vector<char> buf = std::move( pool.back() );
+    pool.pop_back();
+    return buf;
+  }
+  void release( std::vector<char>&& buf ) {
+    if (pool.size() < options.pooled && buf.capacity() <= options.max_message) {
+      buf.clear();
+      pool.push_back( std::move( buf ) );
+    }
+  }
+
+  std::mutex mutex;
+  std::list<Pending> order;
+  std::unordered_map<Key, Iterator, KeyHash> table;
+  std::vector<std::vector<char>> pool;
+  Stats counters;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef SUBA_NET_FRAMING
+#define SUBA_NET_FRAMING
+
+// Length prefixed message framing for stream transports (TCP)
+//
+//   U32:     4 byte big endian length, then the payload
+//   VARINT:  LEB128 length (7 bits per byte, low bits first, high bit = more), then the payload
+//
+// Frames are decoded straight out of a RingBuffer and delivered as spans into it (no copy).
+
+#include <cstdint>
+#include <cstddef>
+#include "RingBuffer.h"
+
+enum class Framing {
+  NONE,    // raw byte stream, every read is delivered as-is
+  U32,
+  VARINT,
+};
+
+// largest encoded header, for sizing a scratch buffer
+static const size_t MAX_FRAME_HEADER = 10;
+
+// write the length header for a payload of len bytes, returns the header size
+inline size_t encodeFrameHeader( Framing framing, uint64_t len, char* out ) {
+  switch (framing) {
+    case Framing::U32:
+      out[0] = (char)(len >> 24);
+      out[1] = (char)(len >> 16);
+      out[2] = (char)(len >> 8);
+      out[3] = (char)(len);
+      return 4;
+    case Framing::VARINT: {
+      size_t n = 0;
+      do {
+        uint8_t byte = len & 0x7f;
+        len >>= 7;
+        out[n++] = (char)(len ? (byte | 0x80) : byte);
+      } while (len);
+      return n;
+    }
+    default:
+      return 0;
+  }
+}
+
+// read a length header from the first avail bytes of p.
+// returns the header size (and sets len), 0 if more bytes are needed, or -1 if the header is malformed
+inline int decodeFrameHeader( Framing framing, const char* p, size_t avail, uint64_t& len ) {
+  switch (framing) {
+    case Framing::U32:
+      if (avail < 4)
+        return 0;
+      len = ((uint64_t)(uint8_t)p[0] << 24) | ((uint64_t)(uint8_t)p[1] << 16) | ((uint64_t)(uint8_t)p[2] << 8) | (uint64_t)(uint8_t)p[3];
+      return 4;
+    case Framing::VARINT: {
+      len = 0;
+      for (size_t i = 0; i < MAX_FRAME_HEADER; ++i) {
+        if (avail <= i)
+          return 0;
+        uint8_t byte = (uint8_t)p[i];
+        len |= (uint64_t)(byte & 0x7f) << (7 * i);
+        if ((byte & 0x80) == 0)
+          return (int)i + 1;
+      }
+      return -1;
+    }
+    default:
+      return -1;
+  }
+}
+
+// deliver every complete frame buffered in ring to cb( payload, payload_size ), then consume it.
+// spans are only valid during the callback.
+// when a frame is incomplete, grows ring (if needed) so the rest of it fits, and returns 0.
+// returns -1 on a malformed header or a frame larger than max_frame (the stream can't be resynced, close it)
+template <typename F>
+int deliverFrames( Framing framing, RingBuffer& ring, uint64_t max_frame, F&& cb ) {
+  while (true) {
+    uint64_t len = 0;
+    int hlen = decodeFrameHeader( framing, ring.readPtr(), ring.readable(), len );
+    if (hlen < 0 || max_frame < len)
+      return -1;
+    if (hlen == 0 || ring.readable() < hlen + len) {
+      size_t needed = hlen == 0 ? MAX_FRAME_HEADER : hlen + len;
+      if (!ring.reserve( needed - ring.readable() ))
+        return -1;
+      return 0;
+    }
+    cb( ring.readPtr() + hlen, (size_t)len );
+    ring.consume( hlen + len );
+  }
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef SUBA_NET_HISTOGRAM
+#define SUBA_NET_HISTOGRAM
+
+// Latency histogram, HDR style:  log-linear buckets (each power of two split into 32 linear sub-buckets),
+// so any recorded value is reported within ~3% whatever its magnitude, in fixed memory and O(1) per record().
+// Values are plain integers (pick a unit, e.g. microseconds).  Not thread safe.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class Histogram {
+public:
+  void record( uint64_t value, uint64_t n = 1 ) {
+    if (counts.empty())
+      counts.resize( BUCKETS, 0 );
+    counts[index( value < MAX_VALUE ? value : MAX_VALUE )] += n;
+    if (total == 0 || value < min_value) min_value = value;
+    if (max_value < value) max_value = value;
+    total += n;
+    sum += value * n;
+  }
+
+  // add another histogram's samples
+  void merge( const Histogram& other ) {
+    if (other.total == 0)
+      return;
+    if (counts.empty())
+      counts.resize( BUCKETS, 0 );
+    for (size_t i = 0; i < BUCKETS; ++i)
+      counts[i] += other.counts[i];
+    if (total == 0 || other.min_value < min_value) min_value = other.min_value;
+    if (max_value < other.max_value) max_value = other.max_value;
+    total += other.total;
+    sum += other.sum;
+  }
+
+  void clear() { counts.clear(); total = sum = min_value = max_value = 0; }
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return min_value; }
+  uint64_t max() const { return max_value; }
+  double mean() const { return total ? (double)sum / total : 0.0; }
+
+  // value at or below which fraction p (0..1) of the samples fall (the top of its bucket, so within the precision)
+  uint64_t percentile( double p ) const {
+    if (total == 0)
+      return 0;
+    uint64_t rank = (uint64_t)(p * total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      seen += counts[i];
+      if (rank <= seen) {
+        uint64_t top = lowest( i + 1 ) - 1;
+        return top < max_value ? top : max_value;
+      }
+    }
+    return max_value;
+  }
+
+  // {"count":..,"min":..,"mean":..,"p50":..,"p90":..,"p99":..,"p999":..,"max":..}
+  std::string json() const {
+    char buf[256];
+    snprintf( buf, sizeof( buf ), "{\"count\": %llu, \"min\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+              (unsigned long long)total, (unsigned long long)min_value, mean(),
+              (unsigned long long)percentile( 0.5 ), (unsigned long long)percentile( 0.9 ), (unsigned long long)percentile( 0.99 ),
+              (unsigned long long)percentile( 0.999 ), (unsigned long long)max_value );
+    return buf;
+  }
+
+private:
+  static const int SUB_BITS = 5;                  // 32 sub-buckets per power of two
+  static const uint64_t SUB = 1ull << SUB_BITS;
+  static const int MAX_BITS = 40;                 // larger values are clamped into the top bucket
+  static const uint64_t MAX_VALUE = (1ull << MAX_BITS) - 1;
+  static const size_t BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB;
+
+  static int msb( uint64_t v ) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll( v );
+#else
+    int n = 0;
+    while (v >>= 1) ++n;
+    return n;
+#endif
+  }
+
+  // values below SUB get a bucket each, then every power of two gets SUB buckets
+  static size_t index( uint64_t v ) {
+    if (v < SUB)
+      return (size_t)v;
+    int shift = msb( v ) - SUB_BITS;
+    return (size_t)((shift + 1) * SUB + ((v >> shift) - SUB));
+  }
+
+  // smallest value in bucket i
+  static uint64_t lowest( size_t i ) {
+    if (i < SUB)
+      return i;
+    int shift = (int)(i / SUB) - 1;
+    return (SUB + i % SUB) << shift;
+  }
+
+  std::vector<uint64_t> counts;  // allocated on first record()
+  uint64_t total = 0, sum = 0, min_value = 0, max_value = 0;
+};
+
+#endif
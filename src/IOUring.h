@@ -0,0 +1,282 @@
+#ifndef SUBA_NET_IOURING
+#define SUBA_NET_IOURING
+
+// Minimal io_uring wrapper (Linux), straight on the syscalls so there's no liburing dependency.
+// Just what the receive loops need:
+// - batched submission:  queue any number of SQEs with sqe(), one io_uring_enter() in submit()
+// - multishot accept / recv / recvmsg:  armed once, they keep posting CQEs (IORING_CQE_F_MORE) until they stop
+// - oneshot poll:  one CQE (res = the ready events) when fd gets ready, e.g. writable again
+// - a provided buffer ring:  the kernel picks a receive buffer per completion, we hand it back with recycle()
+//
+// Needs kernel 6.0+ (multishot recv, buffer rings).  valid() is false when the ring couldn't be set up
+// (old kernel, seccomp, /proc/sys/kernel/io_uring_disabled), so callers can fall back to epoll.
+
+#include "platform_check.h"
+#if HAS_IO_URING==1
+
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+
+class IOUring {
+public:
+  IOUring( unsigned entries = 256 ) {
+    io_uring_params p = {};
+    p.flags = IORING_SETUP_CLAMP;
+    fd = (int)::syscall( __NR_io_uring_setup, entries, &p );
+    if (fd < 0) {
+      fprintf( stderr, "io_uring_setup failed.  Error code: %s\n", strerror(errno) );
+      return;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+      sq_size = cq_size = std::max( sq_size, cq_size );
+    sq_ptr = ::mmap( nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ptr :
+             ::mmap( nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)::mmap( nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+      fprintf( stderr, "io_uring mmap failed.  Error code: %s\n", strerror(errno) );
+      release();
+      return;
+    }
+
+    char* sq = (char*)sq_ptr;
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    char* cq = (char*)cq_ptr;
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    sqe_tail = *sq_tail;
+  }
+  ~IOUring() { release(); }
+  IOUring( const IOUring& ) = delete;
+  IOUring& operator=( const IOUring& ) = delete;
+
+  bool valid() const { return 0 <= fd; }
+
+  // next free (zeroed) submission entry.  submits what's queued first if the SQ is full
+  io_uring_sqe* sqe() {
+    if (sqe_tail - load( sq_head ) == sq_entries)
+      submit();
+    unsigned idx = sqe_tail & sq_mask;
+    sq_array[idx] = idx;
+    io_uring_sqe* e = &sqes[idx];
+    std::memset( e, 0, sizeof(*e) );
+    ++sqe_tail;
+    return e;
+  }
+
+  // submit everything queued since the last submit(), in one syscall.
+  // wait_nr > 0:  also block until that many completions are ready.  returns < 0 on error
+  int submit( unsigned wait_nr = 0 ) {
+    store( sq_tail, sqe_tail );
+    while (true) {
+      unsigned to_submit = sqe_tail - load( sq_head );
+      int r = (int)::syscall( __NR_io_uring_enter, fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0 );
+      if (r < 0 && errno == EINTR)
+        continue;
+      return r;
+    }
+  }
+
+  // call cb( const io_uring_cqe& ) for every ready completion, returns how many there were
+  template <typename F>
+  unsigned reap( F&& cb ) {
+    unsigned head = *cq_head, n = 0;
+    unsigned tail = load( cq_tail );
+    for (; head != tail; ++head, ++n)
+      cb( cqes[head & cq_mask] );
+    store( cq_head, head );
+    return n;
+  }
+
+  // register a ring of count buffers of size bytes each, as buffer group bgid (count must be a power of 2)
+  bool setupBuffers( uint16_t bgid, unsigned count, unsigned size ) {
+    buf_count = count;
+    buf_size = size;
+    buf_ring_size = count * sizeof(io_uring_buf);
+    void* r = ::mmap( nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if (r == MAP_FAILED)
+      return false;
+    buf_ring = (io_uring_buf_ring*)r;
+    io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if (::syscall( __NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0) {
+      fprintf( stderr, "io_uring_register(PBUF_RING) failed.  Error code: %s\n", strerror(errno) );
+      ::munmap( buf_ring, buf_ring_size );
+      buf_ring = nullptr;
+      return false;
+    }
+    buffers.resize( (size_t)count * size );
+    buf_tail = 0;
+    for (unsigned bid = 0; bid < count; ++bid)
+      addBuffer( (uint16_t)bid );
+    publishBuffers();
+    return true;
+  }
+
+  // the provided buffer a completion landed in (IORING_CQE_F_BUFFER must be set)
+  char* buffer( const io_uring_cqe& cqe ) { return &buffers[(size_t)bufferId( cqe ) * buf_size]; }
+  static uint16_t bufferId( const io_uring_cqe& cqe ) { return (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT); }
+
+  // give a provided buffer back to the kernel, once its data has been consumed
+  void recycle( const io_uring_cqe& cqe ) {
+    addBuffer( bufferId( cqe ) );
+    publishBuffers();
+  }
+
+  void prepAcceptMultishot( int listen_fd, uint64_t user_data ) {
+    io_uring_sqe* e = sqe();
+    e->opcode = IORING_OP_ACCEPT;
+    e->fd = listen_fd;
+    e->ioprio = IORING_ACCEPT_MULTISHOT;
+    e->accept_flags = SOCK_CLOEXEC;
+    e->user_data = user_data;
+  }
+
+  void prepRecvMultishot( int sock, uint16_t bgid, uint64_t user_data ) {
+    io_uring_sqe* e = sqe();
+    e->opcode = IORING_OP_RECV;
+    e->fd = sock;
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = bgid;
+    e->user_data = user_data;
+  }
+
+  // msg only describes the layout (msg_namelen, msg_controllen) of each provided buffer:
+  //   io_uring_recvmsg_out | name | control | payload
+  // it must stay alive while the request is armed
+  void prepRecvmsgMultishot( int sock, msghdr* msg, uint16_t bgid, uint64_t user_data ) {
+    io_uring_sqe* e = sqe();
+    e->opcode = IORING_OP_RECVMSG;
+    e->fd = sock;
+    e->addr = (uint64_t)(uintptr_t)msg;
+    e->len = 1;
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = bgid;
+    e->user_data = user_data;
+  }
+
+  // events:  POLLIN, POLLOUT, ...
+  void prepPoll( int fd, unsigned events, uint64_t user_data ) {
+    io_uring_sqe* e = sqe();
+    e->opcode = IORING_OP_POLL_ADD;
+    e->fd = fd;
+    e->poll32_events = events;
+    e->user_data = user_data;
+  }
+
+  unsigned bufferSize() const { return buf_size; }
+
+private:
+  void addBuffer( uint16_t bid ) {
+    // index the ring as a plain array: in C++ the header's flex array member `bufs` lands at the wrong offset
+    io_uring_buf& b = ((io_uring_buf*)buf_ring)[buf_tail & (buf_count - 1)];
+    b.addr = (uint64_t)(uintptr_t)&buffers[(size_t)bid * buf_size];
+    b.len = buf_size;
+    b.bid = bid;
+    ++buf_tail;
+  }
+  void publishBuffers() {
+    __atomic_store_n( &buf_ring->tail, buf_tail, __ATOMIC_RELEASE );
+  }
+
+  static unsigned load( const unsigned* p ) { return __atomic_load_n( p, __ATOMIC_ACQUIRE ); }
+  static void store( unsigned* p, unsigned v ) { __atomic_store_n( p, v, __ATOMIC_RELEASE ); }
+
+  void release() {
+    if (buf_ring != nullptr)
+      ::munmap( buf_ring, buf_ring_size );
+    if (sqes != nullptr && sqes != MAP_FAILED)
+      ::munmap( sqes, sqes_size );
+    if (cq_ptr != nullptr && cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+      ::munmap( cq_ptr, cq_size );
+    if (sq_ptr != nullptr && sq_ptr != MAP_FAILED)
+      ::munmap( sq_ptr, sq_size );
+    if (0 <= fd)
+      ::close( fd );
+    buf_ring = nullptr; sqes = nullptr; cq_ptr = sq_ptr = nullptr; fd = -1;
+  }
+
+  int fd = -1;
+  void* sq_ptr = nullptr;
+  void* cq_ptr = nullptr;
+  size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+  unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+  unsigned sq_mask = 0, sq_entries = 0;
+  unsigned *cq_head = nullptr, *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_sqe* sqes = nullptr;
+  io_uring_cqe* cqes = nullptr;
+  unsigned sqe_tail = 0;   // local SQ tail (queued, not yet published)
+
+  io_uring_buf_ring* buf_ring = nullptr;
+  size_t buf_ring_size = 0;
+  unsigned buf_count = 0, buf_size = 0;
+  uint16_t buf_tail = 0;
+  std::vector<char> buffers;
+};
+
+// receive loop for a datagram socket: one multishot recvmsg, datagrams land in provided buffers.
+// calls cb( const sockaddr_in& sender, const char* data, size_t size ) per datagram (data is only valid during the call)
+// returns 1 when the loop stops on an error, or -1 right away if io_uring isn't usable (so the caller can fall back)
+template <typename F>
+int recvDatagrams( int sock, F&& cb, unsigned buffers = 256, unsigned buffer_size = 2048 ) {
+  IOUring ring( 64 );
+  if (!ring.valid() || !ring.setupBuffers( 0, buffers, buffer_size ))
+    return -1;
+
+  msghdr layout = {};
+  layout.msg_namelen = sizeof(sockaddr_in);
+  ring.prepRecvmsgMultishot( sock, &layout, 0, 0 );
+
+  bool ok = true;
+  while (ok) {
+    if (ring.submit( 1 ) < 0) {
+      fprintf( stderr, "io_uring_enter failed.  Error code: %s\n", strerror(errno) );
+      break;
+    }
+    ring.reap( [&]( const io_uring_cqe& cqe ) {
+      if (0 <= cqe.res && (cqe.flags & IORING_CQE_F_BUFFER)) {
+        const char* buf = ring.buffer( cqe );
+        const io_uring_recvmsg_out* out = (const io_uring_recvmsg_out*)buf;
+        size_t offset = sizeof(io_uring_recvmsg_out) + layout.msg_namelen + layout.msg_controllen;
+        size_t size = std::min( (size_t)out->payloadlen, (size_t)cqe.res - offset );
+        cb( *(const sockaddr_in*)(buf + sizeof(io_uring_recvmsg_out)), buf + offset, size );
+      } else if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+        fprintf( stderr, "io_uring recvmsg failed.  Error code: %s\n", strerror(-cqe.res) );
+        ok = false;
+      }
+      if (cqe.flags & IORING_CQE_F_BUFFER)
+        ring.recycle( cqe );
+      if (ok && !(cqe.flags & IORING_CQE_F_MORE))
+        ring.prepRecvmsgMultishot( sock, &layout, 0, 0 );  // re-arm (e.g. it ran out of buffers)
+    });
+  }
+  return 1;
+}
+
+#endif
+#endif
@@ -0,0 +1,94 @@
+#ifndef SUBA_NET_PACING
+#define SUBA_NET_PACING
+
+// Send pacing (posix):  spread datagrams out at a configured rate instead of bursting them into switch and receiver
+// buffers that then drop them.
+// - TokenBucket:  rate bytes/s with up to burst bytes at once.  reserve() books a send and returns when it may leave
+//                 (a virtual clock:  bookings past the burst queue up behind each other, rate apart)
+// - sleepUntil(): wait for that time on a timerfd (Linux, CLOCK_MONOTONIC absolute), clock_nanosleep() elsewhere
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "platform_check.h"
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#endif
+
+// CLOCK_MONOTONIC in ns (the clock timerfd and SO_TXTIME use)
+inline int64_t monotonicNs() {
+  timespec ts;
+  ::clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// block until monotonicNs() >= ns
+inline void sleepUntil( int64_t ns ) {
+  timespec ts = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+#if defined(__linux__)
+  // one timerfd per thread (a shared one would have concurrent senders re-arming each other's timer)
+  struct TimerFd {
+    int fd = ::timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC );
+    ~TimerFd() { if (0 <= fd) ::close( fd ); }
+  };
+  static thread_local TimerFd timer;
+  if (0 <= timer.fd) {
+    itimerspec its = {};
+    its.it_value = ts;
+    if (::timerfd_settime( timer.fd, TFD_TIMER_ABSTIME, &its, nullptr ) == 0) {
+      uint64_t expirations;
+      while (::read( timer.fd, &expirations, sizeof( expirations ) ) < 0 && errno == EINTR) {}
+      return;
+    }
+  }
+#endif
+  while (::clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr ) == EINTR) {}
+}
+
+class TokenBucket {
+public:
+  TokenBucket() = default;
+  TokenBucket( double bytes_per_sec, size_t burst_bytes ) { setRate( bytes_per_sec, burst_bytes ); }
+  TokenBucket( const TokenBucket& ) = delete;
+  TokenBucket& operator=( const TokenBucket& ) = delete;
+
+  // bytes_per_sec 0:  unlimited (the default).  burst_bytes:  how much may go out back to back after an idle spell
+  // (at least one datagram, or every send waits)
+  void setRate( double bytes_per_sec, size_t burst_bytes ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    rate = bytes_per_sec;
+    burst = (double)burst_bytes;
+    tokens = burst;
+    last = monotonicNs();
+  }
+  bool limited() const { return 0 < rate; }
+  double bytesPerSec() const { return rate; }
+
+  // book bytes for sending at (or after) now.  returns when they may leave (>= now).
+  // thread safe:  concurrent callers get consecutive slots
+  int64_t reserve( size_t bytes, int64_t now ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    double r = rate;
+    if (r <= 0)
+      return now;
+    if (last < now) {
+      tokens = std::min( burst, tokens + (double)(now - last) * r / 1e9 );
+      last = now;
+    }
+    tokens -= (double)bytes;
+    return tokens < 0 ? now + (int64_t)(-tokens * 1e9 / r) : now;
+  }
+
+private:
+  std::mutex mutex;
+  std::atomic<double> rate{ 0 };
+  double burst = 0;
+  double tokens = 0;  // negative:  debt, booked sends still waiting to go out
+  int64_t last = 0;
+};
+
+#endif
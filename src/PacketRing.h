@@ -0,0 +1,228 @@
+#ifndef SUBA_NET_PACKETRING
+#define SUBA_NET_PACKETRING
+
+// Hand received packets from the I/O thread(s) to consumer threads, so slow callbacks never stall the socket reads
+// - PacketRing:  bounded lock-free queue of preallocated packet slots, any number of producers and consumers
+//                (a sequence number per slot, D. Vyukov's bounded MPMC queue).  full:  push() fails, and counts a drop
+// - Handoff:     a PacketRing plus the consumer threads draining it into a callback
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+template <typename Meta>
+class PacketRing {
+public:
+  // slots is rounded up to a power of two.  each slot holds slot_size bytes (a larger packet grows its slot)
+  PacketRing( size_t slots = 1024, size_t slot_size = 2048 ) {
+    size_t n = 2;
+    while (n < slots)
+      n <<= 1;
+    mask = n - 1;
+    ring.reset( new Slot[n] );
+    for (size_t i = 0; i < n; ++i) {
+      ring[i].seq.store( i, std::memory_order_relaxed );
+      ring[i].data.resize( slot_size );
+    }
+  }
+  PacketRing( const PacketRing& ) = delete;
+  PacketRing& operator=( const PacketRing& ) = delete;
+
+  // copy a packet into the next free slot.  returns false (and counts a drop) when the ring is full
+  bool push( const Meta& meta, const char* data, size_t size ) {
+    if (tryPush( meta, data, size ))
+      return true;
+    drops.fetch_add( 1, std::memory_order_relaxed );
+    return false;
+  }
+
+  // push(), waiting for room instead of dropping (for streams, where a lost chunk breaks the rest).
+  // returns false only once the ring is closed
+  bool pushWait( const Meta& meta, const char* data, size_t size ) {
+    while (!tryPush( meta, data, size )) {
+      if (closed.load( std::memory_order_relaxed ))
+        return false;
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+  // take the oldest packet:  calls cb( const Meta& meta, const char* data, size_t size ), then frees its slot.
+  // returns false when the ring is empty
+  template <typename F>
+  bool pop( F&& cb ) {
+    size_t pos = head.load( std::memory_order_relaxed );
+    Slot* slot;
+    while (true) {
+      slot = &ring[pos & mask];
+      size_t seq = slot->seq.load( std::memory_order_acquire );
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load( std::memory_order_relaxed );
+      }
+    }
+    cb( (const Meta&)slot->meta, (const char*)slot->data.data(), slot->size );
+    slot->seq.store( pos + mask + 1, std::memory_order_release );
+    return true;
+  }
+
+  // pop(), sleeping up to timeout for a packet.  returns false on timeout, or once closed and drained
+  template <typename F>
+  bool popWait( F&& cb, std::chrono::milliseconds timeout ) {
+    if (pop( cb ))
+      return true;
+    std::unique_lock<std::mutex> lock( mutex );
+    sleepers.fetch_add( 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    cv.wait_for( lock, timeout, [this]() { return occupancy() != 0 || closed.load( std::memory_order_relaxed ); } );
+    sleepers.fetch_sub( 1, std::memory_order_relaxed );
+    lock.unlock();
+    return pop( cb );
+  }
+
+  // wake every waiting consumer:  popWait() then returns false once the ring is empty
+  void close() {
+    closed = true;
+    std::lock_guard<std::mutex> lock( mutex );
+    cv.notify_all();
+  }
+  bool isClosed() const { return closed.load( std::memory_order_relaxed ); }
+
+  size_t capacity() const { return mask + 1; }
+  size_t occupancy() const {
+    size_t t = tail.load( std::memory_order_acquire ), h = head.load( std::memory_order_acquire );
+    return h < t ? t - h : 0;
+  }
+  uint64_t pushed() const { return tail.load( std::memory_order_relaxed ); }
+  uint64_t popped() const { return head.load( std::memory_order_relaxed ); }
+  uint64_t dropped() const { return drops.load( std::memory_order_relaxed ); }
+
+private:
+  bool tryPush( const Meta& meta, const char* data, size_t size ) {
+    size_t pos = tail.load( std::memory_order_relaxed );
+    Slot* slot;
+    while (true) {
+      slot = &ring[pos & mask];
+      size_t seq = slot->seq.load( std::memory_order_acquire );
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ))
+          break;
+      } else if (diff < 0) {
+        return false;  // full
+      } else {
+        pos = tail.load( std::memory_order_relaxed );
+      }
+    }
+    slot->meta = meta;
+    if (slot->data.size() < size)
+      slot->data.resize( size );
+    if (size)
+      memcpy( slot->data.data(), data, size );
+    slot->size = size;
+    slot->seq.store( pos + 1, std::memory_order_release );
+
+    // wake a sleeping consumer (the fence pairs with the one in popWait(), so one of us sees the other)
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if (0 < sleepers.load( std::memory_order_relaxed )) {
+      std::lock_guard<std::mutex> lock( mutex );
+      cv.notify_one();
+    }
+    return true;
+  }
+
+  struct Slot {
+    std::atomic<size_t> seq;
+    Meta meta;
+    size_t size = 0;
+    std::vector<char> data;
+  };
+
+  // producers and consumers each get their own cache line
+  alignas(64) std::atomic<size_t> tail{ 0 };
+  alignas(64) std::atomic<size_t> head{ 0 };
+  alignas(64) std::atomic<uint64_t> drops{ 0 };
+  std::atomic<int> sleepers{ 0 };
+  std::atomic<bool> closed{ false };
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t mask = 0;
+  std::unique_ptr<Slot[]> ring;
+};
+
+// receive side handoff:  the I/O thread push()es, consumers threads run the callback
+template <typename Meta>
+class Handoff {
+public:
+  struct Options {
+    int consumers = 0;          // consumer threads (0:  off, callbacks run inline on the I/O thread)
+    size_t slots = 4096;        // packets the ring can hold (absorbs a consumer stall this long)
+    size_t slot_size = 2048;    // preallocated bytes per slot
+  };
+  Options options;
+
+  using Callback = std::function<void(const Meta& meta, const char* data, size_t size)>;
+
+  Handoff() = default;
+  ~Handoff() { stop(); }
+  Handoff( const Handoff& ) = delete;
+  Handoff& operator=( const Handoff& ) = delete;
+
+  bool enabled() const { return 0 < options.consumers; }
+
+  // create the ring and start the consumers (once, later calls do nothing)
+  void start( Callback cb ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    if (!enabled() || ring)
+      return;
+    ring.reset( new PacketRing<Meta>( options.slots, options.slot_size ) );
+    for (int i = 0; i < options.consumers; ++i) {
+      threads.emplace_back( [this, cb]() {
+        while (!ring->isClosed() || ring->occupancy()) {
+          ring->popWait( cb, std::chrono::milliseconds( 100 ) );
+        }
+      });
+    }
+  }
+
+  // drain what's queued, and stop the consumers
+  void stop() {
+    std::lock_guard<std::mutex> lock( mutex );
+    if (!ring)
+      return;
+    ring->close();
+    for (auto& t : threads)
+      t.join();
+    threads.clear();
+  }
+
+  // queue a packet for the consumers.  returns false when dropped (ring full)
+  bool push( const Meta& meta, const char* data, size_t size ) { return ring->push( meta, data, size ); }
+  // queue a packet, waiting for room (streams)
+  bool pushWait( const Meta& meta, const char* data, size_t size ) { return ring->pushWait( meta, data, size ); }
+
+  // counters (all 0 until start())
+  size_t occupancy() const { return ring ? ring->occupancy() : 0; }
+  size_t capacity() const { return ring ? ring->capacity() : 0; }
+  uint64_t pushed() const { return ring ? ring->pushed() : 0; }
+  uint64_t dropped() const { return ring ? ring->dropped() : 0; }
+
+private:
+  std::mutex mutex;
+  std::unique_ptr<PacketRing<Meta>> ring;
+  std::vector<std::thread> threads;
+};
+
+#endif
@@ -0,0 +1,468 @@
+#ifndef SUBA_NET_RPC
+#define SUBA_NET_RPC
+
+// Multiplexed request/response over one TCP connection (posix only)
+// - RPCClient:  many calls in flight at once on a single warm connection, each tagged with a stream id.
+//               responses may come back in any order, and complete a callback or a future.  per call timeouts.
+// - RPCServer:  a TCP listener (reactor, shards, ...) handing each request to a handler, which replies whenever
+//               it's done (right away, or later from another thread), so slow calls don't hold up the ones behind.
+//
+// Each message is one frame (U32 or VARINT framing):  [stream id: u32 big endian][kind: u8][payload]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "platform_check.h"
+#include "Framing.h"
+#include "RingBuffer.h"
+#include "TCP.h"
+
+#if IS_POSIX==1 && HAS_ASIO==0
+
+enum class RPCStatus {
+  OK,
+  ERROR,         // the handler replied with an error (the payload says why)
+  TIMEOUT,       // no response in time (a late one is dropped)
+  DISCONNECTED,  // the connection failed or closed before the response came
+};
+
+namespace rpc_detail {
+  enum Kind : uint8_t { REQUEST = 0, RESPONSE = 1, ERROR = 2 };
+  static const size_t HEADER = 5;
+
+  inline void encodeHeader( uint32_t id, uint8_t kind, char* out ) {
+    out[0] = (char)(id >> 24);
+    out[1] = (char)(id >> 16);
+    out[2] = (char)(id >> 8);
+    out[3] = (char)(id);
+    out[4] = (char)kind;
+  }
+  inline uint32_t decodeId( const char* p ) {
+    return ((uint32_t)(uint8_t)p[0] << 24) | ((uint32_t)(uint8_t)p[1] << 16) | ((uint32_t)(uint8_t)p[2] << 8) | (uint32_t)(uint8_t)p[3];
+  }
+}
+
+class RPCClient {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // response callback, called exactly once per call.  the payload span is only valid during the callback.
+  using Callback = std::function<void(RPCStatus status, const char* response, size_t response_size)>;
+
+  struct Response {
+    RPCStatus status;
+    std::string data;
+  };
+
+  struct Options {
+    Framing framing = Framing::U32;                 // must match the server's
+    uint64_t max_frame_size = 64 * 1024 * 1024;     // larger responses close the connection
+    std::chrono::milliseconds timeout{ 5000 };      // default per call timeout (-1 = none)
+    bool nodelay = true;                            // TCP_NODELAY:  small requests go out right away
+  };
+
+  RPCClient( const Endpoint& ep ) : endpoint( ep ) { start(); }
+  RPCClient( const Endpoint& ep, const Options& opts ) : endpoint( ep ), options( opts ) { start(); }
+  ~RPCClient() {
+    stopping = true;
+    wake();
+    if (reader.joinable())
+      reader.join();
+    disconnect( "client closed", -1 );
+    ::close( wake_pipe[0] );
+    ::close( wake_pipe[1] );
+  }
+  RPCClient( const RPCClient& ) = delete;
+  RPCClient& operator=( const RPCClient& ) = delete;
+
+  // open the connection (call() also does this when there isn't one).  returns 0 on success, 1 on error
+  int connect() {
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      if (0 <= fd)
+        return 0;
+    }
+    // the handshake runs without mutex, so the reader and the calls on a live connection don't wait for it.
+    // connect_mutex keeps concurrent callers from each opening one
+    std::lock_guard<std::mutex> clock( connect_mutex );
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      if (0 <= fd)
+        return 0;
+    }
+    int sock = openSocket();
+    if (sock < 0)
+      return 1;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      fd = sock;
+    }
+    wake();  // the reader picks up the new socket
+    return 0;
+  }
+
+  // fail every call in flight (DISCONNECTED), and close the connection
+  void close() { disconnect( "client closed", -1 ); }
+
+  // send a request.  cb gets the response (or TIMEOUT / DISCONNECTED) from the reader thread,
+  // or from this thread when the request couldn't be sent.  returns 0 on success, 1 on error
+  int call( const char* request, size_t request_size, Callback cb ) {
+    return call( request, request_size, std::move( cb ), options.timeout );
+  }
+  int call( const char* request, size_t request_size, Callback cb, std::chrono::milliseconds timeout ) {
+    uint32_t id;
+    int sock = -1;
+    if (connect() == 0) {
+      std::lock_guard<std::mutex> lock( mutex );
+      sock = fd;  // (-1 if it was lost again already)
+      if (0 <= sock) {
+        // register before sending:  the response can beat sendmsg() back
+        do {
+          id = next_id++;
+        } while (pending.count( id ));
+        Pending& p = pending[id];
+        p.cb = std::move( cb );
+        p.deadline = deadlines.end();
+        if (0 <= timeout.count()) {
+          bool earliest = deadlines.empty() || Clock::now() + timeout < deadlines.begin()->first;
+          p.deadline = deadlines.emplace( Clock::now() + timeout, id );
+          if (earliest)
+            wake();  // the reader is sleeping until a later deadline
+        }
+      }
+    }
+    if (sock < 0) {
+      cb( RPCStatus::DISCONNECTED, nullptr, 0 );  // not under mutex:  cb may well call() again
+      return 1;
+    }
+
+    char header[MAX_FRAME_HEADER + rpc_detail::HEADER];
+    size_t header_size = encodeFrameHeader( options.framing, rpc_detail::HEADER + request_size, header );
+    rpc_detail::encodeHeader( id, rpc_detail::REQUEST, header + header_size );
+    header_size += rpc_detail::HEADER;
+    if (write( sock, header, header_size, request, request_size ) != 0) {
+      complete( id, RPCStatus::DISCONNECTED, nullptr, 0 );
+      disconnect( "write failed", sock );
+      return 1;
+    }
+    return 0;
+  }
+
+  // send a request, and get the response through a future
+  std::future<Response> call( const char* request, size_t request_size ) {
+    return call( request, request_size, options.timeout );
+  }
+  std::future<Response> call( const char* request, size_t request_size, std::chrono::milliseconds timeout ) {
+    auto promise = std::make_shared<std::promise<Response>>();
+    std::future<Response> result = promise->get_future();
+    call( request, request_size, [promise]( RPCStatus status, const char* response, size_t response_size ) {
+      promise->set_value( Response{ status, std::string( response ? response : "", response_size ) } );
+    }, timeout );
+    return result;
+  }
+
+  // calls waiting for a response
+  size_t inFlight() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return pending.size();
+  }
+
+  const Endpoint endpoint;
+  const Options options;
+
+private:
+  struct Pending {
+    Callback cb;
+    std::multimap<Clock::time_point, uint32_t>::iterator deadline;
+  };
+
+  void start() {
+    if (::pipe( wake_pipe ) < 0) {
+      fprintf( stderr, "pipe failed.  Error code: %s\n", strerror(errno) );
+      wake_pipe[0] = wake_pipe[1] = -1;
+    } else {
+      ::fcntl( wake_pipe[0], F_SETFL, ::fcntl( wake_pipe[0], F_GETFL, 0 ) | O_NONBLOCK );
+      ::fcntl( wake_pipe[1], F_SETFL, ::fcntl( wake_pipe[1], F_GETFL, 0 ) | O_NONBLOCK );
+    }
+    reader = std::thread( [this]() { readLoop(); } );
+  }
+
+  void wake() {
+    char c = 0;
+    if (::write( wake_pipe[1], &c, 1 ) < 0) {}  // full is fine:  the reader is waking up anyway
+  }
+
+  // resolve and connect (blocking, no locks held).  returns the socket, or -1
+  int openSocket() {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    int err = ::getaddrinfo( endpoint.host.c_str(), std::to_string( endpoint.port ).c_str(), &hints, &res );
+    if (err != 0) {
+      fprintf( stderr, "getaddrinfo(%s) failed.  Error: %s\n", endpoint.str().c_str(), gai_strerror( err ) );
+      return -1;
+    }
+    int sock = -1;
+    for (addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+      sock = ::socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+      if (sock < 0)
+        continue;
+      if (::connect( sock, ai->ai_addr, ai->ai_addrlen ) == 0)
+        break;
+      ::close( sock );
+      sock = -1;
+    }
+    ::freeaddrinfo( res );
+    if (sock < 0) {
+      fprintf( stderr, "Connection to %s failed.  Error code: %s\n", endpoint.str().c_str(), strerror(errno) );
+      return -1;
+    }
+
+    int opt = 1;
+    ::setsockopt( sock, SOL_SOCKET, SO_KEEPALIVE, (char*)&opt, sizeof(opt) );
+#if defined( SO_NOSIGPIPE )
+    ::setsockopt( sock, SOL_SOCKET, SO_NOSIGPIPE, (char*)&opt, sizeof(opt) );
+#endif
+    if (options.nodelay)
+      ::setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(opt) );
+    return sock;
+  }
+
+  // whole request in one sendmsg() (when it fits), so pipelined calls from several threads don't interleave
+  int write( int sock, const char* header, size_t header_size, const char* msg, size_t msg_size ) {
+    iovec iov[2] = { { (void*)header, header_size }, { (void*)msg, msg_size } };
+    msghdr mh = {};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+#if defined( MSG_NOSIGNAL )
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    std::lock_guard<std::mutex> lock( write_mutex );
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      if (fd != sock)
+        return 1;  // disconnected since the call was registered
+    }
+    size_t left = header_size + msg_size;
+    while (0 < left) {
+      ssize_t n = ::sendmsg( sock, &mh, flags );
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        fprintf( stderr, "RPC request to %s failed.  Error code: %s\n", endpoint.str().c_str(), strerror(errno) );
+        return 1;
+      }
+      left -= n;
+      while (0 < n) {
+        size_t done = std::min( (size_t)n, mh.msg_iov->iov_len );
+        mh.msg_iov->iov_base = (char*)mh.msg_iov->iov_base + done;
+        mh.msg_iov->iov_len -= done;
+        n -= done;
+        if (mh.msg_iov->iov_len == 0) {
+          ++mh.msg_iov;
+          --mh.msg_iovlen;
+        }
+      }
+    }
+    return 0;
+  }
+
+  // finish one call, if it's still waiting
+  void complete( uint32_t id, RPCStatus status, const char* response, size_t response_size ) {
+    Callback cb;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      auto it = pending.find( id );
+      if (it == pending.end())
+        return;  // timed out already
+      cb = std::move( it->second.cb );
+      if (it->second.deadline != deadlines.end())
+        deadlines.erase( it->second.deadline );
+      pending.erase( it );
+    }
+    cb( status, response, response_size );
+  }
+
+  // close the socket (sock, if it's still the current one, or whichever is open:  -1), failing everything in flight.
+  // waits for a write in progress, so the socket isn't closed (and its number reused) under it
+  void disconnect( const char* why, int sock ) {
+    std::map<uint32_t, Pending> failed;
+    {
+      std::lock_guard<std::mutex> wlock( write_mutex );
+      std::lock_guard<std::mutex> lock( mutex );
+      if (0 <= sock && sock != fd)
+        return;  // already replaced by a new connection
+      if (0 <= fd) {
+        ::close( fd );
+        fd = -1;
+      }
+      failed.swap( pending );
+      deadlines.clear();
+    }
+    if (!failed.empty() && !stopping)
+      fprintf( stderr, "RPC connection to %s lost (%s), failing %zu calls.\n", endpoint.str().c_str(), why, failed.size() );
+    for (auto& it : failed)
+      it.second.cb( RPCStatus::DISCONNECTED, nullptr, 0 );
+  }
+
+  void expire() {
+    std::vector<Callback> expired;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      auto now = Clock::now();
+      while (!deadlines.empty() && deadlines.begin()->first <= now) {
+        auto it = pending.find( deadlines.begin()->second );
+        expired.push_back( std::move( it->second.cb ) );
+        pending.erase( it );
+        deadlines.erase( deadlines.begin() );
+      }
+    }
+    for (auto& cb : expired)
+      cb( RPCStatus::TIMEOUT, nullptr, 0 );
+  }
+
+  void onFrame( const char* frame, size_t frame_size ) {
+    if (frame_size < rpc_detail::HEADER)
+      return;
+    uint8_t kind = (uint8_t)frame[4];
+    if (kind != rpc_detail::RESPONSE && kind != rpc_detail::ERROR)
+      return;
+    complete( rpc_detail::decodeId( frame ), kind == rpc_detail::RESPONSE ? RPCStatus::OK : RPCStatus::ERROR,
+              frame + rpc_detail::HEADER, frame_size - rpc_detail::HEADER );
+  }
+
+  // one thread reads every response, and fires the timeouts
+  void readLoop() {
+    RingBuffer ring( 16 * 1024 );
+    int ring_sock = -1;
+    while (!stopping) {
+      int sock, timeout = -1;
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        sock = fd;
+        if (!deadlines.empty()) {
+          auto wait = std::chrono::duration_cast<std::chrono::milliseconds>( deadlines.begin()->first - Clock::now() );
+          timeout = wait.count() < 0 ? 0 : (int)wait.count() + 1;
+        }
+      }
+      if (sock != ring_sock) {
+        ring.clear();  // new connection, start clean
+        ring_sock = sock;
+      }
+
+      pollfd fds[2] = { { wake_pipe[0], POLLIN, 0 }, { sock, POLLIN, 0 } };
+      int n = ::poll( fds, sock < 0 ? 1 : 2, timeout );
+      if (n < 0 && errno != EINTR) {
+        fprintf( stderr, "poll failed.  Error code: %s\n", strerror(errno) );
+        break;
+      }
+      if (0 < n && (fds[0].revents & POLLIN)) {
+        char drain[64];
+        while (0 < ::read( wake_pipe[0], drain, sizeof( drain ) )) {}
+      }
+      if (0 < n && 0 <= sock && fds[1].revents) {
+        ssize_t len = -1;
+        if (ring.reserve( 4096 ))
+          len = ::recv( sock, ring.writePtr(), ring.writable(), 0 );
+        if (0 < len) {
+          ring.commit( len );
+          if (deliverFrames( options.framing, ring, options.max_frame_size, [this]( const char* frame, size_t frame_size ) {
+                onFrame( frame, frame_size );
+              }) < 0)
+            disconnect( "bad frame", sock );
+        } else if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
+          disconnect( len == 0 ? "closed by peer" : strerror(errno), sock );
+        }
+      }
+      expire();
+    }
+  }
+
+  std::mutex mutex;        // fd, pending, deadlines
+  std::mutex write_mutex;  // one request on the wire at a time (taken before mutex)
+  std::mutex connect_mutex;  // one connect() at a time (taken before mutex, never held by the reader)
+  int fd = -1;
+  uint32_t next_id = 1;
+  std::map<uint32_t, Pending> pending;
+  std::multimap<Clock::time_point, uint32_t> deadlines;
+  int wake_pipe[2] = { -1, -1 };
+  std::atomic<bool> stopping{ false };
+  std::thread reader;
+};
+
+// reply to one request.  copyable, so a handler can hand it to another thread and reply later.
+// once the connection has closed replying fails, even if a new client got the same socket number
+class RPCReply {
+public:
+  RPCReply( TCP& tcp, int conn, uint64_t generation, uint32_t id ) : tcp( &tcp ), conn( conn ), generation( generation ), id( id ) {}
+
+  // returns 0 on success, 1 on error
+  int operator()( const char* response, size_t response_size, RPCStatus status = RPCStatus::OK ) const {
+    char header[rpc_detail::HEADER];
+    rpc_detail::encodeHeader( id, status == RPCStatus::OK ? rpc_detail::RESPONSE : rpc_detail::ERROR, header );
+    return tcp->reply( conn, generation, header, sizeof( header ), response, response_size );
+  }
+  int operator()( const std::string& response, RPCStatus status = RPCStatus::OK ) const {
+    return (*this)( response.data(), response.size(), status );
+  }
+
+  int connection() const { return conn; }
+  uint32_t stream() const { return id; }
+
+private:
+  TCP* tcp;
+  int conn;
+  uint64_t generation;
+  uint32_t id;
+};
+
+class RPCServer {
+public:
+  // called for each request (from the receive thread).  the request span is only valid during the call
+  using Handler = std::function<void(const char* request, size_t request_size, RPCReply reply)>;
+  Handler handler;
+
+  // the listener:  port, reactor, shards, busy_poll, ... (framing must match the clients', and not be NONE)
+  TCP tcp;
+
+  RPCServer() {
+    tcp.framing = Framing::U32;
+    tcp.recvCallbacks = { [this]( int conn, const char* frame, size_t frame_size ) {
+      if (frame_size < rpc_detail::HEADER || (uint8_t)frame[4] != rpc_detail::REQUEST || !handler)
+        return;
+      handler( frame + rpc_detail::HEADER, frame_size - rpc_detail::HEADER, RPCReply( tcp, conn, tcp.generation( conn ), rpc_detail::decodeId( frame ) ) );
+    } };
+  }
+  RPCServer( const RPCServer& ) = delete;
+  RPCServer& operator=( const RPCServer& ) = delete;
+
+  // serve forever (see TCP::recv())
+  int serve() {
+    return tcp.recv();
+  }
+};
+
+#endif
+#endif
@@ -0,0 +1,482 @@
+#ifndef SUBA_NET_RELIABLEUDP
+#define SUBA_NET_RELIABLEUDP
+
+// Reliable messaging over UDP (posix only), between two peers
+// - up to 256 independent channels, each ordered (like TCP, but a loss only holds up its own channel) or unordered
+//   (every message is delivered once, as soon as it arrives)
+// - per channel sequence numbers, cumulative + selective ACKs (64 packets past the first hole), sent once per batch
+// - fast retransmit once dupthresh later packets are SACKed, RTO from the smoothed RTT otherwise (RFC 6298).
+//   every transmission carries a timestamp the ACK echoes (like TCP timestamps), so retransmits still give RTT samples
+// - each open() picks a random session id.  a receiver seeing a new one (the peer restarted, or this side did) starts
+//   the channel over from the sender's base, the oldest seq it still has unacked
+//
+//   DATA:  [1: u8][channel: u8][session: u32][seq: u32][base: u32 (everything before it was acked)]
+//          [timestamp: u32 (sender's clock, us)][payload]
+//   ACK:   [2: u8][channel: u8][session: u32 (the DATA's)][cumulative: u32 (everything before it arrived)]
+//          [sack: u64 (bit i:  cumulative+1+i)][echo: u32 (timestamp of the latest DATA received)]
+// (all big endian)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "platform_check.h"
+#include "UDPBatch.h"
+
+class ReliableUDP {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    size_t window = 1024;         // packets in flight per channel (more are queued until acked)
+    size_t max_payload = 1200;    // larger messages are refused (keeps datagrams under a typical MTU)
+    std::chrono::microseconds initial_rto{ 200000 };
+    std::chrono::microseconds min_rto{ 10000 };
+    std::chrono::microseconds max_rto{ 2000000 };
+    int dupthresh = 3;            // fast retransmit a hole once this many packets after it were SACKed
+  };
+
+  struct Stats {
+    uint64_t sent = 0, retransmits = 0, fast_retransmits = 0, timeouts = 0;
+    uint64_t received = 0, duplicates = 0, delivered = 0;
+    size_t unacked = 0;     // sent (or queued), not acked yet
+    uint32_t srtt_us = 0;   // smoothed round trip time (the latest sampled channel)
+    uint32_t rto_us = 0;
+  };
+
+  // message callback:  channel, payload (only valid during the call).  called from the receive thread
+  using Callback = std::function<void(uint8_t channel, const char* data, size_t size)>;
+  std::vector<Callback> recvCallbacks;
+
+  ReliableUDP( uint16_t local_port, const std::string& peer_host, uint16_t peer_port ) : local_port( local_port ), peer_host( peer_host ), peer_port( peer_port ) {}
+  ReliableUDP( uint16_t local_port, const std::string& peer_host, uint16_t peer_port, const Options& opts ) : local_port( local_port ), peer_host( peer_host ), peer_port( peer_port ), options( opts ) {}
+  ~ReliableUDP() { close(); }
+  ReliableUDP( const ReliableUDP& ) = delete;
+  ReliableUDP& operator=( const ReliableUDP& ) = delete;
+
+  // channels are ordered unless set otherwise (both peers should agree, only the receiving side uses it).
+  // call before open()
+  void setOrdered( uint8_t channel, bool ordered ) { recv_channels[channel].ordered = ordered; }
+
+  // bind local_port, connect to the peer, and start the receive thread.  returns 0 on success, 1 on error
+  int open() {
+    if (0 <= fd)
+      return 0;
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* res = nullptr;
+    int err = ::getaddrinfo( peer_host.c_str(), std::to_string( peer_port ).c_str(), &hints, &res );
+    if (err != 0 || res == nullptr) {
+      fprintf( stderr, "getaddrinfo(%s:%u) failed.  Error: %s\n", peer_host.c_str(), peer_port, gai_strerror( err ) );
+      return 1;
+    }
+    sockaddr_in peer;
+    memcpy( &peer, res->ai_addr, sizeof( peer ) );
+    ::freeaddrinfo( res );
+
+    int sock = ::socket( AF_INET, SOCK_DGRAM, 0 );
+    if (sock < 0) {
+      fprintf( stderr, "Socket creation failed.  Error code: %s\n", strerror(errno) );
+      return 1;
+    }
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( local_port );
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (::bind( sock, (sockaddr*)&addr, sizeof( addr ) ) < 0 || ::connect( sock, (sockaddr*)&peer, sizeof( peer ) ) < 0) {
+      fprintf( stderr, "bind/connect failed.  Error code: %s\n", strerror(errno) );
+      ::close( sock );
+      return 1;
+    }
+    if (::pipe( wake_pipe ) < 0) {
+      fprintf( stderr, "pipe failed.  Error code: %s\n", strerror(errno) );
+      ::close( sock );
+      return 1;
+    }
+    ::fcntl( wake_pipe[0], F_SETFL, ::fcntl( wake_pipe[0], F_GETFL, 0 ) | O_NONBLOCK );
+    ::fcntl( wake_pipe[1], F_SETFL, ::fcntl( wake_pipe[1], F_GETFL, 0 ) | O_NONBLOCK );
+    std::random_device rd;
+    do {
+      session = rd();
+    } while (session == 0);  // (0:  a receive channel that hasn't seen any)
+    fd = sock;
+    stopping = false;
+    thread = std::thread( [this]() { loop(); } );
+    return 0;
+  }
+
+  // stop the receive thread and close the socket (unacked messages are abandoned)
+  void close() {
+    if (fd < 0)
+      return;
+    stopping = true;
+    wake();
+    if (thread.joinable())
+      thread.join();
+    ::close( fd );
+    ::close( wake_pipe[0] );
+    ::close( wake_pipe[1] );
+    fd = -1;
+  }
+
+  // queue a message on a channel, and send it once the channel's window has room.
+  // returns 0 on success, 1 on error (not open, or larger than max_payload)
+  int send( uint8_t channel, const char* msg, size_t msg_size ) {
+    if (fd < 0 || options.max_payload < msg_size)
+      return 1;
+    std::lock_guard<std::mutex> lock( mutex );
+    SendChannel& ch = send_channels[channel];
+    if (ch.rto.count() == 0)
+      ch.rto = options.initial_rto;
+    uint32_t seq = ch.base + (uint32_t)ch.queue.size();
+    ch.queue.emplace_back();
+    Outstanding& o = ch.queue.back();
+    o.packet.resize( DATA_HEADER + msg_size );
+    o.packet[0] = DATA;
+    o.packet[1] = (char)channel;
+    put32( &o.packet[6], seq );  // (session, base and timestamp are stamped on each transmission)
+    if (msg_size)
+      memcpy( &o.packet[DATA_HEADER], msg, msg_size );
+    ++unacked_total;
+    bool idle = ch.in_flight == 0;
+    transmitLocked( ch );
+    // the receive thread may be sleeping up to max_rto:  have it set the retransmit timer for this one
+    if (idle && 0 < ch.in_flight)
+      wake();
+    return 0;
+  }
+
+  // wait until everything sent has been acked.  returns true if it was, false on timeout
+  bool waitAcked( std::chrono::milliseconds timeout ) {
+    std::unique_lock<std::mutex> lock( mutex );
+    return acked_cv.wait_for( lock, timeout, [this]() { return unacked_total == 0; } );
+  }
+
+  Stats stats() {
+    std::lock_guard<std::mutex> lock( mutex );
+    Stats s = counters;
+    s.unacked = unacked_total;
+    s.received = received;
+    s.duplicates = duplicates;
+    s.delivered = delivered;
+    return s;
+  }
+
+  const uint16_t local_port;
+  const std::string peer_host;
+  const uint16_t peer_port;
+  const Options options;
+
+private:
+  enum : uint8_t { DATA = 1, ACK = 2 };
+  static const size_t DATA_HEADER = 18;
+  static const size_t ACK_SIZE = 22;
+  static const int SACK_BITS = 64;
+
+  struct Outstanding {
+    std::string packet;
+    Clock::time_point sent;
+    bool sacked = false;
+    bool fast_retransmitted = false;
+  };
+
+  // sender side:  queue[i] has seq base + i, the first in_flight of them have been sent
+  struct SendChannel {
+    uint32_t base = 0;
+    size_t in_flight = 0;
+    std::deque<Outstanding> queue;
+    bool have_rtt = false;
+    std::chrono::microseconds srtt{ 0 }, rttvar{ 0 }, rto{ 0 };
+    int backoff = 1;
+  };
+
+  // receiver side (only touched by the receive thread)
+  struct RecvChannel {
+    bool ordered = true;
+    uint32_t session = 0;                       // the sender's (0:  none yet)
+    uint32_t retired = 0;                       // the one before (its stragglers are ignored)
+    uint32_t expected = 0;                      // every seq before this has arrived (and been delivered, if ordered)
+    std::map<uint32_t, std::string> early;      // arrived past a hole (unordered:  already delivered, just marked)
+    bool ack_due = false;
+    uint32_t echo = 0;                          // timestamp of the latest DATA, for the next ACK
+  };
+
+  void wake() {
+    char c = 0;
+    if (::write( wake_pipe[1], &c, 1 ) < 0) {}  // (full:  a wake up is pending anyway)
+  }
+
+  static void put32( char* p, uint32_t v ) { v = htonl( v ); memcpy( p, &v, 4 ); }
+  static uint32_t get32( const char* p ) { uint32_t v; memcpy( &v, p, 4 ); return ntohl( v ); }
+  static int32_t diff( uint32_t a, uint32_t b ) { return (int32_t)(a - b); }  // wrap safe a - b
+  uint32_t timestamp() const { return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>( Clock::now() - epoch ).count(); }
+
+  void transmitLocked( SendChannel& ch ) {
+    while (ch.in_flight < ch.queue.size() && ch.in_flight < options.window) {
+      Outstanding& o = ch.queue[ch.in_flight++];
+      writePacketLocked( ch, o );
+      ++counters.sent;
+    }
+  }
+
+  void writePacketLocked( const SendChannel& ch, Outstanding& o ) {
+    o.sent = Clock::now();
+    put32( &o.packet[2], session );
+    put32( &o.packet[10], ch.base );
+    put32( &o.packet[14], timestamp() );
+    if (::send( fd, o.packet.data(), o.packet.size(), 0 ) < 0 && errno != ECONNREFUSED && errno != EAGAIN && errno != ENOBUFS)
+      fprintf( stderr, "ReliableUDP send failed.  Error code: %s\n", strerror(errno) );
+    // (lost locally or not, the retransmit timer covers it)
+  }
+
+  std::chrono::microseconds effectiveRto( const SendChannel& ch ) const {
+    return std::min( ch.rto * ch.backoff, std::chrono::duration_cast<std::chrono::microseconds>( options.max_rto ) );
+  }
+
+  // RFC 6298
+  void sampleRtt( SendChannel& ch, std::chrono::microseconds r ) {
+    if (!ch.have_rtt) {
+      ch.srtt = r;
+      ch.rttvar = r / 2;
+      ch.have_rtt = true;
+    } else {
+      auto delta = ch.srtt < r ? r - ch.srtt : ch.srtt - r;
+      ch.rttvar = (3 * ch.rttvar + delta) / 4;
+      ch.srtt = (7 * ch.srtt + r) / 8;
+    }
+    ch.rto = std::max( options.min_rto, std::min( options.max_rto, ch.srtt + 4 * ch.rttvar ) );
+    counters.srtt_us = (uint32_t)ch.srtt.count();
+    counters.rto_us = (uint32_t)ch.rto.count();
+  }
+
+  void onAck( uint8_t channel, uint32_t acked_session, uint32_t cumulative, uint64_t sack, uint32_t echo ) {
+    if (acked_session != session)
+      return;  // acks what an earlier open() sent
+    std::lock_guard<std::mutex> lock( mutex );
+    auto it = send_channels.find( channel );
+    if (it == send_channels.end())
+      return;
+    SendChannel& ch = it->second;
+    int32_t rtt = diff( timestamp(), echo );
+    if (0 <= rtt)
+      sampleRtt( ch, std::chrono::microseconds( rtt ) );
+
+    // cumulative:  drop everything before it
+    int32_t advanced = diff( cumulative, ch.base );
+    if (0 < advanced && (size_t)advanced <= ch.in_flight) {
+      ch.queue.erase( ch.queue.begin(), ch.queue.begin() + advanced );
+      ch.base = cumulative;
+      ch.in_flight -= advanced;
+      unacked_total -= advanced;
+      ch.backoff = 1;
+      if (unacked_total == 0)
+        acked_cv.notify_all();
+    }
+
+    // selective:  mark what arrived past the hole, and fast retransmit holes with dupthresh SACKed packets after them
+    int32_t offset = diff( cumulative, ch.base );  // 0, unless this ACK is older than one already processed
+    if (offset < 0 || sack == 0)
+      return transmitLocked( ch );
+    int highest = -1;
+    for (int i = 0; i < SACK_BITS; ++i) {
+      size_t idx = offset + 1 + i;
+      if (ch.in_flight <= idx)
+        break;
+      if (sack & (1ull << i)) {
+        ch.queue[idx].sacked = true;
+        highest = (int)idx;
+      }
+    }
+    int sacked_after = 0;
+    for (int idx = highest; (size_t)offset <= (size_t)idx && 0 <= idx; --idx) {
+      Outstanding& o = ch.queue[idx];
+      if (o.sacked) {
+        ++sacked_after;
+      } else if (options.dupthresh <= sacked_after && !o.fast_retransmitted) {
+        o.fast_retransmitted = true;
+        writePacketLocked( ch, o );
+        ++counters.fast_retransmits;
+      }
+    }
+    transmitLocked( ch );
+  }
+
+  // retransmit timer (RFC 6298):  when the oldest unacked packet has been out longer than the RTO, resend just that one
+  // and back off (SACK / fast retransmit repair the holes after it).  returns the time until the next check is due
+  std::chrono::microseconds checkTimers() {
+    std::lock_guard<std::mutex> lock( mutex );
+    auto now = Clock::now();
+    auto next = std::chrono::microseconds( options.max_rto );
+    for (auto& it : send_channels) {
+      SendChannel& ch = it.second;
+      for (size_t i = 0; i < ch.in_flight; ++i) {
+        Outstanding& o = ch.queue[i];
+        if (o.sacked)
+          continue;
+        auto rto = effectiveRto( ch );
+        auto age = std::chrono::duration_cast<std::chrono::microseconds>( now - o.sent );
+        if (rto <= age) {
+          writePacketLocked( ch, o );
+          ++counters.retransmits;
+          ++counters.timeouts;
+          ch.backoff = std::min( ch.backoff * 2, 64 );
+          age = std::chrono::microseconds( 0 );
+          rto = effectiveRto( ch );
+        }
+        next = std::min( next, rto - age );
+        break;
+      }
+    }
+    return next;
+  }
+
+  void onData( uint8_t channel, uint32_t sender_session, uint32_t seq, uint32_t base, uint32_t stamp, const char* payload, size_t size ) {
+    RecvChannel& ch = recv_channels[channel];
+    if (sender_session != ch.session) {
+      if (sender_session == ch.retired)
+        return;
+      // a new session:  everything before its sender's base was acked already (by an earlier open() on one side or
+      // the other), start over from there
+      ch.retired = ch.session;
+      ch.session = sender_session;
+      ch.expected = base;
+      ch.early.clear();
+    }
+    ch.ack_due = true;
+    ch.echo = stamp;
+    ++received;
+    int32_t ahead = diff( seq, ch.expected );
+    if (ahead < 0 || (0 < ahead && ch.early.count( seq ))) {
+      ++duplicates;
+      return;
+    }
+    if ((int64_t)options.window * 4 < ahead)
+      return;  // far past anything the sender can have in flight:  garbage
+    if (ahead == 0) {
+      deliver( channel, payload, size );
+      ++ch.expected;
+      // release what was waiting on this one
+      for (auto e = ch.early.find( ch.expected ); e != ch.early.end() && e->first == ch.expected; e = ch.early.find( ch.expected )) {
+        if (ch.ordered)
+          deliver( channel, e->second.data(), e->second.size() );
+        ch.early.erase( e );
+        ++ch.expected;
+      }
+    } else if (ch.ordered) {
+      ch.early.emplace( seq, std::string( payload, size ) );
+    } else {
+      deliver( channel, payload, size );
+      ch.early.emplace( seq, std::string() );
+    }
+  }
+
+  void deliver( uint8_t channel, const char* data, size_t size ) {
+    ++delivered;
+    for (auto& func : recvCallbacks)
+      func( channel, data, size );
+  }
+
+  void sendAcks() {
+    for (auto& it : recv_channels) {
+      RecvChannel& ch = it.second;
+      if (!ch.ack_due)
+        continue;
+      ch.ack_due = false;
+      uint64_t sack = 0;
+      for (auto e = ch.early.upper_bound( ch.expected ); e != ch.early.end(); ++e) {
+        int32_t bit = diff( e->first, ch.expected ) - 1;
+        if (SACK_BITS <= bit)
+          break;
+        sack |= 1ull << bit;
+      }
+      char ack[ACK_SIZE];
+      ack[0] = ACK;
+      ack[1] = (char)it.first;
+      put32( &ack[2], ch.session );
+      put32( &ack[6], ch.expected );
+      put32( &ack[10], (uint32_t)(sack >> 32) );
+      put32( &ack[14], (uint32_t)sack );
+      put32( &ack[18], ch.echo );
+      ::send( fd, ack, sizeof( ack ), 0 );
+    }
+  }
+
+  void loop() {
+    RecvBatch batch( 64, 2048 );
+    while (!stopping) {
+      auto next = checkTimers();
+      int timeout = (int)((next.count() + 999) / 1000);
+      pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } };
+      int n = ::poll( fds, 2, std::max( timeout, 1 ) );
+      if (n < 0 && errno != EINTR) {
+        fprintf( stderr, "poll failed.  Error code: %s\n", strerror(errno) );
+        break;
+      }
+      if (n <= 0)
+        continue;
+      if (fds[1].revents & POLLIN) {
+        char drain[64];
+        while (0 < ::read( wake_pipe[0], drain, sizeof( drain ) )) {}
+      }
+      if (fds[0].revents & POLLERR) {
+        // e.g. ICMP port unreachable (the peer isn't up yet):  until it's read, poll() reports it again right away
+        int err = 0;
+        socklen_t len = sizeof( err );
+        ::getsockopt( fd, SOL_SOCKET, SO_ERROR, (char*)&err, &len );
+      }
+      if (!(fds[0].revents & POLLIN))
+        continue;
+      // drain the socket, then answer everything received with one ACK per channel
+      int received_now;
+      while (0 < (received_now = batch.recv( fd, MSG_DONTWAIT ))) {
+        for (int i = 0; i < received_now; ++i) {
+          const char* p = batch.data( i );
+          size_t len = batch.length( i );
+          if (DATA_HEADER <= len && p[0] == DATA)
+            onData( (uint8_t)p[1], get32( p + 2 ), get32( p + 6 ), get32( p + 10 ), get32( p + 14 ), p + DATA_HEADER, len - DATA_HEADER );
+          else if (len == ACK_SIZE && p[0] == ACK)
+            onAck( (uint8_t)p[1], get32( p + 2 ), get32( p + 6 ), ((uint64_t)get32( p + 10 ) << 32) | get32( p + 14 ), get32( p + 18 ) );
+        }
+      }
+      sendAcks();
+    }
+  }
+
+  const Clock::time_point epoch = Clock::now();
+  int fd = -1;
+  int wake_pipe[2] = { -1, -1 };
+  std::atomic<bool> stopping{ false };
+  std::thread thread;
+
+  std::mutex mutex;  // send side:  send_channels, counters
+  std::condition_variable acked_cv;
+  std::map<uint8_t, SendChannel> send_channels;
+  size_t unacked_total = 0;
+  Stats counters;
+
+  std::map<uint8_t, RecvChannel> recv_channels;
+  std::atomic<uint64_t> received{ 0 }, duplicates{ 0 }, delivered{ 0 };  // written by the receive thread, read by stats()
+  uint32_t session = 0;  // this open()'s
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef SUBA_NET_RINGBUFFER
+#define SUBA_NET_RINGBUFFER
+
+// Growable byte ring buffer
+//
+// Readable and writable regions are always contiguous, so a socket can recv() straight into writePtr(),
+// and a complete message can be handed out as a (pointer, size) span into the buffer without copying.
+// - posix:  the ring is mapped twice, back to back (a "mirrored" ring), so data wrapping past the end
+//           also appears after it.  nothing is ever moved, except when growing.
+// - other:  a plain heap buffer, compacted (unread bytes moved to the front) when the tail runs out.
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <utility>
+#include "platform_check.h"
+
+#if IS_POSIX==1
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#endif
+
+class RingBuffer {
+public:
+  RingBuffer( size_t capacity = 64 * 1024 ) { allocate( capacity ); }
+  ~RingBuffer() { release( base, cap, mirrored ); }
+  RingBuffer( const RingBuffer& ) = delete;
+  RingBuffer& operator=( const RingBuffer& ) = delete;
+
+  // unread bytes
+  const char* readPtr() const { return base + head; }
+  size_t readable() const { return used; }
+
+  // mark n bytes as read
+  void consume( size_t n ) {
+    head += n;
+    used -= n;
+    if (used == 0)
+      head = 0;
+    else if (mirrored && cap <= head)
+      head -= cap;
+  }
+
+  // free space, to recv() into
+  char* writePtr() const { return mirrored ? base + (head + used) % cap : base + head + used; }
+  size_t writable() const { return mirrored ? cap - used : cap - head - used; }
+
+  // mark n bytes (written at writePtr()) as readable
+  void commit( size_t n ) { used += n; }
+
+  // make sure writable() >= n, growing (or compacting) the buffer when needed.
+  // spans previously returned by readPtr() are invalidated if this moves data.
+  bool reserve( size_t n ) {
+    if (n <= writable())
+      return true;
+    if (!mirrored && used + n <= cap) {
+      std::memmove( base, base + head, used );
+      head = 0;
+      return true;
+    }
+    char* old_base = base;
+    size_t old_cap = cap, old_head = head;
+    bool old_mirrored = mirrored;
+    size_t new_cap = cap;
+    while (new_cap < used + n)
+      new_cap *= 2;
+    if (!allocate( new_cap )) {
+      base = old_base; cap = old_cap; mirrored = old_mirrored;
+      return false;
+    }
+    std::memcpy( base, old_base + old_head, used );  // contiguous in both layouts
+    head = 0;
+    release( old_base, old_cap, old_mirrored );
+    return true;
+  }
+
+  size_t capacity() const { return cap; }
+  void clear() { head = 0; used = 0; }
+
+private:
+  bool allocate( size_t capacity ) {
+#if IS_POSIX==1
+    size_t page = (size_t)::sysconf( _SC_PAGESIZE );
+    capacity = (capacity + page - 1) / page * page;
+    if (char* p = mapMirrored( capacity )) {
+      base = p; cap = capacity; mirrored = true;
+      return true;
+    }
+#endif
+    char* p = (char*)std::malloc( capacity );
+    if (p == nullptr)
+      return false;
+    base = p; cap = capacity; mirrored = false;
+    return true;
+  }
+
+  static void release( char* p, size_t capacity, bool was_mirrored ) {
+    if (p == nullptr)
+      return;
+#if IS_POSIX==1
+    if (was_mirrored) {
+      ::munmap( p, capacity * 2 );
+      return;
+    }
+#endif
+    std::free( p );
+  }
+
+#if IS_POSIX==1
+  // map the same (anonymous shared) memory twice, back to back.  returns nullptr on failure.
+  static char* mapMirrored( size_t capacity ) {
+#if defined(__linux__)
+    int fd = ::memfd_create( "ringbuffer", MFD_CLOEXEC );
+#else
+    char name[64];
+    snprintf( name, sizeof( name ), "/ringbuffer.%d.%p", (int)::getpid(), (void*)&name );
+    int fd = ::shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0600 );
+    if (0 <= fd)
+      ::shm_unlink( name );
+#endif
+    if (fd < 0)
+      return nullptr;
+    if (::ftruncate( fd, capacity ) < 0) {
+      ::close( fd );
+      return nullptr;
+    }
+    void* region = ::mmap( nullptr, capacity * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if (region == MAP_FAILED) {
+      ::close( fd );
+      return nullptr;
+    }
+    char* p = (char*)region;
+    if (::mmap( p, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0 ) == MAP_FAILED ||
+        ::mmap( p + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0 ) == MAP_FAILED) {
+      ::munmap( p, capacity * 2 );
+      ::close( fd );
+      return nullptr;
+    }
+    ::close( fd );
+    return p;
+  }
+#endif
+
+  char* base = nullptr;
+  size_t cap = 0;
+  size_t head = 0;      // read offset
+  size_t used = 0;      // readable bytes
+  bool mirrored = false;
+};
+
+#endif
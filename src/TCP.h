@@ -1,17 +1,288 @@
 
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
 #include "platform_check.h"
+#include "Framing.h"
+#include "TCPStats.h"
+#include "BusyPoll.h"
+#if IS_POSIX==1 && HAS_ASIO==0
+#include <memory>
+#include <unordered_map>
+#include "TCPConnection.h"
+#include "PacketRing.h"
+#endif
 
 class TCP {
 public:
-    int recv();
-    int send( const char* msg, size_t msg_size );
+  TCP() {
+    // setup defaults (can be overridden)
+    recvCallbacks.push_back( printf_cb );
+#if IS_POSIX==1 && HAS_ASIO==0
+    handoff.options.slot_size = 16 * 1024;  // a read's worth
+#endif
+  }
+  int recv();
+  int send( const char* msg, size_t msg_size );
+
+  // write out anything send() has queued (when batching: pool.options.batch)
+  int flush();
+
+  // open the connection to host:port ahead of the first send(), so it doesn't pay for the handshake.
+  // (posix pool only, the other backends connect per send())
+  int prewarm();
+
+#if IS_POSIX==1 && HAS_ASIO==0
+  // stream part of a file (or a pipe/socket) without copying it through userspace, see TCPConnection::sendFile()
+  int sendFile( int file_fd, off_t offset, size_t len );
+
+  // send a large buffer without copying it (MSG_ZEROCOPY), see TCPConnection::sendZeroCopy().
+  // owner keeps the buffer alive until the kernel is done with it.
+  int sendZeroCopy( std::shared_ptr<const void> owner, const char* msg, size_t msg_size, TCPConnection::ReleaseCallback released = nullptr );
+
+  // write a message back on a connection we're receiving from (conn, as given to recvCallbacks), framed like send().
+  // callable from any thread.  never waits for the peer:  in reactor mode what the socket doesn't take right away
+  // is queued, and the receive loop writes it as the peer reads (up to max_reply_queue bytes per connection).
+  // conn is the connection open now under that socket; to reply later (after the callback returned), keep
+  // generation( conn ) too and use the overload below, so a reply can't reach a newer connection that reused the fd.
+  int reply( int conn, const char* msg, size_t msg_size ) {
+    return reply( conn, 0, nullptr, 0, msg, msg_size );
+  }
+  // ... with a prefix (e.g. a protocol header) in the same frame
+  int reply( int conn, const char* prefix, size_t prefix_size, const char* msg, size_t msg_size ) {
+    return reply( conn, 0, prefix, prefix_size, msg, msg_size );
+  }
+  // ... only if conn is still the connection generation identifies (0: any).  fails once that one has closed
+  int reply( int conn, uint64_t generation, const char* prefix, size_t prefix_size, const char* msg, size_t msg_size );
+
+  // identifies this particular connection on the conn socket (0 if none is open).  from a recvCallback:  the
+  // connection the data came from, even when the callbacks run behind the receive loop (handoff)
+  uint64_t generation( int conn );
+
+  size_t max_reply_queue = 64 * 1024 * 1024;  // reply() fails instead of queueing more for a peer that doesn't read
+#endif
+
+  std::string host = "127.0.0.1";  // send() destination
+  uint16_t port = 12345;           // send() destination port, and recv() listening port
+
+  // TCP Fast Open on the listener (posix, TCP_FASTOPEN):  accept data carried in the SYN, from up to this many
+  // connections still in the handshake (0: off).  Linux also needs server support in net.ipv4.tcp_fastopen (e.g. 3).
+  // (client side:  pool.options.fast_open)
+  int fast_open_queue = 0;
+
+#if IS_POSIX==1 && HAS_ASIO==0
+  // warm connections reused by send(), keyed by endpoint.
+  // pool.options bounds each connection's send queue (backpressure):  send() then returns TCPConnection::QUEUE_FULL
+  // instead of queueing more, depending on pool.options.queue_full
+  TCPPool pool;
+#endif
+
+  // message framing, for both send() and recv()
+  // NONE:  raw stream, recvCallbacks see each chunk as it was read (message boundaries are not preserved)
+  // U32 / VARINT:  send() length prefixes each message, recvCallbacks see exactly one whole message per call,
+  //                as a span into the connection's receive ring (only valid during the callback)
+  Framing framing = Framing::NONE;
+  uint64_t max_frame_size = 64 * 1024 * 1024;  // larger frames close the connection
+  size_t frame_buffer_size = 16 * 1024;        // initial per-connection receive ring (grows to fit the largest frame)
+
+  // connection data callback
+  // called for each chunk (or frame) read from a connection.  conn identifies the connection (its socket) until it closes.
+  using Callback = std::function<void(int conn, const char* buffer, size_t buffer_size)>;
+  std::vector<Callback> recvCallbacks;
+
+  // connection closed callback
+  // called once when a connection is closed (by the peer, or on error)
+  using CloseCallback = std::function<void(int conn)>;
+  std::vector<CloseCallback> closeCallbacks;
+
+  // reactor mode (posix + epoll only): serve all clients at once from the recv() thread, using edge triggered epoll
+  // (or io_uring, when built with it).
+  // when false (or unsupported on the platform), recv() serves one client at a time until it disconnects.
+  bool reactor = true;
+  int max_events = 256;  // epoll events handled per wakeup
+
+  // reactor mode, posix only: shards > 1 runs that many SO_REUSEPORT listeners on the port, each with its own
+  // event loop on its own thread (optionally pinned to a cpu), so accepting and reading scale across cores.
+  // NOTE: callbacks are then called from several threads at once.
+  int shards = 1;
+  bool pin_shards = false;
+
+  // low latency receive mode (posix):  spin on the sockets for busy_poll.budget before sleeping in epoll_wait()/recv(),
+  // with SO_BUSY_POLL set on each connection, and the recv() thread pinned to busy_poll.cpu (shards:  use pin_shards).
+  // uses the epoll reactor (not io_uring).  costs a cpu per receive thread.
+  BusyPoll busy_poll;
+
+  // print a status line for every message sent (turn off when sending a lot, e.g. benchmarks)
+  bool verbose = true;
+
+  // telemetry, receive side:  count bytes and messages per connection (send side:  pool.stats(), always on)
+  bool stats = false;
+
+  // the receiving connections' stats, by conn (TCP_INFO is sampled now)
+  std::map<int, TCPStats> recvStats() {
+    std::map<int, TCPStats> result;
+    {
+      std::lock_guard<std::mutex> lock( stats_mutex );
+      result = recv_stats;
+    }
+#if IS_POSIX==1
+    for (auto& it : result)
+      sampleTCPInfo( it.first, it.second );
+#endif
+    return result;
+  }
+
+  // every connection's stats as JSON:  {"in": [ received from ], "out": [ sent to (posix pool) ]}
+  std::string statsJson() {
+    std::string json = "{\"in\": [";
+    const char* sep = "";
+    for (auto& it : recvStats()) {
+      json += sep + it.second.json();
+      sep = ", ";
+    }
+    json += "], \"out\": [";
+#if IS_POSIX==1 && HAS_ASIO==0
+    sep = "";
+    for (auto& s : pool.stats()) {
+      json += sep + s.json();
+      sep = ", ";
+    }
+#endif
+    return json + "]}";
+  }
+
+  // built in data callback - for printf debugging or logging
+  Callback printf_cb = []( int conn, const char* buffer, size_t buffer_size ) {
+    printf( "Received message: %.*s\n", (int)buffer_size, buffer );
+  };
+
+#if IS_POSIX==1 && HAS_ASIO==0
+  // run the callbacks on consumer threads (handoff.options.consumers > 0):  the receive loop only reads and queues
+  // chunks (or frames) in a lock-free ring, so a slow callback doesn't stall every connection on the loop.
+  // a full ring makes the receive loop wait (nothing is dropped from a stream).  more than one consumer loses the
+  // order of a connection's data, so keep it at 1 unless the callbacks don't care.
+  struct Chunk {
+    int conn = -1;
+    bool closed = false;  // the connection's close, queued behind its data
+    uint64_t generation = 0;
+  };
+  Handoff<Chunk> handoff;
+#endif
+
+private:
+  // the dispatch*() side runs on the receive loop, deliver*() on the handoff consumers (or right after, without them)
+  void dispatch( int conn, const char* buffer, size_t buffer_size ) {
+    if (stats)
+      countIn( conn, buffer_size );  // here, in order with the close, while conn is still this connection
+#if IS_POSIX==1 && HAS_ASIO==0
+    if (handoff.enabled()) {
+      handoff.pushWait( Chunk{ conn, false, generation( conn ) }, buffer, buffer_size );
+      return;
+    }
+#endif
+    deliver( conn, buffer, buffer_size );
+  }
+  void deliver( int conn, const char* buffer, size_t buffer_size ) {
+    for (auto& func : recvCallbacks) {
+      func( conn, buffer, buffer_size );
+    }
+  }
+  // read side of framing: deliver every complete frame buffered for the connection.
+  // returns -1 when the stream is broken (bad header, or frame too large), and the connection should be closed
+  int dispatchFrames( int conn, RingBuffer& ring ) {
+    return deliverFrames( framing, ring, max_frame_size, [this, conn]( const char* buffer, size_t buffer_size ) {
+      dispatch( conn, buffer, buffer_size );
+    });
+  }
+  void dispatchClose( int conn ) {
+    if (stats) {
+      std::lock_guard<std::mutex> lock( stats_mutex );
+      recv_stats.erase( conn );
+    }
+#if IS_POSIX==1 && HAS_ASIO==0
+    closeConn( conn );  // now, before the socket is closed and its number reused
+    if (handoff.enabled()) {
+      handoff.pushWait( Chunk{ conn, true }, nullptr, 0 );
+      return;
+    }
+#endif
+    deliverClose( conn );
+  }
+  void deliverClose( int conn ) {
+    for (auto& func : closeCallbacks) {
+      func( conn );
+    }
+  }
+  void countIn( int conn, size_t bytes ) {
+    std::lock_guard<std::mutex> lock( stats_mutex );
+    auto it = recv_stats.find( conn );
+    if (it == recv_stats.end()) {
+      it = recv_stats.emplace( conn, TCPStats() ).first;
+#if IS_POSIX==1
+      it->second.peer = peerName( conn );  // (the posix loops already did, at accept:  openConn())
+#endif
+    }
+    it->second.bytes_in += bytes;
+    ++it->second.msgs_in;
+  }
+  std::mutex stats_mutex;
+  std::map<int, TCPStats> recv_stats;
+#if IS_POSIX==1 && HAS_ASIO==0
+  // the reply side of a receiving connection
+  struct ReplyLoop;
+  struct Conn {
+    std::mutex mutex;          // one reply at a time on the wire
+    uint64_t generation = 0;
+    bool open = true;
+    bool queued = false;       // non blocking:  what the socket doesn't take waits in out, for the receive loop
+    std::string out;
+    size_t out_offset = 0;
+    ReplyLoop* loop = nullptr; // io_uring loop to wake when out fills (epoll sees it as an EPOLLOUT edge)
+  };
+  // an io_uring receive loop's queue of connections with replies waiting to be written
+  struct ReplyLoop {
+    int wake_fd = -1;  // eventfd the loop polls
+    std::mutex mutex;
+    std::vector<int> want_write;
+    void want( int conn );
+  };
+  std::shared_ptr<Conn> findConn( int conn ) {
+    std::lock_guard<std::mutex> lock( conns_mutex );
+    auto it = conns.find( conn );
+    return it == conns.end() ? nullptr : it->second;
+  }
+  // the connection a handoff consumer is delivering for (conn, generation)
+  static std::pair<int, uint64_t>& delivering() {
+    static thread_local std::pair<int, uint64_t> current = { -1, 0 };
+    return current;
+  }
+  void openConn( int conn, bool queued, ReplyLoop* loop = nullptr );
+  void closeConn( int conn );
+  bool flushReplies( int conn );
+  std::mutex conns_mutex;
+  std::unordered_map<int, std::shared_ptr<Conn>> conns;
+  uint64_t next_generation = 0;  // (conns_mutex)
+
+  int listenSocket( bool reuseport );
+  int serve( int serverSock );
+  int recvSharded();
+  int recvBlocking( int serverSock );
+  ssize_t recvSpin( int sock, char* buffer, size_t size );
+#if HAS_EPOLL==1
+  int recvReactor( int serverSock );
+#endif
+#if HAS_IO_URING==1
+  int recvUring( int serverSock );
+#endif
+#endif
 };
 
 #if HAS_ASIO==1
 #include <iostream>
-#include <asio.hpp>
-
-#include <iostream>
+#include <array>
 #include <asio.hpp>
 
 int TCP::send( const char* msg, size_t msg_size ) {
@@ -20,11 +291,15 @@ int TCP::send( const char* msg, size_t msg_size ) {
 
         asio::ip::tcp::socket socket(io_context);
         asio::ip::tcp::resolver resolver(io_context);
-        asio::connect(socket, resolver.resolve("127.0.0.1", "12345"));
+        asio::connect(socket, resolver.resolve(host, std::to_string(port)));
 
-        asio::write(socket, asio::buffer(msg, msg_size));
+        char header[MAX_FRAME_HEADER];
+        size_t header_size = encodeFrameHeader( framing, msg_size, header );
+        std::array<asio::const_buffer, 2> buffers = { asio::buffer(header, header_size), asio::buffer(msg, msg_size) };
+        asio::write(socket, buffers);
 
-        std::cout << "Message sent successfully." << std::endl;
+        if (verbose)
+          std::cout << "Message sent successfully." << std::endl;
     } catch (std::exception& e) {
         std::cerr << "Exception: " << e.what() << std::endl;
     }
@@ -32,22 +307,52 @@ int TCP::send( const char* msg, size_t msg_size ) {
     return 0;
 }
 
+int TCP::flush() {
+  return 0;  // send() writes immediately
+}
+
+int TCP::prewarm() {
+  return 0;  // send() connects each time
+}
+
 int TCP::recv() {
   try {
     asio::io_context io_context;
 
-    asio::ip::tcp::acceptor acceptor(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 12345));
+    asio::ip::tcp::acceptor acceptor(io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port));
+#if defined( TCP_FASTOPEN ) && IS_POSIX==1
+    if (0 < fast_open_queue) {
+      int qlen = fast_open_queue;
+      if (::setsockopt(acceptor.native_handle(), IPPROTO_TCP, TCP_FASTOPEN, (char*)&qlen, sizeof(qlen)) < 0)
+        std::cerr << "setsockopt(TCP_FASTOPEN) failed, fast open disabled." << std::endl;
+    }
+#endif
 
     while (true) {
       asio::ip::tcp::socket socket(io_context);
       acceptor.accept(socket);
 
-      char buffer[512];
-      size_t recvLen;
-      while ((recvLen = socket.read_some(asio::buffer(buffer))) > 0) {
-          buffer[recvLen] = '\0'; // Null-terminate the received data
-          std::cout << "Received message: " << buffer << std::endl;
+      int conn = (int)socket.native_handle();
+      RingBuffer ring( frame_buffer_size );
+      asio::error_code ec;
+      size_t recvLen = 0;
+      while (true) {
+          if (!ring.reserve( 4096 )) {
+            std::cerr << "Receive buffer allocation failed, closing connection." << std::endl;
+            break;
+          }
+          if ((recvLen = socket.read_some(asio::buffer(ring.writePtr(), ring.writable()), ec)) == 0 || ec)
+            break;
+          ring.commit( recvLen );
+          if (framing == Framing::NONE) {
+            dispatch( conn, ring.readPtr(), ring.readable() );
+            ring.consume( ring.readable() );
+          } else if (dispatchFrames( conn, ring ) < 0) {
+            std::cerr << "Bad frame, closing connection." << std::endl;
+            break;
+          }
       }
+      dispatchClose( conn );
     }
   } catch (std::exception& e) {
     std::cerr << "Exception: " << e.what() << std::endl;
@@ -62,59 +367,333 @@ int TCP::recv() {
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <algorithm>
+#include <thread>
+#include "utils.h"
+#if HAS_EPOLL==1
+#include <sys/epoll.h>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#endif
+#if HAS_IO_URING==1
+#include <sys/eventfd.h>
+#include <poll.h>
+#include "IOUring.h"
+#endif
 
 int TCP::send( const char* msg, size_t msg_size ) {
-    int sock = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        std::cerr << "Socket creation failed." << std::endl;
-        return 1;
-    }
+  char header[MAX_FRAME_HEADER];
+  size_t header_size = encodeFrameHeader( framing, msg_size, header );
+  int result = pool.send( Endpoint{ host, port }, header, header_size, msg, msg_size );
+  if (result == TCPConnection::QUEUE_FULL) {
+    std::cerr << "send queue full." << std::endl;
+    return result;
+  }
+  if (result != 0) {
+    std::cerr << "send failed." << std::endl;
+    return 1;
+  }
+  if (verbose)
+    std::cout << "Message sent successfully." << std::endl;
+  return 0;
+}
 
-    sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_port = htons(12345);
-    ::inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+int TCP::flush() {
+  return pool.flush();
+}
 
-    if (::connect(sock, (sockaddr*)&server, sizeof(server)) < 0) {
-        std::cerr << "Connection failed." << std::endl;
-        close(sock);
-        return 1;
+int TCP::prewarm() {
+  return pool.prewarm( { Endpoint{ host, port } } );
+}
+
+int TCP::sendFile( int file_fd, off_t offset, size_t len ) {
+  char header[MAX_FRAME_HEADER];
+  size_t header_size = encodeFrameHeader( framing, len, header );
+  return pool.get( Endpoint{ host, port } )->sendFile( file_fd, offset, len, header, header_size );
+}
+
+int TCP::sendZeroCopy( std::shared_ptr<const void> owner, const char* msg, size_t msg_size, TCPConnection::ReleaseCallback released ) {
+  char header[MAX_FRAME_HEADER];
+  size_t header_size = encodeFrameHeader( framing, msg_size, header );
+  return pool.get( Endpoint{ host, port } )->sendZeroCopy( std::move( owner ), msg, msg_size, std::move( released ), header, header_size );
+}
+
+// a connection was just accepted:  set up its reply side, and (stats) note its peer while conn surely is this one
+void TCP::openConn( int conn, bool queued, ReplyLoop* loop ) {
+  if (stats) {
+    TCPStats s;
+    s.peer = peerName( conn );
+    std::lock_guard<std::mutex> lock( stats_mutex );
+    recv_stats[conn] = s;
+  }
+  std::shared_ptr<Conn> c = std::make_shared<Conn>();
+  c->queued = queued;
+  c->loop = loop;
+  std::lock_guard<std::mutex> lock( conns_mutex );
+  c->generation = ++next_generation;
+  conns[conn] = std::move( c );
+}
+
+// the connection is gone:  replies to it fail from now on, and whatever was still queued is dropped
+void TCP::closeConn( int conn ) {
+  std::shared_ptr<Conn> c;
+  {
+    std::lock_guard<std::mutex> lock( conns_mutex );
+    auto it = conns.find( conn );
+    if (it == conns.end())
+      return;
+    c = std::move( it->second );
+    conns.erase( it );
+  }
+  std::lock_guard<std::mutex> lock( c->mutex );  // waits out a reply in progress
+  c->open = false;
+  std::string().swap( c->out );
+  c->out_offset = 0;
+}
+
+uint64_t TCP::generation( int conn ) {
+  if (delivering().first == conn)
+    return delivering().second;
+  std::shared_ptr<Conn> c = findConn( conn );
+  return c ? c->generation : 0;
+}
+
+int TCP::reply( int conn, uint64_t generation, const char* prefix, size_t prefix_size, const char* msg, size_t msg_size ) {
+  char header[MAX_FRAME_HEADER];
+  size_t header_size = encodeFrameHeader( framing, prefix_size + msg_size, header );
+  iovec iov[3] = { { header, header_size }, { (void*)prefix, prefix_size }, { (void*)msg, msg_size } };
+  msghdr mh = {};
+  mh.msg_iov = iov;
+  mh.msg_iovlen = 3;
+#if defined( MSG_NOSIGNAL )
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0;
+#endif
+  size_t left = header_size + prefix_size + msg_size;
+
+  std::shared_ptr<Conn> c = findConn( conn );
+  if (!c) {
+    fprintf( stderr, "Reply to connection %d failed.  Error: not connected\n", conn );
+    return 1;
+  }
+  std::lock_guard<std::mutex> lock( c->mutex );
+  if (!c->open || (generation != 0 && generation != c->generation)) {
+    fprintf( stderr, "Reply to connection %d failed.  Error: the connection closed\n", conn );
+    return 1;
+  }
+  size_t waiting = c->out.size() - c->out_offset;
+  if (0 < waiting && max_reply_queue < waiting + left) {
+    fprintf( stderr, "Reply to connection %d failed.  Error: %zu bytes already queued, the peer isn't reading\n", conn, waiting );
+    return 1;
+  }
+
+  // write what the socket takes now, unless older replies are still queued ahead of this one
+  if (c->queued)
+    flags |= MSG_DONTWAIT;
+  while (waiting == 0 && 0 < left) {
+    ssize_t n = ::sendmsg( conn, &mh, flags );
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (c->queued && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      fprintf( stderr, "Reply to connection %d failed.  Error code: %s\n", conn, strerror(errno) );
+      return 1;
+    }
+    left -= n;
+    while (0 < n) {
+      size_t done = std::min( (size_t)n, mh.msg_iov->iov_len );
+      mh.msg_iov->iov_base = (char*)mh.msg_iov->iov_base + done;
+      mh.msg_iov->iov_len -= done;
+      n -= done;
+      if (mh.msg_iov->iov_len == 0) {
+        ++mh.msg_iov;
+        --mh.msg_iovlen;
+      }
     }
+  }
+  if (left == 0)
+    return 0;
 
-    if (::send(sock, msg, msg_size, 0) < 0) {
-        std::cerr << "send failed." << std::endl;
-    } else {
-        std::cout << "Message sent successfully." << std::endl;
+  // the rest goes out from the receive loop, when the socket has room
+  for (size_t i = 0; i < mh.msg_iovlen; ++i)
+    c->out.append( (const char*)mh.msg_iov[i].iov_base, mh.msg_iov[i].iov_len );
+  if (c->loop != nullptr)
+    c->loop->want( conn );
+  return 0;
+}
+
+// receive loop side:  write the connection's queued replies, as far as the socket takes them.
+// returns true if some are still waiting for room
+bool TCP::flushReplies( int conn ) {
+  std::shared_ptr<Conn> c = findConn( conn );
+  if (!c)
+    return false;
+#if defined( MSG_NOSIGNAL )
+  int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+#else
+  int flags = MSG_DONTWAIT;
+#endif
+  std::lock_guard<std::mutex> lock( c->mutex );
+  while (c->out_offset < c->out.size()) {
+    ssize_t n = ::send( conn, c->out.data() + c->out_offset, c->out.size() - c->out_offset, flags );
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      fprintf( stderr, "Reply to connection %d failed.  Error code: %s\n", conn, strerror(errno) );
+      break;  // the read side sees the connection break, and closes it
     }
+    c->out_offset += n;
+  }
+  c->out.clear();
+  c->out_offset = 0;
+  return false;
+}
 
-    ::close(sock);
-    return 0;
+void TCP::ReplyLoop::want( int conn ) {
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+    want_write.push_back( conn );
+  }
+  uint64_t one = 1;
+  if (::write( wake_fd, &one, sizeof(one) ) < 0 && errno != EAGAIN)
+    fprintf( stderr, "Reply loop wakeup failed.  Error code: %s\n", strerror(errno) );
 }
 
-int TCP::recv() {
+// open a listening socket on port.  with reuseport, several of them can share the port (the kernel spreads new connections).
+// returns the socket, or -1 on failure
+int TCP::listenSocket( bool reuseport ) {
   int serverSock = ::socket(AF_INET, SOCK_STREAM, 0);
   if (serverSock < 0) {
     std::cerr << "Socket creation failed." << std::endl;
-    return 1;
+    return -1;
   }
 
+  int opt = 1;
+  ::setsockopt(serverSock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+#if defined( SO_REUSEPORT )
+  if (reuseport && ::setsockopt(serverSock, SOL_SOCKET, SO_REUSEPORT, (char*)&opt, sizeof(opt)) < 0) {
+    fprintf( stderr, "setsockopt(SO_REUSEPORT) failed.  Error code: %s\n", strerror(errno) );
+    ::close(serverSock);
+    return -1;
+  }
+#endif
+
   sockaddr_in serverAddr;
   serverAddr.sin_family = AF_INET;
-  serverAddr.sin_port = htons(12345); // Example port
+  serverAddr.sin_port = htons(port);
   serverAddr.sin_addr.s_addr = INADDR_ANY;
 
   if (::bind(serverSock, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
     std::cerr << "Bind failed." << std::endl;
     ::close(serverSock);
-    return 1;
+    return -1;
+  }
+
+#if defined( TCP_FASTOPEN )
+  if (0 < fast_open_queue) {
+#if defined(__APPLE__)
+    int qlen = 1;  // just on/off
+#else
+    int qlen = fast_open_queue;
+#endif
+    if (::setsockopt(serverSock, IPPROTO_TCP, TCP_FASTOPEN, (char*)&qlen, sizeof(qlen)) < 0)
+      fprintf( stderr, "setsockopt(TCP_FASTOPEN) failed, fast open disabled.  Error code: %s\n", strerror(errno) );
   }
+#endif
 
   if (::listen(serverSock, SOMAXCONN) < 0) {
     std::cerr << "Listen failed." << std::endl;
     ::close(serverSock);
+    return -1;
+  }
+  return serverSock;
+}
+
+int TCP::recv() {
+  handoff.start( [this]( const Chunk& chunk, const char* buffer, size_t buffer_size ) {
+    if (chunk.closed) {
+      deliverClose( chunk.conn );
+    } else {
+      delivering() = { chunk.conn, chunk.generation };
+      deliver( chunk.conn, buffer, buffer_size );
+      delivering() = { -1, 0 };
+    }
+  });
+#if defined( SO_REUSEPORT )
+  if (reactor && 1 < shards)
+    return recvSharded();
+#endif
+  busy_poll.pin();
+
+  int serverSock = listenSocket( false );
+  if (serverSock < 0)
     return 1;
+  return serve( serverSock );
+}
+
+// run the listener's receive loop on this thread
+int TCP::serve( int serverSock ) {
+#if HAS_IO_URING==1
+  if (reactor && !busy_poll.enabled)
+    return recvUring( serverSock );
+#endif
+#if HAS_EPOLL==1
+  if (reactor)
+    return recvReactor( serverSock );
+#endif
+  return recvBlocking( serverSock );
+}
+
+#if defined( SO_REUSEPORT )
+// one SO_REUSEPORT listener + event loop per worker thread: the kernel load balances new connections across
+// the listeners, so there's no shared accept queue or lock.  each connection stays on the shard that accepted it.
+int TCP::recvSharded() {
+  std::vector<int> socks;
+  for (int i = 0; i < shards; ++i) {
+    int sock = listenSocket( true );
+    if (sock < 0) {
+      for (int s : socks)
+        ::close(s);
+      return 1;
+    }
+    socks.push_back( sock );
   }
 
+  std::vector<std::thread> workers;
+  unsigned cpus = std::max( 1u, std::thread::hardware_concurrency() );
+  for (int i = 0; i < shards; ++i) {
+    workers.emplace_back( [this, i, cpus, sock = socks[i]]() {
+      if (pin_shards && pinThread( i % cpus ) != 0)
+        fprintf( stderr, "Could not pin shard %d to cpu %u.\n", i, i % cpus );
+      serve( sock );
+    });
+  }
+  for (auto& t : workers)
+    t.join();
+  return 1;
+}
+#endif
+
+// recv() on a blocking socket, spinning on non-blocking reads first when busy polling
+ssize_t TCP::recvSpin( int sock, char* buffer, size_t size ) {
+  ssize_t n = -1;
+  if (busy_poll.enabled && busy_poll.spin( [&]() {
+        n = ::recv(sock, buffer, size, MSG_DONTWAIT);
+        return 0 <= n || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+      }))
+    return n;
+  return ::recv(sock, buffer, size, 0);
+}
+
+// serve one client at a time, until it disconnects
+int TCP::recvBlocking( int serverSock ) {
   int clientSock;
   sockaddr_in clientAddr;
   socklen_t clientAddrSize = sizeof(clientAddr);
@@ -127,12 +706,27 @@ int TCP::recv() {
       return 1;
     }
 
-    char buffer[512];
-    ssize_t recvLen;
-    while ((recvLen = ::recv(clientSock, buffer, sizeof(buffer), 0)) > 0) {
-      buffer[recvLen] = '\0'; // Null-terminate the received data
-      std::cout << "Received message: " << buffer << std::endl;
+    busy_poll.apply( clientSock );
+    openConn( clientSock, false );  // one client:  replies can just block
+    RingBuffer ring( frame_buffer_size );
+    ssize_t recvLen = 0;
+    while (true) {
+      if (!ring.reserve( 4096 )) {
+        std::cerr << "Receive buffer allocation failed, closing connection." << std::endl;
+        break;
+      }
+      if ((recvLen = recvSpin( clientSock, ring.writePtr(), ring.writable() )) <= 0)
+        break;
+      ring.commit( recvLen );
+      if (framing == Framing::NONE) {
+        dispatch( clientSock, ring.readPtr(), ring.readable() );
+        ring.consume( ring.readable() );
+      } else if (dispatchFrames( clientSock, ring ) < 0) {
+        std::cerr << "Bad frame, closing connection." << std::endl;
+        break;
+      }
     }
+    dispatchClose( clientSock );
 
     if (recvLen < 0) {
       std::cerr << "Recv failed." << std::endl;
@@ -148,6 +742,257 @@ int TCP::recv() {
   return 0;
 }
 
+#if HAS_EPOLL==1
+// serve every client from this one thread:
+// all sockets are non blocking and registered edge triggered, so each wakeup must drain the socket until EAGAIN.
+int TCP::recvReactor( int serverSock ) {
+  ::fcntl( serverSock, F_SETFL, ::fcntl(serverSock, F_GETFL, 0) | O_NONBLOCK );
+
+  int ep = ::epoll_create1( EPOLL_CLOEXEC );
+  if (ep < 0) {
+    fprintf( stderr, "epoll_create1 failed.  Error code: %s\n", strerror(errno) );
+    ::close(serverSock);
+    return 1;
+  }
+
+  epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.fd = serverSock;
+  if (::epoll_ctl(ep, EPOLL_CTL_ADD, serverSock, &ev) < 0) {
+    fprintf( stderr, "epoll_ctl(listener) failed.  Error code: %s\n", strerror(errno) );
+    ::close(ep);
+    ::close(serverSock);
+    return 1;
+  }
+
+  std::vector<epoll_event> events( 0 < max_events ? max_events : 1 );
+  std::unordered_map<int, std::unique_ptr<RingBuffer>> rings;  // per-connection, framed mode only
+  char buffer[16384];
+
+  while (true) {
+    int n = 0;
+    if (busy_poll.enabled)
+      busy_poll.spin( [&]() { n = ::epoll_wait(ep, events.data(), (int)events.size(), 0); return n != 0; } );
+    if (n == 0)
+      n = ::epoll_wait(ep, events.data(), (int)events.size(), -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf( stderr, "epoll_wait failed.  Error code: %s\n", strerror(errno) );
+      break;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+
+      // new connections: accept everything that is pending
+      if (fd == serverSock) {
+        while (true) {
+          int clientSock = ::accept4(serverSock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (clientSock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+              continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+              fprintf( stderr, "accept4 failed.  Error code: %s\n", strerror(errno) );
+            break;
+          }
+          busy_poll.apply( clientSock );
+          openConn( clientSock, true );
+          epoll_event cev = {};
+          cev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;  // EPOLLOUT:  room again for queued replies
+          cev.data.fd = clientSock;
+          if (::epoll_ctl(ep, EPOLL_CTL_ADD, clientSock, &cev) < 0) {
+            fprintf( stderr, "epoll_ctl(client) failed.  Error code: %s\n", strerror(errno) );
+            closeConn( clientSock );
+            ::close(clientSock);
+          }
+        }
+        continue;
+      }
+
+      if (events[i].events & EPOLLOUT)
+        flushReplies( fd );
+      if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) == 0)
+        continue;
+
+      // client data: drain until EAGAIN
+      // raw streams read through one shared scratch buffer, framed streams into their own ring (frames can span reads)
+      RingBuffer* ring = nullptr;
+      if (framing != Framing::NONE) {
+        auto& r = rings[fd];
+        if (!r)
+          r.reset( new RingBuffer( frame_buffer_size ) );
+        ring = r.get();
+      }
+      bool closed = (events[i].events & EPOLLERR) != 0;
+      while (!closed) {
+        if (ring != nullptr && !ring->reserve( 4096 )) {
+          closed = true;
+          break;
+        }
+        ssize_t recvLen = ring != nullptr ? ::recv(fd, ring->writePtr(), ring->writable(), 0) : ::recv(fd, buffer, sizeof(buffer), 0);
+        if (0 < recvLen) {
+          if (ring == nullptr) {
+            dispatch( fd, buffer, recvLen );
+          } else {
+            ring->commit( recvLen );
+            if (dispatchFrames( fd, *ring ) < 0) {
+              fprintf( stderr, "Bad frame, closing connection %d.\n", fd );
+              closed = true;
+            }
+          }
+        } else if (recvLen == 0) {
+          closed = true;
+        } else if (errno == EINTR) {
+          continue;
+        } else {
+          closed = (errno != EAGAIN && errno != EWOULDBLOCK);
+          break;
+        }
+      }
+
+      if (closed) {
+        rings.erase( fd );
+        ::epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+        dispatchClose( fd );
+        ::close(fd);
+      }
+    }
+  }
+
+  ::close(ep);
+  ::close(serverSock);
+  return 1;
+}
+#endif
+
+#if HAS_IO_URING==1
+// io_uring receive loop: one multishot accept for the listener, one multishot recv per connection.
+// the kernel picks a provided buffer for each read; raw streams are delivered straight from it,
+// framed streams are appended to the connection's ring first (frames can span reads).
+// all the re-arms from one batch of completions go out in a single io_uring_enter().
+// replies the socket didn't take are written from here:  reply() queues the connection and wakes the loop through
+// an eventfd, which arms a oneshot POLLOUT for it.
+int TCP::recvUring( int serverSock ) {
+  IOUring ring( 1024 );
+  if (!ring.valid() || !ring.setupBuffers( 0, 1024, 16384 )) {
+    fprintf( stderr, "io_uring unavailable, using epoll.\n" );
+    return recvReactor( serverSock );
+  }
+  ReplyLoop replies;
+  replies.wake_fd = ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if (replies.wake_fd < 0) {
+    fprintf( stderr, "eventfd failed, using epoll.  Error code: %s\n", strerror(errno) );
+    return recvReactor( serverSock );
+  }
+
+  const uint64_t ACCEPT = 1ull << 32, RECV = 2ull << 32, WAKE = 3ull << 32, WRITABLE = 4ull << 32;
+  ring.prepAcceptMultishot( serverSock, ACCEPT );
+  ring.prepPoll( replies.wake_fd, POLLIN, WAKE );
+
+  std::unordered_map<int, std::unique_ptr<RingBuffer>> rings;  // per-connection, framed mode only
+  std::unordered_set<int> closing;                             // shut down, waiting for the recv to terminate
+  std::unordered_set<int> writing;                             // POLLOUT armed, for queued replies
+  std::vector<int> want;
+
+  while (true) {
+    if (ring.submit( 1 ) < 0) {
+      fprintf( stderr, "io_uring_enter failed.  Error code: %s\n", strerror(errno) );
+      break;
+    }
+    ring.reap( [&]( const io_uring_cqe& cqe ) {
+      bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+      uint64_t tag = cqe.user_data & ~0xffffffffull;
+      if (tag == WAKE) {
+        uint64_t count;
+        while (::read( replies.wake_fd, &count, sizeof(count) ) == sizeof(count)) {}
+        {
+          std::lock_guard<std::mutex> lock( replies.mutex );
+          want.swap( replies.want_write );
+        }
+        for (int fd : want)
+          if (writing.insert( fd ).second)
+            ring.prepPoll( fd, POLLOUT, WRITABLE | (uint32_t)fd );
+        want.clear();
+        ring.prepPoll( replies.wake_fd, POLLIN, WAKE );
+        return;
+      }
+      if (tag == WRITABLE) {
+        int fd = (int)(uint32_t)cqe.user_data;
+        if (0 <= cqe.res && closing.count( fd ) == 0 && flushReplies( fd ))
+          ring.prepPoll( fd, POLLOUT, WRITABLE | (uint32_t)fd );
+        else
+          writing.erase( fd );
+        return;
+      }
+      if (tag == ACCEPT) {
+        if (0 <= cqe.res) {
+          openConn( cqe.res, true, &replies );
+          ring.prepRecvMultishot( cqe.res, 0, RECV | (uint32_t)cqe.res );
+        } else {
+          fprintf( stderr, "io_uring accept failed.  Error code: %s\n", strerror(-cqe.res) );
+        }
+        if (!more)
+          ring.prepAcceptMultishot( serverSock, ACCEPT );
+        return;
+      }
+
+      int fd = (int)(uint32_t)cqe.user_data;
+      bool broken = cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS);
+      if (0 < cqe.res && closing.count( fd ) == 0) {
+        const char* data = ring.buffer( cqe );
+        if (framing == Framing::NONE) {
+          dispatch( fd, data, cqe.res );
+        } else {
+          auto& r = rings[fd];
+          if (!r)
+            r.reset( new RingBuffer( frame_buffer_size ) );
+          if (!r->reserve( cqe.res )) {
+            broken = true;
+          } else {
+            std::memcpy( r->writePtr(), data, cqe.res );
+            r->commit( cqe.res );
+            if (dispatchFrames( fd, *r ) < 0) {
+              fprintf( stderr, "Bad frame, closing connection %d.\n", fd );
+              broken = true;
+            }
+          }
+        }
+      }
+      if (cqe.flags & IORING_CQE_F_BUFFER)
+        ring.recycle( cqe );
+
+      if (broken && closing.insert( fd ).second) {
+        rings.erase( fd );
+        dispatchClose( fd );
+        ::shutdown( fd, SHUT_RDWR );  // ends the multishot recv, if still armed
+      }
+      if (!more) {
+        if (closing.erase( fd ))
+          ::close( fd );
+        else
+          ring.prepRecvMultishot( fd, 0, RECV | (uint32_t)fd );  // re-arm (e.g. it ran out of buffers)
+      }
+    });
+  }
+
+  // the loop is going away:  its connections' replies can't be queued on it anymore
+  {
+    std::lock_guard<std::mutex> lock( conns_mutex );
+    for (auto& it : conns) {
+      std::lock_guard<std::mutex> clock( it.second->mutex );
+      if (it.second->loop == &replies) {
+        it.second->loop = nullptr;
+        it.second->queued = false;
+      }
+    }
+  }
+  ::close( replies.wake_fd );
+  ::close(serverSock);
+  return 1;
+}
+#endif
+
 #elif IS_WINDOWS==1
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -171,8 +1016,8 @@ int TCP::send( const char* msg, size_t msg_size ) {
 
     sockaddr_in server;
     server.sin_family = AF_INET;
-    server.sin_port = htons(12345);
-    inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+    server.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &server.sin_addr);
 
     if (connect(sock, (sockaddr*)&server, sizeof(server)) == SOCKET_ERROR) {
         std::cerr << "Connection failed." << std::endl;
@@ -181,9 +1026,12 @@ int TCP::send( const char* msg, size_t msg_size ) {
         return 1;
     }
 
-    if (send(sock, msg, msg_size, 0) == SOCKET_ERROR) {
+    char header[MAX_FRAME_HEADER];
+    size_t header_size = encodeFrameHeader( framing, msg_size, header );
+    if ((0 < header_size && ::send(sock, header, (int)header_size, 0) == SOCKET_ERROR) ||
+        ::send(sock, msg, (int)msg_size, 0) == SOCKET_ERROR) {
         std::cerr << "send failed." << std::endl;
-    } else {
+    } else if (verbose) {
         std::cout << "Message sent successfully." << std::endl;
     }
 
@@ -192,6 +1040,14 @@ int TCP::send( const char* msg, size_t msg_size ) {
     return 0;
 }
 
+int TCP::flush() {
+  return 0;  // send() writes immediately
+}
+
+int TCP::prewarm() {
+  return 0;  // send() connects each time
+}
+
 int TCP::recv() {
   WSADATA wsaData;
   if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
@@ -208,7 +1064,7 @@ int TCP::recv() {
 
   sockaddr_in serverAddr;
   serverAddr.sin_family = AF_INET;
-  serverAddr.sin_port = htons(12345); // Example port
+  serverAddr.sin_port = htons(port);
   serverAddr.sin_addr.s_addr = INADDR_ANY;
 
   if (bind(serverSock, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
@@ -238,12 +1094,25 @@ int TCP::recv() {
       return 1;
     }
 
-    char buffer[512];
-    int recvLen;
-    while ((recvLen = recv(clientSock, buffer, sizeof(buffer), 0)) > 0) {
-      buffer[recvLen] = '\0'; // Null-terminate the received data
-      std::cout << "Received message: " << buffer << std::endl;
+    RingBuffer ring( frame_buffer_size );
+    int recvLen = 0;
+    while (true) {
+      if (!ring.reserve( 4096 )) {
+        std::cerr << "Receive buffer allocation failed, closing connection." << std::endl;
+        break;
+      }
+      if ((recvLen = ::recv(clientSock, ring.writePtr(), (int)ring.writable(), 0)) <= 0)
+        break;
+      ring.commit( recvLen );
+      if (framing == Framing::NONE) {
+        dispatch( (int)clientSock, ring.readPtr(), ring.readable() );
+        ring.consume( ring.readable() );
+      } else if (dispatchFrames( (int)clientSock, ring ) < 0) {
+        std::cerr << "Bad frame, closing connection." << std::endl;
+        break;
+      }
     }
+    dispatchClose( (int)clientSock );
 
     if (recvLen == SOCKET_ERROR) {
       std::cerr << "Recv failed." << std::endl;
@@ -0,0 +1,1074 @@
+#ifndef SUBA_NET_TCPCONNECTION
+#define SUBA_NET_TCPCONNECTION
+
+// Long lived client side TCP connections (posix only)
+// - TCPConnection:  one socket to one endpoint, with a send queue, health check and reconnect
+// - TCPPool:        warm TCPConnections keyed by endpoint, so repeated sends skip the handshake (and TIME_WAIT)
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <time.h>
+#endif
+#include "platform_check.h"
+#include "TCPStats.h"
+
+struct Endpoint {
+  std::string host;
+  uint16_t port;
+
+  bool operator<( const Endpoint& rhs ) const {
+    return port != rhs.port ? port < rhs.port : host < rhs.host;
+  }
+  std::string str() const { return host + ":" + std::to_string( port ); }
+};
+
+// how the kernel may coalesce our writes into packets
+enum class SendPolicy {
+  DEFAULT,   // Nagle's algorithm
+  NODELAY,   // TCP_NODELAY: small writes go out immediately (lowest latency)
+  CORK,      // TCP_CORK (TCP_NOPUSH on BSD/MacOS): hold back partial packets while flush() writes, push them when it's done
+};
+
+// what send() does when a bounded send queue is full
+enum class QueueFullPolicy {
+  BLOCK,     // wait for the peer to drain it (up to Options::block_timeout)
+  DROP,      // discard the new message (counted in dropped()), and carry on
+  FAIL,      // return TCPConnection::QUEUE_FULL right away, so the caller can back off
+};
+
+class TCPConnection {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    // reconnect backoff, doubles on each failed connect() up to the max
+    std::chrono::milliseconds min_backoff{ 50 };
+    std::chrono::milliseconds max_backoff{ 5000 };
+
+    SendPolicy send_policy = SendPolicy::DEFAULT;
+
+    // batching:  send() only queues, and the queue goes out in as few sendmsg() calls as possible
+    // when flush() is called, or once batch_bytes are queued.
+    bool batch = false;
+    size_t batch_bytes = 64 * 1024;
+
+    // sendZeroCopy():  smaller buffers are just copied (page pinning + completion costs more than the copy)
+    size_t zerocopy_min = 16 * 1024;
+    // close() waits up to this long for outstanding zero-copy completions.  after that the socket is shut down but kept
+    // open, and its buffers are held until their completions arrive (reaped by later calls).  the destructor waits as
+    // long again, then aborts the rest (SO_LINGER 0:  the kernel drops the unsent data) before dropping the buffers
+    std::chrono::milliseconds zerocopy_linger{ 100 };
+
+    // backpressure:  with max_queue_bytes > 0, send() never blocks in the kernel.  it writes what the socket takes,
+    // leaves the rest queued (written by later send()/flush() calls), and applies queue_full once the queue is full.
+    // 0:  unbounded, send() blocks until the kernel has taken everything.
+    size_t max_queue_bytes = 0;
+    QueueFullPolicy queue_full = QueueFullPolicy::BLOCK;
+    std::chrono::milliseconds block_timeout{ -1 };  // BLOCK gives up with QUEUE_FULL after this long (-1 = never)
+
+    // writable() turns false once more than high_watermark bytes are queued, and back to true (calling on_writable)
+    // when the queue drains down to low_watermark.  on_drained is called when a backlog has been completely written.
+    // both are called from whichever thread was sending, after the connection's lock is released.
+    size_t high_watermark = 256 * 1024;
+    size_t low_watermark = 64 * 1024;
+    std::function<void(TCPConnection&)> on_writable;
+    std::function<void(TCPConnection&)> on_drained;
+
+    // TCP Fast Open (Linux 4.11+, TCP_FASTOPEN_CONNECT):  connect() returns right away, and the first write goes out
+    // in the SYN.  once the peer's TFO cookie is cached, a new connection's first message saves a round trip.
+    // (the peer must have fast open enabled on its listener, see TCP::fast_open_queue)
+    // not combined with ack_timestamps:  their byte offsets need the handshake done first, so that wins.
+    bool fast_open = false;
+
+    // record send-to-ack latency in stats().ack_latency_us (Linux:  the kernel timestamps when the peer acks the last
+    // byte of each write, SO_TIMESTAMPING + SOF_TIMESTAMPING_TX_ACK).  costs an error queue read per flush.
+    bool ack_timestamps = false;
+  };
+
+  // send() result when the bounded queue is full (QueueFullPolicy::FAIL, or BLOCK timing out)
+  static const int QUEUE_FULL = 2;
+
+  // called when the kernel no longer needs a sendZeroCopy() buffer
+  using ReleaseCallback = std::function<void()>;
+
+  TCPConnection( const Endpoint& ep ) : endpoint( ep ) {}
+  TCPConnection( const Endpoint& ep, const Options& opts ) : endpoint( ep ), options( opts ) {}
+  ~TCPConnection() {
+    std::lock_guard<std::mutex> lock( mutex );
+    closeLocked();
+    abortDrainingLocked();
+  }
+  TCPConnection( const TCPConnection& ) = delete;
+  TCPConnection& operator=( const TCPConnection& ) = delete;
+
+  // queue the message, then write out the queue (unless batching).  reconnects (once) if the connection was found broken.
+  // returns 0 on success (or when dropped by QueueFullPolicy::DROP), QUEUE_FULL, or 1 on error
+  int send( const char* msg, size_t msg_size ) {
+    return send( nullptr, 0, msg, msg_size );
+  }
+
+  // queue the message behind a header (e.g. a frame length prefix), as one unit
+  int send( const char* header, size_t header_size, const char* msg, size_t msg_size ) {
+    int result;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      result = makeRoomLocked( header_size + msg_size );
+      if (result == 0) {
+        sendQueue.emplace_back();
+        sendQueue.back().reserve( header_size + msg_size );
+        if (header_size)
+          sendQueue.back().append( header, header_size );
+        sendQueue.back().append( msg, msg_size );
+        queued_bytes += header_size + msg_size;
+        result = autoFlushLocked();
+      } else if (result == DROPPED) {
+        ++dropped_msgs;
+        result = 0;
+      }
+      updateWatermarksLocked();
+    }
+    notify();
+    return result;
+  }
+
+  // write out everything queued (waiting for the peer if it must).  returns 0 on success
+  int flush() {
+    int result;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      result = flushLocked( true );
+      updateWatermarksLocked();
+    }
+    notify();
+    return result;
+  }
+
+  // write whatever of the queue the socket takes right now, without blocking (bounded queues:  drives a backlog
+  // from a housekeeping loop, e.g. while waiting for on_writable).  returns 0 unless the connection failed
+  int pump() {
+    int result;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      result = flushLocked( false );
+      updateWatermarksLocked();
+    }
+    notify();
+    return result;
+  }
+
+  // stream len bytes of a file (or pipe, or socket) starting at offset, without copying it through userspace:
+  // sendfile() for regular files, splice() for anything else (Linux), read()+send() where neither exists.
+  // an optional header (e.g. a frame length prefix) goes out first.  offset is ignored for non-seekable sources.
+  // returns 0 on success
+  int sendFile( int file_fd, off_t offset, size_t len, const char* header = nullptr, size_t header_size = 0 ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    if (header_size) {
+      sendQueue.emplace_back( header, header_size );
+      queued_bytes += header_size;
+    }
+    if (flushLocked() != 0 || (fd < 0 && connectLocked() != 0))
+      return 1;
+    int result = sendFileLocked( file_fd, offset, len );
+    if (result != 0)
+      closeLocked();  // the stream is cut somewhere in the middle of the file
+    else
+      ++counters.msgs_out;
+    last_used = Clock::now();
+    return result;
+  }
+
+  // send a large buffer with MSG_ZEROCOPY (Linux 4.14+): the kernel transmits straight from data's pages, so data must
+  // stay unchanged until the kernel is done with it.  the connection holds on to owner (which should own data) until
+  // the completion arrives on the socket's error queue, then drops it and calls released (if given).
+  // below Options::zerocopy_min, or without kernel support, data is copied as usual and released right away.
+  // an optional header (e.g. a frame length prefix) goes out first.  returns 0 on success
+  int sendZeroCopy( std::shared_ptr<const void> owner, const char* data, size_t size, ReleaseCallback released = nullptr,
+                    const char* header = nullptr, size_t header_size = 0 ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    if (header_size) {
+      sendQueue.emplace_back( header, header_size );
+      queued_bytes += header_size;
+    }
+    if (flushLocked() != 0 || (fd < 0 && connectLocked() != 0)) {
+      if (released)
+        released();
+      return 1;
+    }
+    reapErrorQueueLocked();
+
+    bool zerocopy = options.zerocopy_min <= size && enableZeroCopyLocked();
+    uint32_t first_id = zerocopy_next;
+    size_t sent = 0;
+    while (sent < size) {
+      ssize_t n = ::send( fd, data + sent, size - sent, sendFlags() | (zerocopy ? zeroCopyFlag() : 0) );
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == ENOBUFS && zerocopy) {
+          zerocopy = false;  // out of optmem for pinning pages, copy the rest
+          continue;
+        }
+        fprintf( stderr, "send to %s failed.  Error code: %s\n", endpoint.str().c_str(), strerror(errno) );
+        if (zerocopy_next != first_id) {
+          // part of it went out zero-copy:  held (and drained) with the socket like the others
+          zerocopy_pending.push_back( { zerocopy_next, std::move( owner ), std::move( released ) } );
+        } else if (released) {
+          released();
+        }
+        closeLocked();
+        return 1;
+      }
+      sent += n;
+      sentLocked( n );
+      if (zerocopy)
+        ++zerocopy_next;  // every successful MSG_ZEROCOPY send gets the next notification id
+    }
+    ++counters.msgs_out;
+    last_used = Clock::now();
+
+    if (zerocopy_next == first_id) {
+      // nothing went out zero-copy, the kernel has its own copy already
+      if (released)
+        released();
+    } else {
+      zerocopy_pending.push_back( { zerocopy_next, std::move( owner ), std::move( released ) } );
+    }
+    return 0;
+  }
+
+  // wait up to timeout_ms (-1 = forever) for the kernel to finish with every sendZeroCopy() buffer (including those of
+  // sockets closed since).  returns the number still outstanding
+  size_t waitZeroCopy( int timeout_ms ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    return waitZeroCopyLocked( timeout_ms );
+  }
+
+  // buffers the kernel ended up copying anyway (e.g. over loopback, or NICs without scatter-gather)
+  size_t zeroCopyCopied() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return zerocopy_copied;
+  }
+
+  // (re)open the socket.  returns 0 on success.
+  // fails fast while backing off from a previous failed attempt.
+  int connect() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return connectLocked();
+  }
+
+  // open the connection ahead of first use, with the handshake done now (never deferred by fast open),
+  // so the first send() goes straight out.  returns 0 on success (or if already connected)
+  int prewarm() {
+    std::lock_guard<std::mutex> lock( mutex );
+    if (0 <= fd)
+      return 0;
+    return connectLocked( false );
+  }
+
+  // cheap non-blocking probe: is the socket open, and has the peer not closed or reset it?
+  bool healthy() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return healthyLocked();
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock( mutex );
+    closeLocked();
+  }
+
+  bool connected() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return 0 <= fd;
+  }
+  Clock::time_point lastUsed() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return last_used;
+  }
+  size_t queued() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return queued_bytes;
+  }
+  // false while the send queue is above the high watermark (until it drains to the low watermark)
+  bool writable() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return !congested;
+  }
+  // messages discarded by QueueFullPolicy::DROP
+  size_t dropped() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return dropped_msgs;
+  }
+
+  // traffic counters, latest TCP_INFO and send-to-ack latency for this connection (counters survive reconnects)
+  TCPStats stats() {
+    std::lock_guard<std::mutex> lock( mutex );
+    reapErrorQueueLocked();
+    TCPStats result = counters;
+    result.peer = endpoint.str();
+    if (0 <= fd)
+      sampleTCPInfo( fd, result );
+    return result;
+  }
+
+  const Endpoint endpoint;
+  const Options options;
+
+protected:
+  // fast_open:  defer the handshake to the first write (when Options::fast_open)
+  int connectLocked( bool fast_open = true ) {
+    closeLocked();
+
+    auto now = Clock::now();
+    if (now < next_attempt)
+      return 1;
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    int err = ::getaddrinfo( endpoint.host.c_str(), std::to_string( endpoint.port ).c_str(), &hints, &res );
+    if (err != 0) {
+      fprintf( stderr, "getaddrinfo(%s) failed.  Error: %s\n", endpoint.str().c_str(), gai_strerror( err ) );
+      backoff( now );
+      return 1;
+    }
+
+    for (addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+      int sock = ::socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+      if (sock < 0)
+        continue;
+      if (fast_open && options.fast_open && !options.ack_timestamps)
+        enableFastOpen( sock );
+      if (::connect( sock, ai->ai_addr, ai->ai_addrlen ) == 0) {
+        fd = sock;
+        break;
+      }
+      ::close( sock );
+    }
+    ::freeaddrinfo( res );
+
+    if (fd < 0) {
+      fprintf( stderr, "Connection to %s failed.  Error code: %s\n", endpoint.str().c_str(), strerror(errno) );
+      backoff( now );
+      return 1;
+    }
+
+    // let the kernel notice dead peers on idle connections too
+    int opt = 1;
+    ::setsockopt( fd, SOL_SOCKET, SO_KEEPALIVE, (char*)&opt, sizeof(opt) );
+#if defined( SO_NOSIGPIPE )
+    ::setsockopt( fd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&opt, sizeof(opt) );
+#endif
+    if (options.send_policy == SendPolicy::NODELAY)
+      ::setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(opt) );
+    if (options.ack_timestamps)
+      enableAckTimestampsLocked();
+
+    backoff_delay = std::chrono::milliseconds( 0 );
+    next_attempt = now;
+    last_used = now;
+    return 0;
+  }
+
+  bool healthyLocked() {
+    if (fd < 0)
+      return false;
+    reapErrorQueueLocked();  // zero-copy completions also raise POLLERR
+    pollfd p = { fd, POLLIN, 0 };
+    if (::poll( &p, 1, 0 ) < 0)
+      return false;
+    if (p.revents & (POLLHUP | POLLNVAL))
+      return false;
+    if (p.revents & POLLERR) {
+      // a real socket error, or just error queue notifications that arrived since the reap
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (::getsockopt( fd, SOL_SOCKET, SO_ERROR, (char*)&err, &len ) < 0 || err != 0)
+        return false;
+    }
+    if (p.revents & POLLIN) {
+      // readable on a send-only connection: either the peer closed (0), reset (error), or sent us something (alive)
+      char c;
+      ssize_t r = ::recv( fd, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+      if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return false;
+    }
+    return true;
+  }
+
+  void closeLocked() {
+    if (0 <= fd) {
+      waitZeroCopyLocked( (int)options.zerocopy_linger.count() );
+      if (zerocopy_pending.empty()) {
+        ::close( fd );
+      } else {
+        // the kernel may still be sending from these buffers:  keep the socket (and them) until it says it's done
+        ::shutdown( fd, SHUT_WR );
+        draining.push_back( { fd, zerocopy_next, zerocopy_done, std::move( zerocopy_pending ) } );
+        zerocopy_pending.clear();
+      }
+      fd = -1;
+    }
+    // a half written front message goes out whole on the next connection:  count its written part as queued again
+    // (backlogged stays as it was, the bytes are still queued)
+    queued_bytes += sent_offset;
+    sent_offset = 0;
+    ack_enabled = false;
+    ack_pending.clear();
+    zerocopy_enabled = false;
+    zerocopy_next = zerocopy_done = 0;
+  }
+
+  // the kernel is done with a closed socket's buffers:  release them and close it
+  void reapDrainingLocked() {
+    for (auto it = draining.begin(); it != draining.end();) {
+      readErrorQueueLocked( it->fd, false, it->next, it->done );
+      while (!it->pending.empty() && (int32_t)(it->done - it->pending.front().last_id) >= 0)
+        releaseFrontLocked( it->pending );
+      if (it->pending.empty()) {
+        ::close( it->fd );
+        it = draining.erase( it );
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // give up on the closed sockets still draining:  reset them, so the kernel drops what it hasn't sent (and lets go of
+  // the pages), then release the buffers
+  void abortDrainingLocked() {
+    reapDrainingLocked();
+    for (auto& d : draining) {
+      linger l = { 1, 0 };
+      ::setsockopt( d.fd, SOL_SOCKET, SO_LINGER, (char*)&l, sizeof(l) );
+      ::close( d.fd );
+      while (!d.pending.empty())
+        releaseFrontLocked( d.pending );
+    }
+    draining.clear();
+  }
+
+  int sendFileLocked( int file_fd, off_t offset, size_t len ) {
+    struct stat st;
+    if (::fstat( file_fd, &st ) < 0) {
+      fprintf( stderr, "fstat failed.  Error code: %s\n", strerror(errno) );
+      return 1;
+    }
+    bool regular = S_ISREG( st.st_mode );
+#if defined(__linux__)
+    if (regular) {
+      while (0 < len) {
+        ssize_t n = ::sendfile( fd, file_fd, &offset, len );
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0) {
+          fprintf( stderr, "sendfile to %s failed.  Error code: %s\n", endpoint.str().c_str(), n == 0 ? "end of file" : strerror(errno) );
+          return 1;
+        }
+        sentLocked( n );
+        len -= n;
+      }
+      return 0;
+    }
+    // splice() needs a pipe on one side: pipes splice straight in, anything else goes through one of ours
+    bool is_pipe = S_ISFIFO( st.st_mode );
+    int p[2] = { -1, -1 };
+    if (!is_pipe && ::pipe( p ) < 0) {
+      fprintf( stderr, "pipe failed.  Error code: %s\n", strerror(errno) );
+      return 1;
+    }
+    int result = 0;
+    while (0 < len && result == 0) {
+      ssize_t in = len;
+      if (!is_pipe) {
+        in = ::splice( file_fd, nullptr, p[1], nullptr, len, SPLICE_F_MOVE | SPLICE_F_MORE );
+        if (in < 0 && errno == EINTR)
+          continue;
+        if (in <= 0) {
+          result = 1;
+          break;
+        }
+      }
+      int src = is_pipe ? file_fd : p[0];
+      ssize_t remaining = in;
+      while (0 < remaining) {
+        ssize_t out = ::splice( src, nullptr, fd, nullptr, remaining, SPLICE_F_MOVE | SPLICE_F_MORE );
+        if (out < 0 && errno == EINTR)
+          continue;
+        if (out <= 0) {
+          result = 1;
+          break;
+        }
+        remaining -= out;
+        sentLocked( out );
+        if (is_pipe)
+          break;  // spliced what the pipe had, go around
+      }
+      len -= (in - remaining);
+    }
+    if (!is_pipe) {
+      ::close( p[0] );
+      ::close( p[1] );
+    }
+    if (result != 0)
+      fprintf( stderr, "splice to %s failed.  Error code: %s\n", endpoint.str().c_str(), strerror(errno) );
+    return result;
+#elif defined(__APPLE__)
+    if (regular) {
+      while (0 < len) {
+        off_t n = len;
+        int r = ::sendfile( file_fd, fd, offset, &n, nullptr, 0 );
+        offset += n;
+        len -= n;
+        sentLocked( n );
+        if (r < 0 && errno != EINTR && errno != EAGAIN) {
+          fprintf( stderr, "sendfile to %s failed.  Error code: %s\n", endpoint.str().c_str(), strerror(errno) );
+          return 1;
+        }
+        if (r == 0 && n == 0)
+          return len == 0 ? 0 : 1;  // end of file
+      }
+      return 0;
+    }
+#endif
+    // plain copy through userspace
+    char buffer[64 * 1024];
+    while (0 < len) {
+      ssize_t n = regular ? ::pread( file_fd, buffer, std::min( len, sizeof(buffer) ), offset ) : ::read( file_fd, buffer, std::min( len, sizeof(buffer) ) );
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return 1;
+      offset += n;
+      len -= n;
+      for (ssize_t sent = 0; sent < n;) {
+        ssize_t w = ::send( fd, buffer + sent, n - sent, sendFlags() );
+        if (w < 0 && errno == EINTR)
+          continue;
+        if (w < 0)
+          return 1;
+        sent += w;
+        sentLocked( w );
+      }
+    }
+    return 0;
+  }
+
+  bool enableZeroCopyLocked() {
+#if defined( SO_ZEROCOPY ) && defined( MSG_ZEROCOPY )
+    if (!zerocopy_enabled) {
+      int opt = 1;
+      zerocopy_enabled = ::setsockopt( fd, SOL_SOCKET, SO_ZEROCOPY, (char*)&opt, sizeof(opt) ) == 0;
+    }
+    return zerocopy_enabled;
+#else
+    return false;
+#endif
+  }
+
+  static int zeroCopyFlag() {
+#if defined( MSG_ZEROCOPY )
+    return MSG_ZEROCOPY;
+#else
+    return 0;
+#endif
+  }
+
+  // read the error queue:  zero-copy completions (releasing the buffers they cover) and ack timestamps
+  void reapErrorQueueLocked() {
+    if (0 <= fd)
+      readErrorQueueLocked( fd, ack_enabled, zerocopy_next, zerocopy_done );
+    while (!zerocopy_pending.empty() && (int32_t)(zerocopy_done - zerocopy_pending.front().last_id) >= 0)
+      releaseFrontLocked( zerocopy_pending );
+    if (!draining.empty())
+      reapDrainingLocked();
+  }
+
+  // read sock's error queue while it may have something:  moves done past the completed zero-copy ids (up to next),
+  // and with acks, records the ack timestamps
+  void readErrorQueueLocked( int sock, bool acks, uint32_t next, uint32_t& done ) {
+#if defined(__linux__)
+    while (acks || done != next) {
+      char control[256];
+      msghdr msg = {};
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if (::recvmsg( sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0)
+        break;
+      const sock_extended_err* err = nullptr;
+      const scm_timestamping* ts = nullptr;
+      for (cmsghdr* cm = CMSG_FIRSTHDR( &msg ); cm != nullptr; cm = CMSG_NXTHDR( &msg, cm )) {
+        if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+          err = (const sock_extended_err*)CMSG_DATA( cm );
+        else if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+          ts = (const scm_timestamping*)CMSG_DATA( cm );
+      }
+      if (err == nullptr)
+        continue;
+#if defined( SO_EE_ORIGIN_ZEROCOPY )
+      if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY && err->ee_errno == 0) {
+        // notifications cover the range of send ids [ee_info, ee_data], in order on a TCP socket
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+          zerocopy_copied += err->ee_data - err->ee_info + 1;
+        if ((int32_t)(err->ee_data + 1 - done) > 0)
+          done = err->ee_data + 1;
+      }
+#endif
+      if (acks && err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && err->ee_info == SCM_TSTAMP_ACK && ts != nullptr)
+        ackedLocked( err->ee_data, (uint64_t)ts->ts[0].tv_sec * 1000000000ull + ts->ts[0].tv_nsec );
+    }
+#endif
+  }
+
+  // count n bytes written to the socket.  with ack timestamps, remember when the write went out:
+  // the kernel reports the ack of its last byte by offset (bytes written since enabling, minus one)
+  void sentLocked( size_t n ) {
+    counters.bytes_out += n;
+    tx_bytes += (uint32_t)n;
+    if (!ack_enabled)
+      return;
+    if (MAX_ACK_PENDING <= ack_pending.size())
+      ack_pending.pop_front();  // never acked (or the reports were lost), don't grow forever
+    ack_pending.push_back( { tx_bytes - 1, realtimeNs() } );
+  }
+
+  // the peer acked everything up to byte offset key at time acked_ns
+  void ackedLocked( uint32_t key, uint64_t acked_ns ) {
+    while (!ack_pending.empty() && (int32_t)(key - ack_pending.front().key) >= 0) {
+      uint64_t sent_ns = ack_pending.front().sent_ns;
+      counters.ack_latency_us.record( sent_ns < acked_ns ? (acked_ns - sent_ns) / 1000 : 0 );
+      ack_pending.pop_front();
+    }
+  }
+
+  void enableAckTimestampsLocked() {
+#if defined(__linux__) && defined( SO_TIMESTAMPING )
+    int flags = SOF_TIMESTAMPING_TX_ACK | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    ack_enabled = ::setsockopt( fd, SOL_SOCKET, SO_TIMESTAMPING, (char*)&flags, sizeof(flags) ) == 0;
+    if (!ack_enabled)
+      fprintf( stderr, "setsockopt(SO_TIMESTAMPING) failed.  Error code: %s\n", strerror(errno) );
+#endif
+    tx_bytes = 0;  // OPT_ID offsets count from here
+    ack_pending.clear();
+  }
+
+  static bool enableFastOpen( int sock ) {
+#if defined( TCP_FASTOPEN_CONNECT )
+    int opt = 1;
+    if (::setsockopt( sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (char*)&opt, sizeof(opt) ) == 0)
+      return true;
+    fprintf( stderr, "setsockopt(TCP_FASTOPEN_CONNECT) failed, using a regular handshake.  Error code: %s\n", strerror(errno) );
+#endif
+    return false;
+  }
+
+  static uint64_t realtimeNs() {
+#if defined(__linux__)
+    timespec t;
+    ::clock_gettime( CLOCK_REALTIME, &t );  // the clock the kernel stamps with
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+#else
+    return 0;
+#endif
+  }
+
+  size_t waitZeroCopyLocked( int timeout_ms ) {
+    auto deadline = Clock::now() + std::chrono::milliseconds( timeout_ms );
+    reapErrorQueueLocked();
+    while (outstandingZeroCopyLocked()) {
+      int wait = timeout_ms < 0 ? -1 : (int)std::chrono::duration_cast<std::chrono::milliseconds>( deadline - Clock::now() ).count();
+      if (0 <= timeout_ms && wait <= 0)
+        break;
+      // POLLERR is always reported:  an error queue has something
+      std::vector<pollfd> p;
+      if (0 <= fd && !zerocopy_pending.empty())
+        p.push_back( { fd, 0, 0 } );
+      for (auto& d : draining)
+        p.push_back( { d.fd, 0, 0 } );
+      if (p.empty() || ::poll( p.data(), p.size(), wait ) <= 0)
+        break;
+      reapErrorQueueLocked();
+    }
+    return outstandingZeroCopyLocked();
+  }
+
+  size_t outstandingZeroCopyLocked() const {
+    size_t n = zerocopy_pending.size();
+    for (auto& d : draining)
+      n += d.pending.size();
+    return n;
+  }
+
+  struct ZeroCopyBuffer;
+  static void releaseFrontLocked( std::deque<ZeroCopyBuffer>& pending ) {
+    ReleaseCallback released = std::move( pending.front().released );
+    pending.pop_front();
+    if (released)
+      released();
+  }
+
+  int autoFlushLocked() {
+    if (options.batch && queued_bytes < options.batch_bytes)
+      return 0;
+    return flushLocked( options.max_queue_bytes == 0 );
+  }
+
+  static const int DROPPED = -1;
+
+  // bounded queue:  make room for n more bytes, or apply the queue full policy.
+  // returns 0 when there's room, DROPPED, QUEUE_FULL, or 1 on error.
+  // (a message larger than the whole queue is let in when the queue is empty, or it never could be sent)
+  int makeRoomLocked( size_t n ) {
+    auto fits = [&]() { return options.max_queue_bytes == 0 || queued_bytes == 0 || queued_bytes + n <= options.max_queue_bytes; };
+    if (fits())
+      return 0;
+    if (flushLocked( false ) != 0)
+      return 1;
+    if (fits())
+      return 0;
+    if (options.queue_full == QueueFullPolicy::DROP)
+      return DROPPED;
+    if (options.queue_full == QueueFullPolicy::FAIL)
+      return QUEUE_FULL;
+
+    auto deadline = Clock::now() + options.block_timeout;
+    while (!fits()) {
+      int wait = -1;
+      if (0 <= options.block_timeout.count()) {
+        wait = (int)std::chrono::duration_cast<std::chrono::milliseconds>( deadline - Clock::now() ).count();
+        if (wait <= 0)
+          return QUEUE_FULL;
+      }
+      pollfd p = { fd, POLLOUT, 0 };
+      if (::poll( &p, 1, wait ) < 0 && errno != EINTR)
+        return 1;
+      if (flushLocked( false ) != 0)
+        return 1;
+    }
+    return 0;
+  }
+
+  // track the queue against the watermarks, noting which callbacks notify() should call
+  void updateWatermarksLocked() {
+    if (!congested && options.high_watermark < queued_bytes) {
+      congested = true;
+    } else if (congested && queued_bytes <= options.low_watermark) {
+      congested = false;
+      notify_writable = true;
+    }
+    if (backlogged && queued_bytes == 0) {
+      backlogged = false;
+      notify_drained = true;
+    }
+  }
+
+  // call the callbacks noted by updateWatermarksLocked(), outside the lock (so they can send())
+  void notify() {
+    bool writable, drained;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      writable = std::exchange( notify_writable, false );
+      drained = std::exchange( notify_drained, false );
+    }
+    if (writable && options.on_writable)
+      options.on_writable( *this );
+    if (drained && options.on_drained)
+      options.on_drained( *this );
+  }
+
+  // write the whole queue, front to back, gathering up to MAX_IOV messages per sendmsg().
+  // if the connection is broken before any byte of the front message went out, reconnect once and retry,
+  // otherwise the message was cut in half and it's dropped along with the connection.
+  // without wait, stops (leaving the rest queued) as soon as the socket buffer is full.
+  int flushLocked( bool wait = true ) {
+    static const size_t MAX_IOV = 64;
+    if (sendQueue.empty())
+      return 0;
+    if (fd < 0 && connectLocked() != 0) {
+      dropQueueLocked();
+      return 1;
+    }
+
+    bool corked = options.send_policy == SendPolicy::CORK && 1 < sendQueue.size() && setCork( true );
+    bool retried = false;
+    while (!sendQueue.empty()) {
+      iovec iov[MAX_IOV];
+      size_t count = 0;
+      for (auto it = sendQueue.begin(); it != sendQueue.end() && count < MAX_IOV; ++it, ++count) {
+        size_t skip = count == 0 ? sent_offset : 0;
+        iov[count].iov_base = (void*)(it->data() + skip);
+        iov[count].iov_len = it->size() - skip;
+      }
+      msghdr mh = {};
+      mh.msg_iov = iov;
+      mh.msg_iovlen = count;
+      ssize_t n = ::sendmsg( fd, &mh, sendFlags() | (wait ? 0 : MSG_DONTWAIT) );
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          backlogged = true;
+          break;
+        }
+        bool untouched = sent_offset == 0;
+        fprintf( stderr, "send to %s failed.  Error code: %s\n", endpoint.str().c_str(), strerror(errno) );
+        if (untouched && !retried && connectLocked() == 0) {
+          retried = true;
+          corked = options.send_policy == SendPolicy::CORK && 1 < sendQueue.size() && setCork( true );
+          continue;
+        }
+        closeLocked();
+        dropQueueLocked();
+        return 1;
+      }
+      sentLocked( n );
+      consumeLocked( n );
+    }
+    if (corked)
+      setCork( false );  // push out the last partial packet now
+    if (ack_enabled)
+      reapErrorQueueLocked();
+    last_used = Clock::now();
+    return 0;
+  }
+
+  // pop n written bytes off the front of the queue
+  void consumeLocked( size_t n ) {
+    queued_bytes -= n;
+    while (0 < n) {
+      size_t remaining = sendQueue.front().size() - sent_offset;
+      if (n < remaining) {
+        sent_offset += n;
+        return;
+      }
+      n -= remaining;
+      sendQueue.pop_front();
+      sent_offset = 0;
+      ++counters.msgs_out;
+    }
+  }
+
+  void dropQueueLocked() {
+    sendQueue.clear();
+    queued_bytes = 0;
+    sent_offset = 0;
+    backlogged = false;  // lost, not drained
+  }
+
+  bool setCork( bool on ) {
+    int opt = on ? 1 : 0;
+#if defined( TCP_CORK )
+    return ::setsockopt( fd, IPPROTO_TCP, TCP_CORK, (char*)&opt, sizeof(opt) ) == 0;
+#elif defined( TCP_NOPUSH )
+    return ::setsockopt( fd, IPPROTO_TCP, TCP_NOPUSH, (char*)&opt, sizeof(opt) ) == 0;
+#else
+    return false;
+#endif
+  }
+
+  static int sendFlags() {
+#if defined( MSG_NOSIGNAL )
+    return MSG_NOSIGNAL;
+#else
+    return 0;
+#endif
+  }
+
+  void backoff( Clock::time_point now ) {
+    backoff_delay = backoff_delay.count() == 0 ? options.min_backoff : std::min( backoff_delay * 2, options.max_backoff );
+    next_attempt = now + backoff_delay;
+  }
+
+  std::mutex mutex;
+  int fd = -1;
+  std::deque<std::string> sendQueue;
+  size_t queued_bytes = 0;            // unwritten bytes in sendQueue
+  size_t sent_offset = 0;             // bytes of sendQueue.front() already written
+  size_t dropped_msgs = 0;
+  bool congested = false;             // above the high watermark (not yet back down to the low one)
+  bool backlogged = false;            // a non blocking write left data queued
+  bool notify_writable = false, notify_drained = false;
+  Clock::time_point last_used = Clock::now();
+
+  // zero-copy sends waiting for the kernel: each is released once every id before last_id has completed
+  struct ZeroCopyBuffer {
+    uint32_t last_id;
+    std::shared_ptr<const void> owner;
+    ReleaseCallback released;
+  };
+  std::deque<ZeroCopyBuffer> zerocopy_pending;
+  bool zerocopy_enabled = false;
+  uint32_t zerocopy_next = 0;    // id the next MSG_ZEROCOPY send will get
+  uint32_t zerocopy_done = 0;    // every id below this has completed
+  size_t zerocopy_copied = 0;
+  // closed sockets the kernel may still be sending zero-copy buffers from (see closeLocked())
+  struct Draining {
+    int fd;
+    uint32_t next, done;
+    std::deque<ZeroCopyBuffer> pending;
+  };
+  std::vector<Draining> draining;
+  Clock::time_point next_attempt = Clock::now();
+  std::chrono::milliseconds backoff_delay{ 0 };
+
+  TCPStats counters;
+  uint32_t tx_bytes = 0;         // bytes written since the socket opened (wraps), ack timestamp offsets count these
+  bool ack_enabled = false;
+  struct AckPending {
+    uint32_t key;                // offset of the write's last byte
+    uint64_t sent_ns;            // CLOCK_REALTIME
+  };
+  std::deque<AckPending> ack_pending;
+  static const size_t MAX_ACK_PENDING = 4096;
+};
+
+class TCPPool {
+public:
+  // get the warm connection for the endpoint, creating (or reconnecting) it as needed.
+  // connections idle longer than health_check_interval are probed before they're handed out.
+  std::shared_ptr<TCPConnection> get( const Endpoint& ep ) {
+    std::shared_ptr<TCPConnection> conn = slot( ep );
+    if (!conn->connected() || (health_check_interval < TCPConnection::Clock::now() - conn->lastUsed() && !conn->healthy()))
+      conn->connect();
+    return conn;
+  }
+
+  // open connections to endpoints ahead of first use (handshake done now, see TCPConnection::prewarm()).
+  // returns 0 if all of them connected
+  int prewarm( const std::vector<Endpoint>& endpoints ) {
+    int result = 0;
+    for (auto& ep : endpoints)
+      result |= slot( ep )->prewarm();
+    return result;
+  }
+
+  int send( const Endpoint& ep, const char* msg, size_t msg_size ) {
+    return get( ep )->send( msg, msg_size );
+  }
+
+  int send( const Endpoint& ep, const char* header, size_t header_size, const char* msg, size_t msg_size ) {
+    return get( ep )->send( header, header_size, msg, msg_size );
+  }
+
+  // sweep the pool: close connections idle longer than idle_timeout, reconnect broken ones.
+  // call periodically from a housekeeping thread (optional, get() also checks on checkout).
+  void healthCheck() {
+    std::vector<std::shared_ptr<TCPConnection>> broken;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      auto now = TCPConnection::Clock::now();
+      for (auto it = connections.begin(); it != connections.end();) {
+        auto& conn = it->second;
+        if (idle_timeout < now - conn->lastUsed()) {
+          conn->close();
+          it = connections.erase( it );
+          continue;
+        }
+        if (!conn->healthy())
+          broken.push_back( conn );
+        ++it;
+      }
+    }
+    // reconnect outside the pool's lock:  a connect() to an unreachable host mustn't hold up every get()
+    for (auto& conn : broken)
+      conn->connect();
+  }
+
+  // write out every connection's queue (see TCPConnection::Options::batch).  returns 0 if all succeeded.
+  // outside the pool's lock:  a slow peer mustn't hold up get(), and the watermark callbacks may send
+  int flush() {
+    int result = 0;
+    for (auto& conn : snapshot())
+      result |= conn->flush();
+    return result;
+  }
+
+  // every connection's stats (see TCPConnection::stats())
+  std::vector<TCPStats> stats() {
+    std::lock_guard<std::mutex> lock( mutex );
+    std::vector<TCPStats> result;
+    for (auto& it : connections)
+      result.push_back( it.second->stats() );
+    return result;
+  }
+
+  // write what each connection's socket takes right now, without blocking (see TCPConnection::pump())
+  // (outside the pool's lock, like flush():  on_writable may send)
+  int pump() {
+    int result = 0;
+    for (auto& conn : snapshot())
+      result |= conn->pump();
+    return result;
+  }
+
+  void close() {
+    std::map<Endpoint, std::shared_ptr<TCPConnection>> closing;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      closing.swap( connections );
+    }
+    for (auto& it : closing)
+      it.second->close();  // may wait out a zerocopy linger
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock( mutex );
+    return connections.size();
+  }
+
+  std::chrono::milliseconds health_check_interval{ 1000 };
+  std::chrono::milliseconds idle_timeout{ 60000 };
+
+  // for connections created from now on
+  TCPConnection::Options options;
+
+private:
+  // the connections right now, to work on without holding the pool's lock
+  std::vector<std::shared_ptr<TCPConnection>> snapshot() {
+    std::lock_guard<std::mutex> lock( mutex );
+    std::vector<std::shared_ptr<TCPConnection>> result;
+    result.reserve( connections.size() );
+    for (auto& it : connections)
+      result.push_back( it.second );
+    return result;
+  }
+
+  // the endpoint's connection, created (unconnected) if there isn't one yet
+  std::shared_ptr<TCPConnection> slot( const Endpoint& ep ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    auto& conn = connections[ep];
+    if (!conn)
+      conn = std::make_shared<TCPConnection>( ep, options );
+    return conn;
+  }
+
+  std::mutex mutex;
+  std::map<Endpoint, std::shared_ptr<TCPConnection>> connections;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef SUBA_NET_TCPSTATS
+#define SUBA_NET_TCPSTATS
+
+// Per connection telemetry:  traffic counters, the kernel's view of the connection (TCP_INFO), and a histogram of
+// send-to-ack latency (how long the peer took to acknowledge what we sent, see TCPConnection::Options::ack_timestamps).
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "platform_check.h"
+#include "Histogram.h"
+
+#if IS_POSIX==1
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+struct TCPStats {
+  std::string peer;  // host:port
+
+  uint64_t bytes_out = 0, msgs_out = 0;
+  uint64_t bytes_in = 0, msgs_in = 0;  // framing NONE:  msgs_in counts reads
+
+  // sampled from the kernel when the stats are read (has_info is false where TCP_INFO isn't available)
+  bool has_info = false;
+  uint32_t rtt_us = 0;         // smoothed round trip time
+  uint32_t rttvar_us = 0;
+  uint32_t retransmits = 0;    // total retransmitted segments
+  uint32_t cwnd = 0;           // congestion window, in segments
+  uint32_t unacked = 0;        // segments in flight
+
+  Histogram ack_latency_us;    // send() to acked by the peer
+
+  std::string json() const {
+    char buf[512];
+    snprintf( buf, sizeof( buf ), "{\"peer\": \"%s\", \"bytes_out\": %llu, \"msgs_out\": %llu, \"bytes_in\": %llu, \"msgs_in\": %llu",
+              peer.c_str(), (unsigned long long)bytes_out, (unsigned long long)msgs_out,
+              (unsigned long long)bytes_in, (unsigned long long)msgs_in );
+    std::string s( buf );
+    if (has_info) {
+      snprintf( buf, sizeof( buf ), ", \"rtt_us\": %u, \"rttvar_us\": %u, \"retransmits\": %u, \"cwnd\": %u, \"unacked\": %u",
+                rtt_us, rttvar_us, retransmits, cwnd, unacked );
+      s += buf;
+    }
+    if (ack_latency_us.count())
+      s += ", \"ack_latency_us\": " + ack_latency_us.json();
+    return s + "}";
+  }
+};
+
+#if IS_POSIX==1
+// fill in the kernel's TCP_INFO fields for a connected socket.  returns false if unavailable
+inline bool sampleTCPInfo( int fd, TCPStats& stats ) {
+#if defined(__linux__)
+  tcp_info info;
+  socklen_t len = sizeof( info );
+  if (::getsockopt( fd, IPPROTO_TCP, TCP_INFO, &info, &len ) < 0)
+    return false;
+  stats.rtt_us = info.tcpi_rtt;
+  stats.rttvar_us = info.tcpi_rttvar;
+  stats.retransmits = info.tcpi_total_retrans;
+  stats.cwnd = info.tcpi_snd_cwnd;
+  stats.unacked = info.tcpi_unacked;
+  stats.has_info = true;
+  return true;
+#elif defined(__APPLE__) && defined( TCP_CONNECTION_INFO )
+  tcp_connection_info info;
+  socklen_t len = sizeof( info );
+  if (::getsockopt( fd, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &len ) < 0)
+    return false;
+  stats.rtt_us = info.tcpi_srtt * 1000;  // ms
+  stats.rttvar_us = info.tcpi_rttvar * 1000;
+  stats.retransmits = (uint32_t)info.tcpi_txretransmitpackets;
+  stats.cwnd = info.tcpi_maxseg ? info.tcpi_snd_cwnd / info.tcpi_maxseg : 0;  // bytes
+  stats.unacked = 0;
+  stats.has_info = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// "host:port" of the socket's peer
+inline std::string peerName( int fd ) {
+  sockaddr_storage addr;
+  socklen_t len = sizeof( addr );
+  if (::getpeername( fd, (sockaddr*)&addr, &len ) < 0)
+    return "";
+  char host[INET6_ADDRSTRLEN] = "";
+  uint16_t port = 0;
+  if (addr.ss_family == AF_INET) {
+    const sockaddr_in* a = (const sockaddr_in*)&addr;
+    ::inet_ntop( AF_INET, &a->sin_addr, host, sizeof( host ) );
+    port = ntohs( a->sin_port );
+  } else if (addr.ss_family == AF_INET6) {
+    const sockaddr_in6* a = (const sockaddr_in6*)&addr;
+    ::inet_ntop( AF_INET6, &a->sin6_addr, host, sizeof( host ) );
+    port = ntohs( a->sin6_port );
+  }
+  return std::string( host ) + ":" + std::to_string( port );
+}
+#endif
+
+#endif
@@ -1,10 +1,130 @@
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <vector>
+#include <cstdio>
 #include "platform_check.h"
+#include "BusyPoll.h"
+#include "UDPBatch.h"
+#include "Fragment.h"
+#if IS_POSIX==1 && HAS_ASIO==0
+#include "UDPSender.h"
+#include "PacketRing.h"
+#endif
+
+struct sockaddr_in;
 
 class UDP {
 public:
+    UDP() {
+      // setup defaults (can be overridden)
+      recvCallbacks.push_back( printf_cb );
+    }
     int recv();
     int send( const char* msg, size_t msg_size );
+
+    // send several messages in as few syscalls as possible (one sendmmsg() per 64 on Linux).  returns 0 if all were sent
+    int send( const std::vector<Datagram>& msgs );
+
+    // send msg as consecutive datagrams of segment_size bytes (the last one may be shorter).
+    // Linux splits them in the kernel (UDP GSO, UDP_SEGMENT):  one syscall per 64 datagrams.  returns 0 on success
+    int sendSegmented( const char* msg, size_t msg_size, size_t segment_size );
+
+    // send a message of any size (up to the receiver's reassembly.options.max_message):  split into datagrams of at most
+    // fragment_size bytes with fragment headers (Fragment.h), and put back together by the receiver's recv(), which
+    // hands it to messageCallbacks.  a lost fragment loses the message (after reassembly.options.timeout).
+    // returns 0 on success
+    int sendMessage( const char* msg, size_t msg_size );
+    size_t fragment_size = 1200;
+
+#if IS_POSIX==1 && HAS_ASIO==0
+    // the send() socket:  opened once, connected to the destination, reused by every send
+    UDPSender sender{ "127.0.0.1", 12345 };
+#endif
+
+    // print a status line for every message sent (turn off when sending a lot)
+    bool verbose = true;
+
+    // recv() takes up to batch_size datagrams per syscall (posix:  recvmmsg() on Linux), each up to max_datagram bytes
+    unsigned batch_size = 64;
+    size_t max_datagram = 2048;
+
+    // recv() lets the kernel coalesce a flow's datagrams (UDP GRO, Linux 5.0+), and splits them back up in userspace.
+    // fewer, larger receives for bulk streams.  uses recvmmsg (not io_uring)
+    bool gro = false;
+
+    // low latency receive mode (posix):  spin on the socket for busy_poll.budget before blocking in recvfrom(),
+    // with SO_BUSY_POLL set, and the recv() thread pinned to busy_poll.cpu.  uses recvfrom (not io_uring).
+    BusyPoll busy_poll;
+
+    // receiver group (posix):  shards > 1 binds that many SO_REUSEPORT sockets to the port, each read by its own
+    // worker thread (pinned to a cpu with pin_shards), so a burst is spread over the cores instead of overflowing
+    // one socket's queue.  the kernel picks the socket by a hash of the sender's address and port.
+    // NOTE: callbacks are then called from several threads at once.
+    int shards = 1;
+    bool pin_shards = false;
+
+    // receiver group, Linux:  steer with a reuseport BPF program (SO_ATTACH_REUSEPORT_CBPF), shard = hash( sender ) % shards.
+    // every datagram of a flow lands on the same shard, even as sockets come and go (the default hash then reshuffles)
+    bool steer_by_flow = false;
+
+    // have the kernel timestamp each datagram's arrival (Linux:  SO_TIMESTAMPING, the NIC's clock with
+    // hardware_timestamps), passed to the callbacks.  uses recvmmsg (not io_uring)
+    bool timestamps = false;
+    bool hardware_timestamps = false;
+
+    // datagram callback
+    // called for each datagram received (data is only valid during the call).
+    // timestamp_ns:  when it arrived, per the kernel, ns since the epoch (0:  not recorded, see timestamps)
+    using Callback = std::function<void(const sockaddr_in& sender, int64_t timestamp_ns, const char* buffer, size_t buffer_size)>;
+    std::vector<Callback> recvCallbacks;
+
+    // message callback (see sendMessage()):  called once per reassembled message, with the last fragment's timestamp.
+    // with any set, datagrams with a fragment header go to reassembly, and only the others to recvCallbacks
+    using MessageCallback = std::function<void(const sockaddr_in& sender, int64_t timestamp_ns, const char* msg, size_t msg_size)>;
+    std::vector<MessageCallback> messageCallbacks;
+    Reassembler reassembly;
+
+    // built in data callback - for printf debugging or logging
+    Callback printf_cb = []( const sockaddr_in& sender, int64_t timestamp_ns, const char* buffer, size_t buffer_size ) {
+      printf( "Received: %.*s\n", (int)buffer_size, buffer );
+    };
+
+#if IS_POSIX==1 && HAS_ASIO==0
+    // hand datagrams to consumer threads (handoff.options.consumers > 0):  the receive loop only reads and queues them
+    // in a lock-free ring of preallocated slots, and the consumers run recvCallbacks, so a slow callback no longer
+    // leaves the socket to overflow.  a full ring drops the datagram (handoff.dropped(), handoff.occupancy())
+    Handoff<Arrival> handoff;
+#endif
+
+private:
+    void dispatch( const sockaddr_in& sender, int64_t timestamp_ns, const char* buffer, size_t buffer_size ) {
+      if (!messageCallbacks.empty() && isFragment( buffer, buffer_size )) {
+        reassemble( sender, timestamp_ns, buffer, buffer_size );
+        return;
+      }
+      for (auto& func : recvCallbacks) {
+        func( sender, timestamp_ns, buffer, buffer_size );
+      }
+    }
+    void reassemble( const sockaddr_in& sender, int64_t timestamp_ns, const char* buffer, size_t buffer_size );
+    std::atomic<uint32_t> next_message_id{ std::random_device()() };
+    std::atomic<bool> warned_truncated{ false };
+#if IS_POSIX==1 && HAS_ASIO==0
+    // from the receive loop:  to the consumers, or straight to the callbacks
+    void deliver( const Arrival& from, const char* buffer, size_t buffer_size ) {
+      if (handoff.enabled())
+        handoff.push( from, buffer, buffer_size );
+      else
+        dispatch( from.sender, from.timestamp_ns, buffer, buffer_size );
+    }
+    int bindSocket();
+    int serve( int sock );
+    int recvSharded();
+    int steerByFlow( int sock );
+#endif
 };
 
 #if HAS_ASIO==1
@@ -25,7 +145,8 @@ int UDP::send( const char* msg, size_t msg_size ) {
 
         socket.send_to(asio::buffer(msg, msg_size), endpoint);
 
-        std::cout << "Message sent successfully." << std::endl;
+        if (verbose)
+            std::cout << "Message sent successfully." << std::endl;
     } catch (std::exception& e) {
         std::cerr << "Exception: " << e.what() << std::endl;
     }
@@ -33,19 +154,49 @@ int UDP::send( const char* msg, size_t msg_size ) {
     return 0;
 }
 
+int UDP::send( const std::vector<Datagram>& msgs ) {
+    try {
+        asio::io_context io_context;
+
+        asio::ip::udp::socket socket(io_context);
+        socket.open(asio::ip::udp::v4());
+
+        asio::ip::udp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), 12345);
+
+        for (auto& msg : msgs)
+            socket.send_to(asio::buffer(msg.data, msg.size), endpoint);
+
+        if (verbose)
+            std::cout << msgs.size() << " messages sent successfully." << std::endl;
+    } catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+int UDP::sendSegmented( const char* msg, size_t msg_size, size_t segment_size ) {
+    if (segment_size == 0)
+        return 1;
+    std::vector<Datagram> msgs;
+    for (size_t off = 0; off < msg_size; off += segment_size)
+        msgs.push_back( Datagram{ msg + off, std::min( segment_size, msg_size - off ) } );
+    return send( msgs );
+}
+
 int UDP::recv() {
     try {
         asio::io_context io_context;
 
         asio::ip::udp::socket socket(io_context, asio::ip::udp::endpoint(asio::ip::udp::v4(), 5353));
 
-        char buffer[512];
+        std::vector<char> buffer( 65536 );  // the largest UDP datagram:  nothing gets truncated
         asio::ip::udp::endpoint senderEndpoint;
 
         while (true) {
             size_t len = socket.receive_from(asio::buffer(buffer), senderEndpoint);
-            buffer[len] = '\0'; // Null-terminate the received data
-            std::cout << "Received message: " << buffer << std::endl;
+            dispatch( *(const sockaddr_in*)senderEndpoint.data(), 0, buffer.data(), len );
         }
     } catch (std::exception& e) {
         std::cerr << "Exception: " << e.what() << std::endl;
@@ -61,37 +212,46 @@ int UDP::recv() {
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
+#include <thread>
+#include "utils.h"
+#if defined(__linux__)
+#include <linux/filter.h>
+#endif
+#if HAS_IO_URING==1
+#include "IOUring.h"
+#endif
 
 int UDP::send( const char* msg, size_t msg_size ) {
-  int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0) {
-    std::cerr << "Socket creation failed." << std::endl;
-    printf("Error code: %d\n", errno);
+  if (sender.send( msg, msg_size ) != 0)
     return 1;
-  }
+  if (verbose)
+    std::cout << "Message sent successfully." << std::endl;
+  return 0;
+}
 
-  sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(12345);
-  ::inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+int UDP::send( const std::vector<Datagram>& msgs ) {
+  if (sender.send( msgs ) != 0)
+    return 1;
+  if (verbose)
+    std::cout << msgs.size() << " messages sent successfully." << std::endl;
+  return 0;
+}
 
-  if (::sendto(sock, msg, msg_size, 0, (sockaddr*)&addr, sizeof(addr)) < 0) {
-    std::cerr << "sendto failed." << std::endl;
-    printf("Error code: %d\n", errno);
-  } else {
+int UDP::sendSegmented( const char* msg, size_t msg_size, size_t segment_size ) {
+  if (sender.sendSegmented( msg, msg_size, segment_size ) != 0)
+    return 1;
+  if (verbose)
     std::cout << "Message sent successfully." << std::endl;
-  }
-
-  ::close(sock);
   return 0;
 }
 
-int UDP::recv() {
+// bind a receive socket to the port, with SO_REUSEPORT (so a receiver group can share it).  returns the socket, or -1
+int UDP::bindSocket() {
   int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
   if (sock < 0) {
     std::cerr << "Socket creation failed." << std::endl;
     printf("Error code: %d\n", errno);
-    return 1;
+    return -1;
   }
 
   // reuse
@@ -99,12 +259,14 @@ int UDP::recv() {
 #if defined( SO_REUSEPORT )
   if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char*)&opt, sizeof(opt)) < 0) {
     printf("setsockopt(SO_REUSEPORT) failed.  Error code: %d\n", errno);
-    return 1;
+    ::close(sock);
+    return -1;
   }
 #elif defined( SO_REUSEADDR )
   if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt)) < 0) {
     printf("setsockopt(SO_REUSEADDR) failed.  Error code: %d\n", errno);
-    return 1;
+    ::close(sock);
+    return -1;
   }
 #endif
 
@@ -118,29 +280,139 @@ int UDP::recv() {
     std::cerr << "Bind failed." << std::endl;
     printf("Error code: %d\n", errno);
     ::close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int UDP::recv() {
+  handoff.start( [this]( const Arrival& from, const char* buffer, size_t buffer_size ) {
+    dispatch( from.sender, from.timestamp_ns, buffer, buffer_size );
+  });
+#if defined( SO_REUSEPORT )
+  if (1 < shards)
+    return recvSharded();
+#endif
+  busy_poll.pin();
+
+  int sock = bindSocket();
+  if (sock < 0)
     return 1;
+  return serve( sock );
+}
+
+// run the socket's receive loop on this thread, until it fails
+int UDP::serve( int sock ) {
+  busy_poll.apply( sock );
+
+#if HAS_IO_URING==1
+  if (!busy_poll.enabled && !gro && !timestamps) {
+    int result = recvDatagrams( sock, [this]( const sockaddr_in& senderAddr, const char* buffer, size_t size ) {
+      deliver( Arrival{ senderAddr, 0 }, buffer, size );
+    });
+    if (0 <= result) {
+      ::close(sock);
+      return result;
+    }
+    fprintf( stderr, "io_uring unavailable, using recvfrom.\n" );
   }
+#endif
 
-  char buffer[1024];
-  sockaddr_in senderAddr;
-  socklen_t senderAddrSize = sizeof(senderAddr);
+  // many datagrams per syscall
+  RecvBatch batch( 0 < batch_size ? batch_size : 1, gro ? std::max( max_datagram, (size_t)65535 ) : max_datagram );
+  if (gro && !batch.enableGRO( sock ))
+    fprintf( stderr, "setsockopt(UDP_GRO) failed, receiving datagrams one by one.  Error code: %s\n", strerror(errno) );
+  if (timestamps && !batch.enableTimestamps( sock, hardware_timestamps ))
+    fprintf( stderr, "setsockopt(SO_TIMESTAMPING) failed, no arrival timestamps.  Error code: %s\n", strerror(errno) );
 
   while (true) {
-    printf( "Receiving...\n" );
-    int bytesReceived = ::recvfrom(sock, buffer, sizeof(buffer) - 1, 0, (sockaddr*)&senderAddr, &senderAddrSize);
-    if (bytesReceived < 0) {
-      std::cerr << "recvfrom failed." << std::endl;
+    int received = -1;
+    if (!busy_poll.enabled || !busy_poll.spin( [&]() {
+          received = batch.recv( sock, MSG_DONTWAIT );
+          return 0 <= received || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+        }))
+      received = batch.recv( sock );
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "recvmmsg failed." << std::endl;
       printf("Error code: %d\n", errno);
       break;
     }
-    buffer[bytesReceived] = '\0';
-    std::cout << "Received: " << buffer << std::endl;
+    for (int i = 0; i < received; ++i) {
+      if (batch.truncated( i ) && !warned_truncated) {
+        fprintf( stderr, "UDP datagram larger than max_datagram (%zu bytes) dropped, raise it or use sendMessage().\n", max_datagram );
+        warned_truncated = true;
+      }
+    }
+    batch.forEach( [this]( const sockaddr_in& senderAddr, int64_t timestamp_ns, const char* data, size_t size ) {
+      deliver( Arrival{ senderAddr, timestamp_ns }, data, size );
+    });
   }
 
   ::close(sock);
   return 0;
 }
 
+#if defined( SO_REUSEPORT )
+// one SO_REUSEPORT socket + receive loop per worker thread:  the kernel spreads datagrams across the sockets by flow,
+// so each worker drains its own queue, with no shared socket or lock between them.
+int UDP::recvSharded() {
+  std::vector<int> socks;
+  for (int i = 0; i < shards; ++i) {
+    int sock = bindSocket();
+    if (sock < 0) {
+      for (int s : socks)
+        ::close(s);
+      return 1;
+    }
+    socks.push_back( sock );
+  }
+  if (steer_by_flow && steerByFlow( socks[0] ) != 0)
+    fprintf( stderr, "Could not attach the reuseport steering program, using the kernel's default hash.\n" );
+
+  std::vector<std::thread> workers;
+  unsigned cpus = std::max( 1u, std::thread::hardware_concurrency() );
+  for (int i = 0; i < shards; ++i) {
+    workers.emplace_back( [this, i, cpus, sock = socks[i]]() {
+      if (pin_shards && pinThread( i % cpus ) != 0)
+        fprintf( stderr, "Could not pin shard %d to cpu %u.\n", i, i % cpus );
+      serve( sock );
+    });
+  }
+  for (auto& t : workers)
+    t.join();
+  return 1;
+}
+#endif
+
+// classic BPF for the reuseport group, returning the socket to use (numbered in bind order):
+// a hash of the sender's IPv4 address and port, % shards.  (skb->hash isn't set for every packet, e.g. on loopback)
+int UDP::steerByFlow( int sock ) {
+#if defined( SO_ATTACH_REUSEPORT_CBPF )
+  sock_filter code[] = {
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_NET_OFF + 12) },   // A = source address
+    { BPF_ST, 0, 0, 0 },                                                 // M[0] = A
+    { BPF_LDX | BPF_B | BPF_MSH, 0, 0, (uint32_t)SKF_NET_OFF },          // X = IP header length
+    { BPF_LD | BPF_H | BPF_IND, 0, 0, (uint32_t)SKF_NET_OFF },           // A = source port
+    { BPF_LDX | BPF_MEM, 0, 0, 0 },                                      // X = M[0]
+    { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+    { BPF_ALU | BPF_MUL | BPF_K, 0, 0, 0x9e3779b1 },                     // mix
+    { BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)shards },
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  sock_fprog prog = { (unsigned short)(sizeof( code ) / sizeof( code[0] )), code };
+  if (::setsockopt( sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof( prog ) ) < 0) {
+    fprintf( stderr, "setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed.  Error code: %s\n", strerror(errno) );
+    return 1;
+  }
+  return 0;
+#else
+  return 1;
+#endif
+}
+
 #elif IS_WINDOWS==1
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -170,7 +442,8 @@ int UDP::send( const char* msg, size_t msg_size ) {
     if (sendto(sock, msg, msg_size, 0, (sockaddr*)&server, sizeof(server)) == SOCKET_ERROR) {
         std::cerr << "sendto failed." << std::endl;
     } else {
-        std::cout << "Message sent successfully." << std::endl;
+        if (verbose)
+            std::cout << "Message sent successfully." << std::endl;
     }
 
     closesocket(sock);
@@ -178,6 +451,48 @@ int UDP::send( const char* msg, size_t msg_size ) {
     return 0;
 }
 
+int UDP::send( const std::vector<Datagram>& msgs ) {
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) {
+        std::cerr << "Socket creation failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_port = htons(12345);
+    inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+
+    int result = 0;
+    for (auto& msg : msgs) {
+        if (sendto(sock, msg.data, (int)msg.size, 0, (sockaddr*)&server, sizeof(server)) == SOCKET_ERROR) {
+            std::cerr << "sendto failed." << std::endl;
+            result = 1;
+            break;
+        }
+    }
+
+    closesocket(sock);
+    WSACleanup();
+    return result;
+}
+
+int UDP::sendSegmented( const char* msg, size_t msg_size, size_t segment_size ) {
+    if (segment_size == 0)
+        return 1;
+    std::vector<Datagram> msgs;
+    for (size_t off = 0; off < msg_size; off += segment_size)
+        msgs.push_back( Datagram{ msg + off, std::min( segment_size, msg_size - off ) } );
+    return send( msgs );
+}
+
 int UDP::recv() {
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
@@ -204,19 +519,18 @@ int UDP::recv() {
         return 1;
     }
 
-    char buffer[512];
+    std::vector<char> buffer( 65536 );  // the largest UDP datagram:  nothing gets truncated
     sockaddr_in senderAddr;
     int senderAddrSize = sizeof(senderAddr);
 
     while (true) {
-        int recvLen = recvfrom(sock, buffer, sizeof(buffer), 0, (sockaddr*)&senderAddr, &senderAddrSize);
+        int recvLen = recvfrom(sock, buffer.data(), (int)buffer.size(), 0, (sockaddr*)&senderAddr, &senderAddrSize);
         if (recvLen == SOCKET_ERROR) {
             std::cerr << "recvfrom failed." << std::endl;
             break;
         }
 
-        buffer[recvLen] = '\0'; // Null-terminate the received data
-        std::cout << "Received message: " << buffer << std::endl;
+        dispatch( senderAddr, 0, buffer.data(), recvLen );
     }
 
     closesocket(sock);
@@ -224,3 +538,23 @@ int UDP::recv() {
     return 0;
 }
 #endif
+
+// every platform:  fragments go out through send( msgs )
+int UDP::sendMessage( const char* msg, size_t msg_size ) {
+  std::vector<char> scratch;
+  std::vector<Datagram> fragments;
+  if (fragmentMessage( next_message_id++, msg, msg_size, fragment_size, scratch, fragments ) == 0) {
+    fprintf( stderr, "UDP message of %zu bytes can't be split into fragments of %zu bytes.\n", msg_size, fragment_size );
+    return 1;
+  }
+  return send( fragments );
+}
+
+void UDP::reassemble( const sockaddr_in& sender, int64_t timestamp_ns, const char* buffer, size_t buffer_size ) {
+  uint64_t source = ((uint64_t)sender.sin_addr.s_addr << 16) | sender.sin_port;
+  reassembly.add( source, buffer, buffer_size, [&]( const char* msg, size_t msg_size ) {
+    for (auto& func : messageCallbacks) {
+      func( sender, timestamp_ns, msg, msg_size );
+    }
+  });
+}
@@ -0,0 +1,307 @@
+#ifndef SUBA_NET_UDPBATCH
+#define SUBA_NET_UDPBATCH
+
+// Batched datagram I/O (posix):  many datagrams per syscall, recvmmsg() / sendmmsg() on Linux.
+// (elsewhere the same API loops recvmsg() / sendto(), so callers don't need to care)
+// - RecvBatch:      preallocated slots, filled by one recv() call (optionally with kernel arrival timestamps)
+// - sendBatch:      write a list of datagrams to one destination
+// - sendSegmented:  one large buffer out as many equal sized datagrams, split by the kernel (UDP GSO)
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "platform_check.h"
+
+// a datagram to send (the caller keeps the data alive for the call)
+struct Datagram {
+  const char* data;
+  size_t size;
+};
+
+#if IS_POSIX==1
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <time.h>
+#if defined(__linux__)
+#include <netinet/udp.h>
+#include <linux/net_tstamp.h>
+#endif
+
+// a received datagram's origin:  sender, and the kernel's arrival timestamp (ns since the epoch, 0:  not recorded)
+struct Arrival {
+  sockaddr_in sender;
+  int64_t timestamp_ns;
+};
+
+class RecvBatch {
+public:
+  // count slots of slot_size bytes each (larger datagrams are truncated, see truncated())
+  RecvBatch( unsigned count = 64, size_t slot_size = 2048 ) : slot_size( slot_size ), buffers( count * slot_size ), iovs( count ), addrs( count ), lens( count ), flags( count ), segments( count, 0 ), stamps( count, 0 ) {
+#if defined(__linux__)
+    msgs.resize( count );
+#endif
+    for (unsigned i = 0; i < count; ++i) {
+      iovs[i].iov_base = &buffers[i * slot_size];
+      iovs[i].iov_len = slot_size;
+    }
+  }
+  RecvBatch( const RecvBatch& ) = delete;
+  RecvBatch& operator=( const RecvBatch& ) = delete;
+
+  // UDP GRO (Linux 5.0+, UDP_GRO):  the kernel may coalesce consecutive same sized datagrams from a flow into one
+  // super-datagram (up to 64KB, so slot_size should be 65535).  forEach() splits them back up.
+  // returns false where unsupported (datagrams then just arrive one by one)
+  bool enableGRO( int sock ) {
+#if defined( UDP_GRO )
+    int opt = 1;
+    if (::setsockopt( sock, IPPROTO_UDP, UDP_GRO, (char*)&opt, sizeof(opt) ) < 0)
+      return false;
+    control.assign( iovs.size() * CONTROL_SIZE, 0 );
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // kernel receive timestamps (Linux):  SO_TIMESTAMPING, stamped when the packet reaches the stack (or by the NIC,
+  // with hardware:  the device must have rx timestamping turned on, SIOCSHWTSTAMP), else SO_TIMESTAMPNS.
+  // they show up in timestamp() and forEach().  returns false where unsupported
+  bool enableTimestamps( int sock, bool hardware = false ) {
+#if defined(__linux__) && defined( SO_TIMESTAMPING )
+    int opt = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (hardware)
+      opt |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (::setsockopt( sock, SOL_SOCKET, SO_TIMESTAMPING, (char*)&opt, sizeof(opt) ) < 0) {
+      opt = 1;
+      if (::setsockopt( sock, SOL_SOCKET, SO_TIMESTAMPNS, (char*)&opt, sizeof(opt) ) < 0)
+        return false;
+    }
+    control.assign( iovs.size() * CONTROL_SIZE, 0 );
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // receive up to capacity() datagrams:  waits for the first (unless flags has MSG_DONTWAIT), then takes whatever
+  // else is already queued.  returns how many were received, or -1 on error (errno is set)
+  int recv( int sock, int recv_flags = 0 ) {
+    received = 0;
+#if defined(__linux__)
+    for (unsigned i = 0; i < msgs.size(); ++i) {
+      msghdr& mh = msgs[i].msg_hdr;
+      mh = msghdr();
+      mh.msg_name = &addrs[i];
+      mh.msg_namelen = sizeof( sockaddr_in );
+      mh.msg_iov = &iovs[i];
+      mh.msg_iovlen = 1;
+      if (!control.empty()) {
+        mh.msg_control = &control[i * CONTROL_SIZE];
+        mh.msg_controllen = CONTROL_SIZE;
+      }
+    }
+    int n = ::recvmmsg( sock, msgs.data(), (unsigned)msgs.size(), recv_flags | MSG_WAITFORONE, nullptr );
+    if (n < 0)
+      return -1;
+    for (int i = 0; i < n; ++i) {
+      lens[i] = msgs[i].msg_len;
+      flags[i] = msgs[i].msg_hdr.msg_flags;
+      segments[i] = 0;
+      stamps[i] = 0;
+      if (!control.empty())
+        readControl( msgs[i].msg_hdr, segments[i], stamps[i] );
+    }
+    received = (unsigned)n;
+#else
+    for (unsigned i = 0; i < iovs.size(); ++i) {
+      socklen_t addr_len = sizeof( sockaddr_in );
+      msghdr mh = {};
+      mh.msg_name = &addrs[i];
+      mh.msg_namelen = addr_len;
+      mh.msg_iov = &iovs[i];
+      mh.msg_iovlen = 1;
+      ssize_t n = ::recvmsg( sock, &mh, i == 0 ? recv_flags : recv_flags | MSG_DONTWAIT );
+      if (n < 0) {
+        if (i == 0)
+          return -1;
+        break;  // nothing more queued
+      }
+      lens[i] = (size_t)n;
+      flags[i] = mh.msg_flags;
+      segments[i] = 0;
+      stamps[i] = 0;
+      ++received;
+    }
+#endif
+    return (int)received;
+  }
+
+  unsigned capacity() const { return (unsigned)iovs.size(); }
+  unsigned size() const { return received; }  // datagrams from the last recv()
+
+  // the i'th datagram of the last recv() (valid until the next one)
+  const char* data( unsigned i ) const { return &buffers[i * slot_size]; }
+  size_t length( unsigned i ) const { return lens[i]; }
+  const sockaddr_in& sender( unsigned i ) const { return addrs[i]; }
+  bool truncated( unsigned i ) const { return (flags[i] & MSG_TRUNC) != 0; }
+  // the size of the datagrams the kernel coalesced into the i'th (GRO), or 0 for a plain datagram
+  size_t segmentSize( unsigned i ) const { return segments[i]; }
+  // when the i'th datagram arrived (see enableTimestamps()):  ns since the epoch, or 0 if not recorded
+  int64_t timestamp( unsigned i ) const { return stamps[i]; }
+
+  // call cb( const sockaddr_in& sender, int64_t timestamp_ns, const char* data, size_t size ) for each datagram of the
+  // last recv(), with GRO super-datagrams split back into the datagrams that were sent (the last one may be shorter).
+  // truncated datagrams are skipped
+  template <typename F>
+  void forEach( F&& cb ) const {
+    for (unsigned i = 0; i < received; ++i) {
+      if (flags[i] & MSG_TRUNC)
+        continue;
+      size_t seg = segments[i];
+      if (seg == 0 || lens[i] <= seg) {
+        cb( addrs[i], stamps[i], data( i ), lens[i] );
+        continue;
+      }
+      for (size_t off = 0; off < lens[i]; off += seg)
+        cb( addrs[i], stamps[i], data( i ) + off, lens[i] - off < seg ? lens[i] - off : seg );
+    }
+  }
+
+private:
+#if defined(__linux__)
+  // the GRO segment size and the arrival timestamp, from the cmsgs
+  static void readControl( const msghdr& mh, size_t& gro_size, int64_t& timestamp_ns ) {
+    for (cmsghdr* c = CMSG_FIRSTHDR( &mh ); c != nullptr; c = CMSG_NXTHDR( (msghdr*)&mh, c )) {
+#if defined( UDP_GRO )
+      if (c->cmsg_level == IPPROTO_UDP && c->cmsg_type == UDP_GRO) {
+        int size = 0;
+        memcpy( &size, CMSG_DATA( c ), sizeof( size ) );
+        gro_size = 0 < size ? (size_t)size : 0;
+      }
+#endif
+      if (c->cmsg_level != SOL_SOCKET)
+        continue;
+#if defined( SCM_TIMESTAMPING )
+      if (c->cmsg_type == SCM_TIMESTAMPING) {
+        timespec ts[3];  // [0] software, [2] hardware (raw)
+        memcpy( ts, CMSG_DATA( c ), sizeof( ts ) );
+        const timespec& t = (ts[2].tv_sec || ts[2].tv_nsec) ? ts[2] : ts[0];
+        timestamp_ns = (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+      }
+#endif
+#if defined( SCM_TIMESTAMPNS )
+      if (c->cmsg_type == SCM_TIMESTAMPNS) {
+        timespec t;
+        memcpy( &t, CMSG_DATA( c ), sizeof( t ) );
+        timestamp_ns = (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+      }
+#endif
+    }
+  }
+#endif
+  static const size_t CONTROL_SIZE = 128;  // room for a UDP_GRO and a timestamping cmsg
+
+  size_t slot_size;
+  std::vector<char> buffers;
+  std::vector<iovec> iovs;
+  std::vector<sockaddr_in> addrs;
+  std::vector<size_t> lens;
+  std::vector<int> flags;
+  std::vector<size_t> segments;
+  std::vector<int64_t> stamps;
+  std::vector<char> control;  // per slot cmsg space, once GRO or timestamps are on
+#if defined(__linux__)
+  std::vector<mmsghdr> msgs;
+#endif
+  unsigned received = 0;
+};
+
+// send count datagrams to to (or, with to == nullptr, to the connected peer) in as few syscalls as possible.
+// returns how many were sent (fewer than count when one fails:  errno is set), or -1 if none were
+inline int sendBatch( int sock, const Datagram* msgs, size_t count, const sockaddr_in* to = nullptr ) {
+  size_t sent = 0;
+#if defined(__linux__)
+  static const size_t CHUNK = 64;
+  mmsghdr hdrs[CHUNK];
+  iovec iovs[CHUNK];
+  while (sent < count) {
+    size_t n = count - sent < CHUNK ? count - sent : CHUNK;
+    for (size_t i = 0; i < n; ++i) {
+      iovs[i].iov_base = (void*)msgs[sent + i].data;
+      iovs[i].iov_len = msgs[sent + i].size;
+      hdrs[i] = mmsghdr();
+      hdrs[i].msg_hdr.msg_name = (void*)to;
+      hdrs[i].msg_hdr.msg_namelen = to ? sizeof( sockaddr_in ) : 0;
+      hdrs[i].msg_hdr.msg_iov = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int result = ::sendmmsg( sock, hdrs, (unsigned)n, 0 );
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    sent += result;  // a short count:  the next call retries (and reports) the one that failed
+  }
+#else
+  for (; sent < count; ++sent) {
+    if (::sendto( sock, msgs[sent].data, msgs[sent].size, 0, (const sockaddr*)to, to ? sizeof( sockaddr_in ) : 0 ) < 0)
+      break;
+  }
+#endif
+  return sent == 0 && 0 < count ? -1 : (int)sent;
+}
+
+// UDP GSO (Linux 4.18+, UDP_SEGMENT):  send len bytes as consecutive datagrams of segment_size bytes (the last one may
+// be shorter), handing the kernel up to 64 of them per sendmsg() instead of one per syscall.
+// falls back to sendBatch() where the kernel or the device can't segment.  returns 0 on success, 1 on error
+inline int sendSegmented( int sock, const char* buf, size_t len, size_t segment_size, const sockaddr_in* to = nullptr ) {
+  if (segment_size == 0)
+    return 1;
+  size_t off = 0;
+#if defined( UDP_SEGMENT )
+  static const size_t MAX_SEGMENTS = 64;
+  static const size_t MAX_GSO_BYTES = 65000;  // the super-datagram must still fit in one (64KB) UDP datagram
+  size_t per_call = MAX_GSO_BYTES / segment_size < MAX_SEGMENTS ? MAX_GSO_BYTES / segment_size : MAX_SEGMENTS;
+  uint16_t gso_size = (uint16_t)segment_size;
+  while (0 < per_call && off < len) {
+    size_t n = len - off < per_call * segment_size ? len - off : per_call * segment_size;
+    iovec iov = { (void*)(buf + off), n };
+    char control[CMSG_SPACE( sizeof( uint16_t ) )] = {};
+    msghdr mh = {};
+    mh.msg_name = (void*)to;
+    mh.msg_namelen = to ? sizeof( sockaddr_in ) : 0;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (segment_size < n) {  // a single datagram goes out as is
+      mh.msg_control = control;
+      mh.msg_controllen = sizeof( control );
+      cmsghdr* c = CMSG_FIRSTHDR( &mh );
+      c->cmsg_level = SOL_UDP;
+      c->cmsg_type = UDP_SEGMENT;
+      c->cmsg_len = CMSG_LEN( sizeof( uint16_t ) );
+      memcpy( CMSG_DATA( c ), &gso_size, sizeof( gso_size ) );
+    }
+    ssize_t result = ::sendmsg( sock, &mh, 0 );
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+        break;  // no GSO here:  send the rest one by one
+      return 1;
+    }
+    off += n;
+  }
+#endif
+  std::vector<Datagram> rest;
+  for (; off < len; off += segment_size)
+    rest.push_back( Datagram{ buf + off, len - off < segment_size ? len - off : segment_size } );
+  return sendBatch( sock, rest.data(), rest.size(), to ) == (int)rest.size() ? 0 : 1;
+}
+#endif
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef SUBA_NET_UDPSENDER
+#define SUBA_NET_UDPSENDER
+
+// Long lived UDP sender (posix only):  one socket kept open for every send() to a destination, connect()ed to it
+// so the kernel resolves the route once instead of per datagram.  (a socket per datagram costs orders of magnitude more)
+// Optionally paced (see Pacing.h):  a token bucket per sender (destination), and one shared by every sender.
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include "platform_check.h"
+#include "UDPBatch.h"
+#include "Pacing.h"
+#if defined(__linux__)
+#include <linux/net_tstamp.h>
+#endif
+
+class UDPSender {
+public:
+  struct Options {
+    bool connect = true;      // connect() to the destination:  cached route, and send() instead of sendto()
+    int multicast_ttl = -1;   // IP_MULTICAST_TTL (-1:  the system default, 1)
+    int sndbuf = 0;           // SO_SNDBUF (0:  the system default)
+    // paced sends:  stamp each datagram with its departure time (SO_TXTIME, Linux 4.19+) and let the qdisc hold it,
+    // instead of sleeping in send().  needs the fq qdisc on the outgoing device, others send right away.
+    // (not etf:  it wants CLOCK_TAI timestamps, the schedule here is CLOCK_MONOTONIC)
+    bool txtime = false;
+  };
+
+  // pacing for this destination (off until pacing.setRate()), and for all senders together.  a paced send() waits
+  // (or, with txtime, is stamped) until both buckets allow it.  sizes count the IPv4 + UDP headers too
+  TokenBucket pacing;
+  static TokenBucket& globalPacing() {
+    static TokenBucket bucket;
+    return bucket;
+  }
+
+  UDPSender( const std::string& host, uint16_t port ) : host( host ), port( port ) {}
+  UDPSender( const std::string& host, uint16_t port, const Options& opts ) : host( host ), port( port ), options( opts ) {}
+  ~UDPSender() { close(); }
+  UDPSender( const UDPSender& ) = delete;
+  UDPSender& operator=( const UDPSender& ) = delete;
+
+  // create (and connect) the socket.  send() does this on first use.  returns 0 on success, 1 on error
+  int open() {
+    if (0 <= fd)
+      return 0;
+    std::lock_guard<std::mutex> lock( mutex );
+    if (0 <= fd)
+      return 0;
+
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* res = nullptr;
+    int err = ::getaddrinfo( host.c_str(), std::to_string( port ).c_str(), &hints, &res );
+    if (err != 0 || res == nullptr) {
+      fprintf( stderr, "getaddrinfo(%s:%u) failed.  Error: %s\n", host.c_str(), port, gai_strerror( err ) );
+      return 1;
+    }
+    memcpy( &addr, res->ai_addr, sizeof( addr ) );
+    ::freeaddrinfo( res );
+
+    int sock = ::socket( AF_INET, SOCK_DGRAM, 0 );
+    if (sock < 0) {
+      fprintf( stderr, "Socket creation failed.  Error code: %s\n", strerror(errno) );
+      return 1;
+    }
+    if (0 <= options.multicast_ttl) {
+      unsigned char ttl = (unsigned char)options.multicast_ttl;
+      ::setsockopt( sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl) );
+    }
+    if (0 < options.sndbuf)
+      ::setsockopt( sock, SOL_SOCKET, SO_SNDBUF, (const char*)&options.sndbuf, sizeof(options.sndbuf) );
+#if defined( SO_TXTIME )
+    if (options.txtime) {
+      sock_txtime cfg = {};
+      cfg.clockid = CLOCK_MONOTONIC;
+      txtime = ::setsockopt( sock, SOL_SOCKET, SO_TXTIME, (const char*)&cfg, sizeof(cfg) ) == 0;
+      if (!txtime)
+        fprintf( stderr, "SO_TXTIME unavailable, pacing by sleeping.  Error code: %s\n", strerror(errno) );
+    }
+#endif
+    if (options.connect && ::connect( sock, (const sockaddr*)&addr, sizeof( addr ) ) < 0) {
+      fprintf( stderr, "connect(%s:%u) failed.  Error code: %s\n", host.c_str(), port, strerror(errno) );
+      ::close( sock );
+      return 1;
+    }
+    fd = sock;
+    return 0;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock( mutex );
+    if (0 <= fd) {
+      ::close( fd );
+      fd = -1;
+    }
+  }
+
+  // send one datagram.  returns 0 on success, 1 on error
+  int send( const char* msg, size_t msg_size ) {
+    if (open() != 0)
+      return 1;
+    int64_t at = departure( msg_size + HEADERS );
+    if (at != 0 && !txtime)
+      sleepUntil( at );
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      ssize_t n = write( msg, msg_size, txtime ? at : 0 );
+      if (0 <= n)
+        return 0;
+      if (errno != EINTR && !(errno == ECONNREFUSED && attempt == 0))
+        break;  // (a connected socket reports an earlier datagram's ICMP port unreachable once:  retry past it)
+    }
+    fprintf( stderr, "send to %s:%u failed.  Error code: %s\n", host.c_str(), port, strerror(errno) );
+    return 1;
+  }
+
+  // send several datagrams, sendmmsg() on Linux.  returns 0 if all were sent.
+  // paced:  the ones already due go out together, the batch sleeps before each that isn't (txtime:  one sendmsg() each)
+  int send( const std::vector<Datagram>& msgs ) {
+    if (open() != 0)
+      return 1;
+    int sent = 0;
+    if (!pacing.limited() && !globalPacing().limited()) {
+      sent = sendBatch( fd, msgs.data(), msgs.size(), options.connect ? nullptr : &addr );
+    } else if (txtime) {
+      for (; sent < (int)msgs.size(); ++sent) {
+        if (write( msgs[sent].data, msgs[sent].size, departure( msgs[sent].size + HEADERS ) ) < 0)
+          break;
+      }
+    } else {
+      size_t due = 0;  // msgs[due, i) may leave now
+      for (size_t i = 0; i <= msgs.size(); ++i) {
+        int64_t at = i < msgs.size() ? departure( msgs[i].size + HEADERS ) : 0;
+        if (at == 0 && i < msgs.size())
+          continue;
+        int n = sendBatch( fd, msgs.data() + due, i - due, options.connect ? nullptr : &addr );
+        sent += 0 < n ? n : 0;
+        if (n < (int)(i - due))
+          break;
+        due = i;
+        if (at != 0)
+          sleepUntil( at );
+      }
+    }
+    if (sent < (int)msgs.size()) {
+      fprintf( stderr, "sendmmsg to %s:%u failed after %d of %zu.  Error code: %s\n", host.c_str(), port, sent < 0 ? 0 : sent, msgs.size(), strerror(errno) );
+      return 1;
+    }
+    return 0;
+  }
+
+  // send msg as datagrams of segment_size bytes, split by the kernel (UDP GSO) where it can.  returns 0 on success.
+  // paced:  waits until the whole message may leave (the segments then go out back to back)
+  int sendSegmented( const char* msg, size_t msg_size, size_t segment_size ) {
+    if (open() != 0)
+      return 1;
+    if (segment_size != 0) {
+      int64_t at = departure( msg_size + (msg_size / segment_size + 1) * HEADERS );
+      if (at != 0)
+        sleepUntil( at );
+    }
+    if (::sendSegmented( fd, msg, msg_size, segment_size, options.connect ? nullptr : &addr ) != 0) {
+      fprintf( stderr, "segmented send to %s:%u failed.  Error code: %s\n", host.c_str(), port, strerror(errno) );
+      return 1;
+    }
+    return 0;
+  }
+
+  int socket() const { return fd; }
+
+  const std::string host;
+  const uint16_t port;
+  const Options options;
+
+private:
+  static const size_t HEADERS = 28;  // IPv4 + UDP
+
+  // book a datagram with both buckets.  returns when it may leave, or 0 for right now
+  int64_t departure( size_t bytes ) {
+    if (!pacing.limited() && !globalPacing().limited())
+      return 0;
+    int64_t now = monotonicNs();
+    int64_t at = std::max( pacing.reserve( bytes, now ), globalPacing().reserve( bytes, now ) );
+    return now < at ? at : 0;
+  }
+
+  // one datagram, stamped with departure time at (SO_TXTIME) unless it's 0
+  ssize_t write( const char* msg, size_t msg_size, int64_t at ) {
+#if defined( SO_TXTIME )
+    if (at != 0) {
+      iovec iov = { (void*)msg, msg_size };
+      char control[CMSG_SPACE( sizeof( uint64_t ) )] = {};
+      msghdr mh = {};
+      mh.msg_name = options.connect ? nullptr : (void*)&addr;
+      mh.msg_namelen = options.connect ? 0 : sizeof( addr );
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = control;
+      mh.msg_controllen = sizeof( control );
+      cmsghdr* c = CMSG_FIRSTHDR( &mh );
+      c->cmsg_level = SOL_SOCKET;
+      c->cmsg_type = SCM_TXTIME;
+      c->cmsg_len = CMSG_LEN( sizeof( uint64_t ) );
+      uint64_t when = (uint64_t)at;
+      memcpy( CMSG_DATA( c ), &when, sizeof( when ) );
+      return ::sendmsg( fd, &mh, 0 );
+    }
+#endif
+    return options.connect ? ::send( fd, msg, msg_size, 0 ) : ::sendto( fd, msg, msg_size, 0, (const sockaddr*)&addr, sizeof( addr ) );
+  }
+
+  std::mutex mutex;  // open() / close()
+  std::atomic<int> fd{ -1 };
+  sockaddr_in addr = {};
+  bool txtime = false;  // SO_TXTIME is on
+};
+
+#endif
@@ -5,6 +5,11 @@
 #include "platform_check.h"
 #include "utils.h"
 #include "mDNSData.h"
+#include "UDPBatch.h"
+#if IS_POSIX==1 && HAS_ASIO==0
+#include "UDPSender.h"
+#include "PacketRing.h"
+#endif
 
 class mDNS {
 public:
@@ -17,6 +22,25 @@ public:
   int recv();
   int send( const char* msg, size_t msg_size );
 
+#if IS_POSIX==1 && HAS_ASIO==0
+  // the send() socket:  opened once, connected to the mDNS group, reused by every send
+  UDPSender sender{ "224.0.0.251", 5353 };
+
+  // parse on consumer threads (handoff.options.consumers > 0):  the receive loop only reads packets and queues them
+  // in a lock-free ring, so slow (printf) callbacks don't leave the socket to overflow.
+  // a full ring drops the packet (handoff.dropped(), handoff.occupancy())
+  Handoff<Arrival> handoff;
+#endif
+
+  // recv() takes up to batch_size packets per syscall (posix:  recvmmsg() on Linux), each up to max_packet bytes
+  unsigned batch_size = 32;
+  size_t max_packet = 9000;  // RFC 6762:  up to 9000 bytes (jumbo frames)
+
+  // have the kernel timestamp each packet's arrival (Linux:  SO_TIMESTAMPING, the NIC's clock with hardware_timestamps),
+  // passed to the callbacks as timestamp_ns (ns since the epoch, 0 when off).  uses recvmmsg (not io_uring)
+  bool timestamps = false;
+  bool hardware_timestamps = false;
+
   // Raw mDNS message callbacks
   // called for each message.   May contain multiple records, use qCb or rCb to access them individually.
   std::vector<DNSHeader::Callback> rawCallbacks;
@@ -29,15 +53,20 @@ public:
   // called for each record recv'd via mDNS
   std::vector<DNSResourceRecord::Callback> recordCallbacks;
 
+  // zero copy question / record callbacks:  names (DomainName) and rdata (RDataView) read in place from the packet, only
+  // valid during the call.  names are copied out into std::strings only when the callbacks above are set
+  std::vector<DNSQuestion::ViewCallback> questionViewCallbacks;
+  std::vector<DNSResourceRecord::ViewCallback> recordViewCallbacks;
+
   // built in Raw mDNS callback - for printf debugging or logging
-  DNSHeader::Callback printf_cb = []( const std::string& sender_ip, const char* buffer, uint16_t buffer_size ) {
+  DNSHeader::Callback printf_cb = []( const std::string& sender_ip, int64_t timestamp_ns, const char* buffer, uint16_t buffer_size ) {
     printf( "Received mDNS message: \n" );
     cppArrayDump( buffer, buffer_size );
     printf( "\n" );
   };
 
   // built in question callback - for printf debugging or logging
-  DNSQuestion::Callback printf_qCb = []( const std::string& sender_ip, const std::string& name, uint16_t qtype, uint16_t qclass, bool flushbit, const char* buffer, uint16_t buffer_size, int pos ) {
+  DNSQuestion::Callback printf_qCb = []( const std::string& sender_ip, int64_t timestamp_ns, const std::string& name, uint16_t qtype, uint16_t qclass, bool flushbit, const char* buffer, uint16_t buffer_size, int pos ) {
     printf( "%s:\n", DNSHeader::typeLookup( DNSHeader::Type::QUESTION ).c_str() );
     printf( "  Name: %s\n", name.c_str() );
     printf( "  Type:  0x%04x, %d, %s\n", (uint16_t)qtype, (uint16_t)qtype, DNSQuestion::typeLookup( qtype ).c_str() );
@@ -45,7 +74,7 @@ public:
   };
 
   // built in records callback (e.g. for record types of answer, authority, additional)  - for printf debugging or logging
-  DNSResourceRecord::Callback printf_rCb = []( const std::string& sender_ip, DNSHeader::Type msg_type, const std::string& name, uint16_t rtype, uint16_t rclass, bool flushbit, uint32_t ttl, std::vector<uint8_t>& data, const char* buffer, uint16_t buffer_size, int pos ) {
+  DNSResourceRecord::Callback printf_rCb = []( const std::string& sender_ip, int64_t timestamp_ns, DNSHeader::Type msg_type, const std::string& name, uint16_t rtype, uint16_t rclass, bool flushbit, uint32_t ttl, std::vector<uint8_t>& data, const char* buffer, uint16_t buffer_size, int pos ) {
     printf( "%s:\n", DNSHeader::typeLookup( msg_type ).c_str() );
     printf( "  Name: %s\n", name.c_str() );
     printf( "  Type:  0x%04x, %d, %s\n", (uint16_t)rtype, (uint16_t)rtype, DNSQuestion::typeLookup( rtype ).c_str() );
@@ -128,19 +157,56 @@ public:
   };
 
 private:
-  DNSHeader::Callback mCb = [this]( const std::string& sender_ip, const char* buffer, uint16_t buffer_size ) {
-    for (auto func : rawCallbacks) {
-      func( sender_ip, buffer, buffer_size );
+#if IS_POSIX==1 && HAS_ASIO==0
+  void parse( const Arrival& from, const char* buffer, size_t size ) {
+    int it = 0;
+    parseMDNSPacketView( buffer, it, (int)size, ip_NetToStr( (const sockaddr&)from.sender ), from.timestamp_ns, mCb, mqCb, mrCb );
+  }
+  // from the receive loop:  to the consumers, or parsed right here
+  void deliver( const Arrival& from, const char* buffer, size_t size ) {
+    if (handoff.enabled())
+      handoff.push( from, buffer, size );
+    else
+      parse( from, buffer, size );
+  }
+#endif
+
+  // the names and rdata copied out for the std::string callbacks, per parsing thread
+  static PacketArena& scratch() {
+    static thread_local PacketArena arena;
+    return arena;
+  }
+
+  DNSHeader::Callback mCb = [this]( const std::string& sender_ip, int64_t timestamp_ns, const char* buffer, uint16_t buffer_size ) {
+    scratch().reset();  // a new packet:  what the last one copied out is free again
+    for (auto& func : rawCallbacks) {
+      func( sender_ip, timestamp_ns, buffer, buffer_size );
     }
   };
-  DNSQuestion::Callback mqCb = [this]( const std::string& sender_ip, const std::string& name, uint16_t qtype, uint16_t qclass, bool flushbit, const char* buffer, uint16_t buffer_size, int pos ) {
-    for (auto func : questionCallbacks) {
-      func( sender_ip, name, qtype, qclass, flushbit, buffer, buffer_size, pos );
+  DNSQuestion::ViewCallback mqCb = [this]( const std::string& sender_ip, int64_t timestamp_ns, const DomainName& name, uint16_t qtype, uint16_t qclass, bool flushbit, const char* buffer, uint16_t buffer_size, int pos ) {
+    for (auto& func : questionViewCallbacks) {
+      func( sender_ip, timestamp_ns, name, qtype, qclass, flushbit, buffer, buffer_size, pos );
+    }
+    if (questionCallbacks.empty())
+      return;
+    std::string& name_str = scratch().string();
+    name.appendTo( name_str );
+    for (auto& func : questionCallbacks) {
+      func( sender_ip, timestamp_ns, name_str, qtype, qclass, flushbit, buffer, buffer_size, pos );
     }
   };
-  DNSResourceRecord::Callback mrCb = [this]( const std::string& sender_ip, DNSHeader::Type msg_type, const std::string& name, uint16_t rtype, uint16_t rclass, bool flushbit, uint32_t ttl, std::vector<uint8_t>& data, const char* buffer, uint16_t buffer_size, int pos ) {
-    for (auto func : recordCallbacks) {
-      func( sender_ip, msg_type, name, rtype, rclass, flushbit, ttl, data, buffer, buffer_size, pos );
+  DNSResourceRecord::ViewCallback mrCb = [this]( const std::string& sender_ip, int64_t timestamp_ns, DNSHeader::Type msg_type, const DomainName& name, uint16_t rtype, uint16_t rclass, bool flushbit, uint32_t ttl, RDataView data, const char* buffer, uint16_t buffer_size, int pos ) {
+    for (auto& func : recordViewCallbacks) {
+      func( sender_ip, timestamp_ns, msg_type, name, rtype, rclass, flushbit, ttl, data, buffer, buffer_size, pos );
+    }
+    if (recordCallbacks.empty())
+      return;
+    std::string& name_str = scratch().string();
+    name.appendTo( name_str );
+    std::vector<uint8_t>& data_vec = scratch().bytes();
+    data_vec.assign( data.begin(), data.end() );
+    for (auto& func : recordCallbacks) {
+      func( sender_ip, timestamp_ns, msg_type, name_str, rtype, rclass, flushbit, ttl, data_vec, buffer, buffer_size, pos );
     }
   };
 };
@@ -199,7 +265,7 @@ int mDNS::recv() {
         }
 
         int it = 0;
-        parseMDNSPacket( buffer, it, bytesReceived, ip_NetToStr( (sockaddr&)senderAddr ), mCb, mqCb, mrCb );
+        parseMDNSPacketView( buffer, it, bytesReceived, ip_NetToStr( (sockaddr&)senderAddr ), 0, mCb, mqCb, mrCb );
       }
     } catch (std::exception& e) {
       std::cerr << "Exception: " << e.what() << std::endl;
@@ -215,26 +281,12 @@ int mDNS::recv() {
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#if HAS_IO_URING==1
+#include "IOUring.h"
+#endif
 
 int mDNS::send( const char* msg, size_t msg_size ) {
-  int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0) {
-    fprintf( stderr, "Socket creation failed. Error code: %d\n", errno );
-    return 1;
-  }
-
-  sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(5353);
-  ::inet_pton(AF_INET, "224.0.0.251", &addr.sin_addr);
-
-  if (::sendto(sock, msg, msg_size, 0, (sockaddr*)&addr, sizeof(addr)) < 0) {
-    fprintf( stderr, "sendto failed.  Error code: %s\n", strerror(errno) );
-    return 1;
-  }
-
-  ::close(sock);
-  return 0;
+  return sender.send( msg, msg_size );
 }
 
 int mDNS::recv() {
@@ -296,19 +348,42 @@ int mDNS::recv() {
 // #endif
 
 
-  char buffer[1024];
-  sockaddr_in senderAddr;
-  socklen_t senderAddrSize = sizeof(senderAddr);
+  handoff.start( [this]( const Arrival& from, const char* buffer, size_t size ) {
+    parse( from, buffer, size );
+  });
+
+#if HAS_IO_URING==1
+  if (!timestamps) {
+    int result = recvDatagrams( sock, [this]( const sockaddr_in& senderAddr, const char* buffer, size_t size ) {
+      deliver( Arrival{ senderAddr, 0 }, buffer, size );
+    }, 256, 9000 );
+    if (0 <= result) {
+      ::close(sock);
+      return result;
+    }
+    fprintf( stderr, "io_uring unavailable, using recvfrom.\n" );
+  }
+#endif
+
+  // many packets per syscall
+  RecvBatch batch( 0 < batch_size ? batch_size : 1, max_packet );
+  if (timestamps && !batch.enableTimestamps( sock, hardware_timestamps ))
+    fprintf( stderr, "setsockopt(SO_TIMESTAMPING) failed, no arrival timestamps.  Error code: %s\n", strerror(errno) );
 
   while (true) {
-    int bytesReceived = ::recvfrom(sock, buffer, sizeof(buffer), 0, (sockaddr*)&senderAddr, &senderAddrSize);
-    if (bytesReceived < 0) {
-      fprintf(stderr, "recvfrom failed.  bytesreceived: %d  Error code: %s\n", bytesReceived, strerror(errno) );
+    int received = batch.recv( sock );
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "recvmmsg failed.  Error code: %s\n", strerror(errno) );
       break;
     }
 
-    int it = 0;
-    parseMDNSPacket( buffer, it, bytesReceived, ip_NetToStr( (sockaddr&)senderAddr ), mCb, mqCb, mrCb );
+    for (int i = 0; i < received; ++i) {
+      if (batch.truncated( i ))
+        continue;  // larger than max_packet, don't parse half a packet
+      deliver( Arrival{ batch.sender( i ), batch.timestamp( i ) }, batch.data( i ), batch.length( i ) );
+    }
   }
 
   ::close(sock);
@@ -399,7 +474,7 @@ int mDNS::recv() {
     }
 
     int it = 0;
-    parseMDNSPacket( buffer, it, bytesReceived, ip_NetToStr( (sockaddr&)senderAddr ), mCb, mqCb, mrCb );
+    parseMDNSPacketView( buffer, it, bytesReceived, ip_NetToStr( (sockaddr&)senderAddr ), 0, mCb, mqCb, mrCb );
   }
 
   closesocket(sock);
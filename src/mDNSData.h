@@ -1,7 +1,15 @@
 #ifndef SUBA_MDNS_TYPES
 #define SUBA_MDNS_TYPES
 
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
 #include "utils.h"
+#include "Arena.h"
 
 
 // using BufferType = char; // may change by platform, posix needs char
@@ -38,24 +46,137 @@ struct DNSHeader {
   }
 
   // Raw mDNS message callback type
-  using Callback = std::function<void(const std::string& sender_ip, const char* buffer, uint16_t buffer_size)>;
+  // (every callback gets timestamp_ns:  when the packet arrived, per the kernel, ns since the epoch.  0:  not recorded)
+  using Callback = std::function<void(const std::string& sender_ip, int64_t timestamp_ns, const char* buffer, uint16_t buffer_size)>;
   
   // a default callback that does nothing
-  static void nop_cb(const std::string& sender_ip, const char* buffer, uint16_t buffer_size) {}
+  static void nop_cb(const std::string& sender_ip, int64_t timestamp_ns, const char* buffer, uint16_t buffer_size) {}
 
   DNSHeader() : id(0), flags(0), qdCount(0), anCount(0), nsCount(0), arCount(0) {}
 };
 
+// A name in a packet, read in place:  its labels are decoded from the packet as they are iterated (following compression
+// pointers), and nothing is copied until str() / appendTo() asks for it
+//   for (std::string_view label : name) ...      name == "_http._tcp.local."      name.contains( "_http" )
+// (dotted, ending in '.', as parseDomainName() gives it.)  only valid while the packet buffer is
+class DomainName {
+public:
+  DomainName() = default;
+  template <typename T>
+  DomainName( const T* buffer, int length, int pos ) : buffer( (const char*)buffer ), length( length ), pos( pos ) {}
+
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const std::string_view*;
+    using reference = std::string_view;
+
+    iterator() = default;
+    iterator( const char* buffer, int length, int at ) : buffer( buffer ), length( length ), at( at ) { settle(); }
+    std::string_view operator*() const { return std::string_view( buffer + at + 1, (unsigned char)buffer[at] ); }
+    iterator& operator++() { at += 1 + (unsigned char)buffer[at]; settle(); return *this; }
+    iterator operator++( int ) { iterator was = *this; ++*this; return was; }
+    bool operator==( const iterator& o ) const { return at == o.at; }
+    bool operator!=( const iterator& o ) const { return at != o.at; }
+
+  private:
+    // move at to the next label's length byte (through any pointers), or to -1 at the end of the name
+    void settle() {
+      while (at < length) {
+        unsigned char len = buffer[at];
+        if (len == 0)
+          break;
+        if ((len & 0xC0) == 0xC0) {
+          // a loop of pointers would never end
+          if (length <= at + 1 || 16 < ++hops)
+            break;
+          at = ((len & 0x3F) << 8) | (unsigned char)buffer[at + 1];
+          continue;
+        }
+        if (length < at + 1 + len)
+          break;
+        return;
+      }
+      at = -1;
+    }
+    const char* buffer = nullptr;
+    int length = 0;
+    int at = -1;
+    int hops = 0;  // compression pointers followed
+  };
+
+  iterator begin() const { return buffer ? iterator( buffer, length, pos ) : iterator(); }
+  iterator end() const { return iterator(); }
+  bool empty() const { return begin() == end(); }
+
+  void appendTo( std::string& s ) const {
+    for (std::string_view label : *this) {
+      s.append( label.data(), label.size() );
+      s += '.';
+    }
+  }
+  std::string str() const {
+    std::string s;
+    appendTo( s );
+    return s;
+  }
+
+  // compare with a dotted name, without building this one
+  bool operator==( std::string_view dotted ) const {
+    for (std::string_view label : *this) {
+      if (dotted.size() <= label.size() || dotted.compare( 0, label.size(), label ) != 0 || dotted[label.size()] != '.')
+        return false;
+      dotted.remove_prefix( label.size() + 1 );
+    }
+    return dotted.empty();
+  }
+  bool operator!=( std::string_view dotted ) const { return !(*this == dotted); }
+
+  // does the dotted name contain s (as std::string::find() would find it)?  decoded on the stack, not the heap
+  bool contains( std::string_view s ) const {
+    char flat[256];
+    size_t n = 0;
+    for (std::string_view label : *this) {
+      if (sizeof( flat ) < n + label.size() + 1)
+        return str().find( s ) != std::string::npos;  // (longer than a name may be:  malformed)
+      memcpy( flat + n, label.data(), label.size() );
+      n += label.size();
+      flat[n++] = '.';
+    }
+    return std::string_view( flat, n ).find( s ) != std::string_view::npos;
+  }
+
+private:
+  const char* buffer = nullptr;
+  int length = 0;
+  int pos = 0;
+};
+
+// a record's rdata, in place in the packet
+struct RDataView {
+  const uint8_t* data = nullptr;
+  uint16_t size = 0;
+
+  const uint8_t* begin() const { return data; }
+  const uint8_t* end() const { return data + size; }
+  std::string_view str() const { return std::string_view( (const char*)data, size ); }
+};
+
 // DNS Question structure
 struct DNSQuestion {
   std::string qName; // Query name
   uint16_t qType; // Query type
   uint16_t qClass; // Query class
 
-  using Callback = std::function<void(const std::string& sender_ip, const std::string& name, uint16_t type, uint16_t cls, bool flushbit, const char* buffer, uint16_t buffer_size, int pos)>;
+  using Callback = std::function<void(const std::string& sender_ip, int64_t timestamp_ns, const std::string& name, uint16_t type, uint16_t cls, bool flushbit, const char* buffer, uint16_t buffer_size, int pos)>;
 
   // a default callback that does nothing
-  static void nop_cb(const std::string& sender_ip, const std::string& name, uint16_t type, uint16_t cls, bool flushbit, const char* buffer, uint16_t buffer_size, int pos) {}
+  static void nop_cb(const std::string& sender_ip, int64_t timestamp_ns, const std::string& name, uint16_t type, uint16_t cls, bool flushbit, const char* buffer, uint16_t buffer_size, int pos) {}
+
+  // zero copy:  the name read in place from the packet (see DomainName)
+  using ViewCallback = std::function<void(const std::string& sender_ip, int64_t timestamp_ns, const DomainName& name, uint16_t type, uint16_t cls, bool flushbit, const char* buffer, uint16_t buffer_size, int pos)>;
 
   // https://en.wikipedia.org/wiki/List_of_DNS_record_types
   enum Type {
@@ -128,10 +249,13 @@ struct DNSResourceRecord {
   uint32_t ttl; // Time to live
   std::vector<uint8_t> rData; // Resource data
 
-  using Callback = std::function<void(const std::string& sender_ip, DNSHeader::Type msg_type, const std::string& name, uint16_t type, uint16_t cls, bool flushbit, uint32_t ttl, std::vector<uint8_t>& data, const char* buffer, uint16_t buffer_size, int pos)>;
+  using Callback = std::function<void(const std::string& sender_ip, int64_t timestamp_ns, DNSHeader::Type msg_type, const std::string& name, uint16_t type, uint16_t cls, bool flushbit, uint32_t ttl, std::vector<uint8_t>& data, const char* buffer, uint16_t buffer_size, int pos)>;
 
   // a default callback that does nothing
-  void nop_cb(const std::string& sender_ip, DNSHeader::Type msg_type, const std::string& name, uint16_t type, uint16_t cls, bool flushbit, uint32_t ttl, std::vector<uint8_t>& data, const char* buffer, uint16_t buffer_size, int pos) {}
+  void nop_cb(const std::string& sender_ip, int64_t timestamp_ns, DNSHeader::Type msg_type, const std::string& name, uint16_t type, uint16_t cls, bool flushbit, uint32_t ttl, std::vector<uint8_t>& data, const char* buffer, uint16_t buffer_size, int pos) {}
+
+  // zero copy:  the name and rdata read in place from the packet
+  using ViewCallback = std::function<void(const std::string& sender_ip, int64_t timestamp_ns, DNSHeader::Type msg_type, const DomainName& name, uint16_t type, uint16_t cls, bool flushbit, uint32_t ttl, RDataView data, const char* buffer, uint16_t buffer_size, int pos)>;
 
   DNSResourceRecord(const std::string& name, uint16_t type, uint16_t cls, uint32_t ttlVal, const std::vector<uint8_t>& data)
     : rName(name), rType(type), rClass(cls), ttl(ttlVal), rData(data) {}
@@ -142,174 +266,201 @@ struct DNSResourceRecord {
 // PARSING
 //////////////////////////////////////////////////////////////////////////
 
+// move pos past the name at pos, without reading it (a compression pointer ends it in place)
 template <typename T>
-std::string parseDomainName(const T* buffer, int& pos, int length) {
-  std::string name;
+void skipDomainName(const T* buffer, int& pos, int length) {
   while (pos < length) {
     unsigned char len = buffer[pos];
     if (len == 0) {
       pos++;
-      break;
+      return;
     }
     if ((len & 0xC0) == 0xC0) {
-      // Pointer to another part of the packet
-      int offset = ((len & 0x3F) << 8) | (unsigned char)buffer[pos + 1];
-      pos += 2;
-      int oldPos = pos;
-      pos = offset;
-      name += parseDomainName(buffer, pos, length);
-      pos = oldPos;
-      break;
-    } else {
-      pos++;
-      name.append(buffer + pos, len);
-      pos += len;
-      name += '.';
+      pos = length <= pos + 1 ? length : pos + 2;
+      return;
     }
+    pos += 1 + len;
+    if (length < pos)
+      pos = length;
   }
-  return name;
 }
 
+// append the name at pos to name (following compression pointers), and move pos past it
 template <typename T>
-void parseMDNSQuestion(const T* buffer, int& pos, int length, const std::string& sender_ip, DNSQuestion::Callback cb) {
-  if (length <= pos) {
-    fprintf( stderr, "[parseMDNSQuestion] Invalid mDNS packet (length:%d pos:%d).\n", length, pos );
-    return;
-  }
+void parseDomainName(const T* buffer, int& pos, int length, std::string& name) {
+  DomainName( buffer, length, pos ).appendTo( name );
+  skipDomainName( buffer, pos, length );
+}
+
+template <typename T>
+std::string parseDomainName(const T* buffer, int& pos, int length) {
+  std::string name;
+  parseDomainName(buffer, pos, length, name);
+  return name;
+}
 
-  // Parse the question name
-  std::string name = parseDomainName(buffer, pos, length);
+// the one parser behind both forms:  it hands out names and rdata as views, the std::string / std::vector callbacks
+// are served by copying them out
+namespace mdns_detail {
+  // cb( const DomainName& name, uint16_t type, uint16_t cls, bool flushbit )
+  template <typename T, typename F>
+  void parseQuestion(const T* buffer, int& pos, int length, F&& cb) {
+    if (length <= pos) {
+      fprintf( stderr, "[parseMDNSQuestion] Invalid mDNS packet (length:%d pos:%d).\n", length, pos );
+      return;
+    }
 
-  // Parse the question type
-  uint16_t qtype = ntohs(*(uint16_t*)&buffer[pos]);
-  pos += 2;
+    // the question name
+    DomainName name( buffer, length, pos );
+    skipDomainName( buffer, pos, length );
+    if (length < pos + 4) {
+      fprintf( stderr, "[parseMDNSQuestion] Invalid mDNS packet (length:%d pos:%d).\n", length, pos );
+      pos = length;
+      return;
+    }
 
-  // Parse the question class
-  uint16_t qclass = ntohs(*(uint16_t*)&buffer[pos]);
-  uint16_t qclass_without_flushbit = qclass & (~0x8000);
-  bool flushbit = (qclass & 0x8000) != 0;
-  pos += 2;
+    // Parse the question type
+    uint16_t qtype = ntohs(*(uint16_t*)&buffer[pos]);
+    pos += 2;
 
-  //printf( "  Name: %s\n", name.c_str() );
-  //printf( "  Type:  0x%04x, %d, %s\n", (uint16_t)qtype, (uint16_t)qtype, DNSQuestion::typeLookup( qtype ).c_str() );
-  //printf( "  Class: 0x%04x, %d, %s%s\n", (uint16_t)qclass, (uint16_t)qclass_without_flushbit, DNSQuestion::classLookup( qclass_without_flushbit ).c_str(), flushbit ? " +FLUSHBIT" : "" );
+    // Parse the question class
+    uint16_t qclass = ntohs(*(uint16_t*)&buffer[pos]);
+    uint16_t qclass_without_flushbit = qclass & (~0x8000);
+    bool flushbit = (qclass & 0x8000) != 0;
+    pos += 2;
 
-  cb( sender_ip, name, qtype, qclass_without_flushbit, flushbit, buffer, length, pos );
-}
+    //printf( "  Name: %s\n", name.str().c_str() );
+    //printf( "  Type:  0x%04x, %d, %s\n", (uint16_t)qtype, (uint16_t)qtype, DNSQuestion::typeLookup( qtype ).c_str() );
+    //printf( "  Class: 0x%04x, %d, %s%s\n", (uint16_t)qclass, (uint16_t)qclass_without_flushbit, DNSQuestion::classLookup( qclass_without_flushbit ).c_str(), flushbit ? " +FLUSHBIT" : "" );
 
-template <typename T>
-void parseMDNSRecord(const T* buffer, int& pos, int length, const std::string& sender_ip, DNSResourceRecord::Callback cb, DNSHeader::Type msg_type) {
-  if (length <= pos) {
-    fprintf( stderr, "[parseMDNSRecord] Invalid mDNS packet (length:%d pos:%d).\n", length, pos );
-    return;
+    cb( name, qtype, qclass_without_flushbit, flushbit );
   }
-  std::string name = parseDomainName(buffer, pos, length);
-  uint16_t rtype = ntohs(*(uint16_t*)&buffer[pos]);
-  pos += 2;
-  uint16_t rclass = ntohs(*(uint16_t*)&buffer[pos]);
-  uint16_t rclass_without_flushbit = rclass & (~0x8000);
-  bool flushbit = (rclass & 0x8000) != 0;
-  pos += 2;
-  uint32_t ttl = ntohl(*(uint32_t*)&buffer[pos]);
-  pos += 4;
-  uint16_t rdlength = ntohs(*(uint16_t*)&buffer[pos]);
-  pos += 2;
-  std::vector<uint8_t> rdata( &buffer[pos], &buffer[pos+rdlength] );
-
-  // printf( "  Name: %s\n", name.c_str() );
-  // printf( "  Type:  0x%04x, %d, %s\n", (uint16_t)rtype, (uint16_t)rtype, DNSQuestion::typeLookup( rtype ).c_str() );
-  // printf( "  Class: 0x%04x, %d, %s%s\n", (uint16_t)rclass, (uint16_t)rclass_without_flushbit, DNSQuestion::classLookup( rclass_without_flushbit ).c_str(), flushbit ? " +FLUSHBIT" : "" );
-  // printf( "  TTL: %d\n", (uint32_t)ttl );
-  // printf( "  Data length: %d\n", (uint16_t)rdlength );
-
-  int rdstart = pos; // Store the start position of RDATA
-  cb( sender_ip, msg_type, name, rtype, rclass_without_flushbit, flushbit, ttl, rdata, buffer, length, pos );
-
-/*
-  switch (rtype) {
-    case DNSQuestion::Type::A:
-      printf( "  Address: %03d.%03d.%03d.%03d\n", (uint8_t)buffer[pos], (uint8_t)buffer[pos+1], (uint8_t)buffer[pos+2], (uint8_t)buffer[pos+3] );
-      break;
-    case DNSQuestion::Type::TXT:
-      printf( "  TXT Data: %s\n", std::string(buffer + pos, rdlength).c_str() );
-      if (rdlength < 100)
-        hexDump( &buffer[pos], rdlength );
-      else
-        printf( "    - %d bytes (not showing, too long)\n", rdlength );
-      break;
-    case DNSQuestion::Type::PTR: {
-      //int temp_pos = pos;
-      std::string ptrname = parseDomainName(buffer, pos, length);
-      printf( "  PTR Name: %s\n", ptrname.c_str() );
-      break;
-    }
-    case DNSQuestion::Type::AAAA:
-      //char addr_str[INET6_ADDRSTRLEN];
-      //inet_ntop(AF_INET6, &buffer[pos], addr_str, sizeof(addr_str));
-      //std::cout << "  Address: " << addr_str << std::endl;
-      printf( "  Address AAAA ipv6: ???\n" );
-      break;
-    case DNSQuestion::Type::SRV: {
-      uint16_t priority = ntohs(*(uint16_t*)&buffer[pos]);
-      pos += 2;
-      uint16_t weight = ntohs(*(uint16_t*)&buffer[pos]);
-      pos += 2;
-      uint16_t port = ntohs(*(uint16_t*)&buffer[pos]);
-      pos += 2;
-      //int temp_pos = pos + 6;
-      std::string target = parseDomainName(buffer, pos, length);
-      printf( "  Priority: %u\n", priority );
-      printf( "  Weight: %u\n", weight );
-      printf( "  Port: %u\n", port );
-      printf( "  Target: %s\n", target.c_str() );
-      break;
+
+  // cb( const DomainName& name, uint16_t type, uint16_t cls, bool flushbit, uint32_t ttl, RDataView rdata ), with pos at
+  // the rdata
+  template <typename T, typename F>
+  void parseRecord(const T* buffer, int& pos, int length, F&& cb) {
+    if (length <= pos) {
+      fprintf( stderr, "[parseMDNSRecord] Invalid mDNS packet (length:%d pos:%d).\n", length, pos );
+      return;
     }
-    case DNSQuestion::Type::OPT: {
-      // OPT record is typically used for EDNS0 options and may contain multiple options
-      // For simplicity, we print the raw data
-      printf( "  OPT Data: " );
-      if (rdlength < 100)
-        hexDump( &buffer[pos], rdlength );
-      else
-        printf( "    - %d bytes (not showing, too long)\n", rdlength );
-      break;
+    DomainName name( buffer, length, pos );
+    skipDomainName( buffer, pos, length );
+    if (length < pos + 10) {
+      fprintf( stderr, "[parseMDNSRecord] Invalid mDNS packet (length:%d pos:%d).\n", length, pos );
+      pos = length;
+      return;
     }
-    case DNSQuestion::Type::NSEC: {
-      //int temp_pos = pos;
-      std::string nextDomainName = parseDomainName(buffer, pos, length);
-      printf( "  Next Domain Name: %s\n", nextDomainName.c_str() );
-      printf( "  Type Bitmaps:\n" );
-      if (rdlength < 100)
-        hexDump( &buffer[pos], rdlength );
-      else
-        printf( "    - %d bytes (not showing, too long)\n", rdlength );
-      break;
+    uint16_t rtype = ntohs(*(uint16_t*)&buffer[pos]);
+    pos += 2;
+    uint16_t rclass = ntohs(*(uint16_t*)&buffer[pos]);
+    uint16_t rclass_without_flushbit = rclass & (~0x8000);
+    bool flushbit = (rclass & 0x8000) != 0;
+    pos += 2;
+    uint32_t ttl = ntohl(*(uint32_t*)&buffer[pos]);
+    pos += 4;
+    uint16_t rdlength = ntohs(*(uint16_t*)&buffer[pos]);
+    pos += 2;
+    if (length < pos + rdlength) {
+      fprintf( stderr, "[parseMDNSRecord] Invalid mDNS packet (length:%d pos:%d rdlength:%d).\n", length, pos, rdlength );
+      pos = length;
+      return;
     }
-    case DNSQuestion::Type::ANY: {
-      // ANY is a request for all records, so data parsing depends on response
-      printf( "  ANY Data: " );
-      if (rdlength < 100)
-        hexDump( &buffer[pos], rdlength );
-      else
-        printf( "    - %d bytes (not showing, too long)\n", rdlength );
-      break;
+    RDataView rdata{ (const uint8_t*)&buffer[pos], rdlength };
+
+    // printf( "  Name: %s\n", name.str().c_str() );
+    // printf( "  Type:  0x%04x, %d, %s\n", (uint16_t)rtype, (uint16_t)rtype, DNSQuestion::typeLookup( rtype ).c_str() );
+    // printf( "  Class: 0x%04x, %d, %s%s\n", (uint16_t)rclass, (uint16_t)rclass_without_flushbit, DNSQuestion::classLookup( rclass_without_flushbit ).c_str(), flushbit ? " +FLUSHBIT" : "" );
+    // printf( "  TTL: %d\n", (uint32_t)ttl );
+    // printf( "  Data length: %d\n", (uint16_t)rdlength );
+
+    int rdstart = pos; // Store the start position of RDATA
+    cb( name, rtype, rclass_without_flushbit, flushbit, ttl, rdata );
+
+  /*
+    switch (rtype) {
+      case DNSQuestion::Type::A:
+        printf( "  Address: %03d.%03d.%03d.%03d\n", (uint8_t)buffer[pos], (uint8_t)buffer[pos+1], (uint8_t)buffer[pos+2], (uint8_t)buffer[pos+3] );
+        break;
+      case DNSQuestion::Type::TXT:
+        printf( "  TXT Data: %s\n", std::string(buffer + pos, rdlength).c_str() );
+        if (rdlength < 100)
+          hexDump( &buffer[pos], rdlength );
+        else
+          printf( "    - %d bytes (not showing, too long)\n", rdlength );
+        break;
+      case DNSQuestion::Type::PTR: {
+        //int temp_pos = pos;
+        std::string ptrname = parseDomainName(buffer, pos, length);
+        printf( "  PTR Name: %s\n", ptrname.c_str() );
+        break;
+      }
+      case DNSQuestion::Type::AAAA:
+        //char addr_str[INET6_ADDRSTRLEN];
+        //inet_ntop(AF_INET6, &buffer[pos], addr_str, sizeof(addr_str));
+        //std::cout << "  Address: " << addr_str << std::endl;
+        printf( "  Address AAAA ipv6: ???\n" );
+        break;
+      case DNSQuestion::Type::SRV: {
+        uint16_t priority = ntohs(*(uint16_t*)&buffer[pos]);
+        pos += 2;
+        uint16_t weight = ntohs(*(uint16_t*)&buffer[pos]);
+        pos += 2;
+        uint16_t port = ntohs(*(uint16_t*)&buffer[pos]);
+        pos += 2;
+        //int temp_pos = pos + 6;
+        std::string target = parseDomainName(buffer, pos, length);
+        printf( "  Priority: %u\n", priority );
+        printf( "  Weight: %u\n", weight );
+        printf( "  Port: %u\n", port );
+        printf( "  Target: %s\n", target.c_str() );
+        break;
+      }
+      case DNSQuestion::Type::OPT: {
+        // OPT record is typically used for EDNS0 options and may contain multiple options
+        // For simplicity, we print the raw data
+        printf( "  OPT Data: " );
+        if (rdlength < 100)
+          hexDump( &buffer[pos], rdlength );
+        else
+          printf( "    - %d bytes (not showing, too long)\n", rdlength );
+        break;
+      }
+      case DNSQuestion::Type::NSEC: {
+        //int temp_pos = pos;
+        std::string nextDomainName = parseDomainName(buffer, pos, length);
+        printf( "  Next Domain Name: %s\n", nextDomainName.c_str() );
+        printf( "  Type Bitmaps:\n" );
+        if (rdlength < 100)
+          hexDump( &buffer[pos], rdlength );
+        else
+          printf( "    - %d bytes (not showing, too long)\n", rdlength );
+        break;
+      }
+      case DNSQuestion::Type::ANY: {
+        // ANY is a request for all records, so data parsing depends on response
+        printf( "  ANY Data: " );
+        if (rdlength < 100)
+          hexDump( &buffer[pos], rdlength );
+        else
+          printf( "    - %d bytes (not showing, too long)\n", rdlength );
+        break;
+      }
+      default:
+        printf( "  Raw data: \n" );
+        if (rdlength < 100)
+          hexDump( &buffer[pos], rdlength );
+        else
+          printf( "    - %d bytes (not showing, too long)\n", rdlength );
     }
-    default:
-      printf( "  Raw data: \n" );
-      if (rdlength < 100)
-        hexDump( &buffer[pos], rdlength );
-      else
-        printf( "    - %d bytes (not showing, too long)\n", rdlength );
+  */
+    pos = rdstart + rdlength;
   }
-*/
-  pos = rdstart + rdlength;
-}
 
-template <typename T>
-void parseMDNSPacket(const T* buffer, int& pos, int length, const std::string& sender_ip, DNSHeader::Callback cb, DNSQuestion::Callback qCb, DNSResourceRecord::Callback rCb ) {
-    cb( sender_ip, buffer, length );
-
-    if (length < pos) {
+  // the header, then each question and record in turn:  question() / record( msg_type ) parse the one at pos
+  template <typename T, typename Q, typename R>
+  void parsePacket(const T* buffer, int& pos, int length, Q&& question, R&& record) {
+    if (length < pos + 12) {
       fprintf( stderr, "[parseMDNSPacket] Invalid mDNS packet (length:%d pos:%d).\n", length, pos );
       return;
     }
@@ -331,27 +482,89 @@ void parseMDNSPacket(const T* buffer, int& pos, int length, const std::string& s
 
     // if (0 < qdcount) printf( "Questions[%u]:\n", qdcount );
     for (int x = 0; x < qdcount; ++x) {
-      parseMDNSQuestion( buffer, pos, length, sender_ip, qCb );
+      question();
       // printf( "\n" );
     }
 
     // if (0 < ancount) printf( "Answers[%u]:\n", ancount );
     for (int i = 0; i < ancount; i++) {
-      parseMDNSRecord(buffer, pos, length, sender_ip, rCb, DNSHeader::Type::ANSWER);
+      record( DNSHeader::Type::ANSWER );
       // printf( "\n" );
     }
 
     // if (0 < nscount) printf( "Authorities[%u]:\n", nscount );
     for (int i = 0; i < nscount; i++) {
-      parseMDNSRecord(buffer, pos, length, sender_ip, rCb, DNSHeader::Type::AUTHORITY);
+      record( DNSHeader::Type::AUTHORITY );
       // printf( "\n" );
     }
 
     // if (0 < arcount) printf( "Additional records[%u]:\n", arcount );
     for (int i = 0; i < arcount; i++) {
-      parseMDNSRecord(buffer, pos, length, sender_ip, rCb, DNSHeader::Type::ADDITIONAL);
+      record( DNSHeader::Type::ADDITIONAL );
       // printf( "\n" );
     }
+  }
+}
+
+// names (and rdata) are parsed into arena, which the caller resets per packet
+template <typename T>
+void parseMDNSQuestion(const T* buffer, int& pos, int length, const std::string& sender_ip, int64_t timestamp_ns, const DNSQuestion::Callback& cb, PacketArena& arena) {
+  mdns_detail::parseQuestion( buffer, pos, length, [&]( const DomainName& name, uint16_t qtype, uint16_t qclass, bool flushbit ) {
+    std::string& s = arena.string();
+    name.appendTo( s );
+    cb( sender_ip, timestamp_ns, s, qtype, qclass, flushbit, buffer, length, pos );
+  });
+}
+
+template <typename T>
+void parseMDNSRecord(const T* buffer, int& pos, int length, const std::string& sender_ip, int64_t timestamp_ns, const DNSResourceRecord::Callback& cb, DNSHeader::Type msg_type, PacketArena& arena) {
+  mdns_detail::parseRecord( buffer, pos, length, [&]( const DomainName& name, uint16_t rtype, uint16_t rclass, bool flushbit, uint32_t ttl, RDataView rdata ) {
+    std::string& s = arena.string();
+    name.appendTo( s );
+    std::vector<uint8_t>& data = arena.bytes();
+    data.assign( rdata.begin(), rdata.end() );
+    cb( sender_ip, timestamp_ns, msg_type, s, rtype, rclass, flushbit, ttl, data, buffer, length, pos );
+  });
+}
+
+// arena:  scratch for the names and rdata handed to the callbacks (reset here, reused packet after packet)
+template <typename T>
+void parseMDNSPacket(const T* buffer, int& pos, int length, const std::string& sender_ip, int64_t timestamp_ns, const DNSHeader::Callback& cb, const DNSQuestion::Callback& qCb, const DNSResourceRecord::Callback& rCb, PacketArena& arena ) {
+  arena.reset();
+  cb( sender_ip, timestamp_ns, buffer, length );
+  mdns_detail::parsePacket( buffer, pos, length,
+    [&]() { parseMDNSQuestion( buffer, pos, length, sender_ip, timestamp_ns, qCb, arena ); },
+    [&]( DNSHeader::Type msg_type ) { parseMDNSRecord( buffer, pos, length, sender_ip, timestamp_ns, rCb, msg_type, arena ); } );
+}
+
+// (with a scratch arena per thread)
+template <typename T>
+void parseMDNSPacket(const T* buffer, int& pos, int length, const std::string& sender_ip, int64_t timestamp_ns, const DNSHeader::Callback& cb, const DNSQuestion::Callback& qCb, const DNSResourceRecord::Callback& rCb ) {
+  static thread_local PacketArena arena;
+  parseMDNSPacket( buffer, pos, length, sender_ip, timestamp_ns, cb, qCb, rCb, arena );
+}
+
+// zero copy:  the callbacks get names and rdata in place in buffer (valid during the call).  nothing is allocated
+template <typename T>
+void parseMDNSQuestionView(const T* buffer, int& pos, int length, const std::string& sender_ip, int64_t timestamp_ns, const DNSQuestion::ViewCallback& cb) {
+  mdns_detail::parseQuestion( buffer, pos, length, [&]( const DomainName& name, uint16_t qtype, uint16_t qclass, bool flushbit ) {
+    cb( sender_ip, timestamp_ns, name, qtype, qclass, flushbit, buffer, length, pos );
+  });
+}
+
+template <typename T>
+void parseMDNSRecordView(const T* buffer, int& pos, int length, const std::string& sender_ip, int64_t timestamp_ns, const DNSResourceRecord::ViewCallback& cb, DNSHeader::Type msg_type) {
+  mdns_detail::parseRecord( buffer, pos, length, [&]( const DomainName& name, uint16_t rtype, uint16_t rclass, bool flushbit, uint32_t ttl, RDataView rdata ) {
+    cb( sender_ip, timestamp_ns, msg_type, name, rtype, rclass, flushbit, ttl, rdata, buffer, length, pos );
+  });
+}
+
+template <typename T>
+void parseMDNSPacketView(const T* buffer, int& pos, int length, const std::string& sender_ip, int64_t timestamp_ns, const DNSHeader::Callback& cb, const DNSQuestion::ViewCallback& qCb, const DNSResourceRecord::ViewCallback& rCb ) {
+  cb( sender_ip, timestamp_ns, buffer, length );
+  mdns_detail::parsePacket( buffer, pos, length,
+    [&]() { parseMDNSQuestionView( buffer, pos, length, sender_ip, timestamp_ns, qCb ); },
+    [&]( DNSHeader::Type msg_type ) { parseMDNSRecordView( buffer, pos, length, sender_ip, timestamp_ns, rCb, msg_type ); } );
 }
 
 
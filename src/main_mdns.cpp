@@ -153,11 +153,11 @@ int main( int argc, char* argv[] ) {
     int it;
     it = 0;
     switch (opt.test) {
-      case 0: parseMDNSPacket( (const char*)testdata_1answer_4additional, it, sizeof( testdata_1answer_4additional ), "tst.tst.tst.tst.", DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
-      case 1: parseMDNSPacket( (const char*)testdata_9answer_5additional, it, sizeof( testdata_9answer_5additional ), "tst.tst.tst.tst.", DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
-      case 2: parseMDNSPacket( (const char*)testdata_1question, it, sizeof( testdata_1question ), "tst.tst.tst.tst.", DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
-      case 3: parseMDNSPacket( (const char*)testdata_3question_2answer_1additional, it, sizeof( testdata_3question_2answer_1additional ), "tst.tst.tst.tst.", DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
-      case 4: parseMDNSPacket( (const char*)testdata_4answer_7additional, it, sizeof( testdata_4answer_7additional ), "tst.tst.tst.tst.", DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
+      case 0: parseMDNSPacket( (const char*)testdata_1answer_4additional, it, sizeof( testdata_1answer_4additional ), "tst.tst.tst.tst.", 0, DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
+      case 1: parseMDNSPacket( (const char*)testdata_9answer_5additional, it, sizeof( testdata_9answer_5additional ), "tst.tst.tst.tst.", 0, DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
+      case 2: parseMDNSPacket( (const char*)testdata_1question, it, sizeof( testdata_1question ), "tst.tst.tst.tst.", 0, DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
+      case 3: parseMDNSPacket( (const char*)testdata_3question_2answer_1additional, it, sizeof( testdata_3question_2answer_1additional ), "tst.tst.tst.tst.", 0, DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
+      case 4: parseMDNSPacket( (const char*)testdata_4answer_7additional, it, sizeof( testdata_4answer_7additional ), "tst.tst.tst.tst.", 0, DNSHeader::nop_cb, transport.printf_qCb, transport.printf_rCb ); break;
       default: printf( "Unknown test\n" );
     }
     exit(-1);
@@ -185,32 +185,32 @@ int main( int argc, char* argv[] ) {
     transport.questionCallbacks.clear();
     transport.recordCallbacks.clear();
 
-    // add a stdout handler for questions
-    transport.questionCallbacks.push_back( [&opt]( const std::string& sender_ip, const std::string& name, uint16_t qtype, uint16_t qclass, bool flushbit, const char* buffer, uint16_t buffer_size, int pos ) {
+    // add a stdout handler for questions (names read in place, only copied out for the ones printed)
+    transport.questionViewCallbacks.push_back( [&opt]( const std::string& sender_ip, int64_t timestamp_ns, const DomainName& name, uint16_t qtype, uint16_t qclass, bool flushbit, const char* buffer, uint16_t buffer_size, int pos ) {
       //printf( "%s %s\n", opt.service_name.c_str(), opt.ip_filter.c_str() );
       if (
-        (opt.service_name == opt.service_name_default || name.find( opt.service_name ) != std::string::npos) &&
+        (opt.service_name == opt.service_name_default || name.contains( opt.service_name )) &&
         (opt.ip_filter == "" || opt.ip_filter == sender_ip)
       )
         printf( "%-36s [%-10s] \"%s\" Type[0x%04x, %d, %s] Class[0x%04x, %d, %s%s]\n",
           sender_ip.c_str(),
           DNSHeader::typeLookup( DNSHeader::Type::QUESTION ).c_str(),
-          name.c_str(),
+          name.str().c_str(),
           (uint16_t)qtype, (uint16_t)qtype, DNSQuestion::typeLookup( qtype ).c_str(),
           (uint16_t)qclass, (uint16_t)qclass, DNSQuestion::classLookup( qclass ).c_str(), flushbit ? " +FLUSHBIT" : ""
         );
     });
 
     // add a stdout handler for records
-    transport.recordCallbacks.push_back( [&opt]( const std::string& sender_ip, DNSHeader::Type msg_type, const std::string& name, uint16_t rtype, uint16_t rclass, bool flushbit, uint32_t ttl, std::vector<uint8_t>& data, const char* buffer, uint16_t buffer_size, int pos ) {
+    transport.recordViewCallbacks.push_back( [&opt]( const std::string& sender_ip, int64_t timestamp_ns, DNSHeader::Type msg_type, const DomainName& name, uint16_t rtype, uint16_t rclass, bool flushbit, uint32_t ttl, RDataView data, const char* buffer, uint16_t buffer_size, int pos ) {
       if (
-        (opt.service_name == opt.service_name_default || name.find( opt.service_name ) != std::string::npos) &&
+        (opt.service_name == opt.service_name_default || name.contains( opt.service_name )) &&
         (opt.ip_filter == "" || opt.ip_filter == sender_ip)
       )
         printf( "%-36s [%-10s] \"%s\" Type[0x%04x, %d, %s] Class[0x%04x, %d, %s%s] ttl:%d\n",
           sender_ip.c_str(),
           DNSHeader::typeLookup( msg_type ).c_str(),
-          name.c_str(),
+          name.str().c_str(),
           (uint16_t)rtype, (uint16_t)rtype, DNSQuestion::typeLookup( rtype ).c_str(),
           (uint16_t)rclass, (uint16_t)rclass, DNSQuestion::classLookup( rclass ).c_str(), flushbit ? " +FLUSHBIT" : "",
           ttl
@@ -219,8 +219,8 @@ int main( int argc, char* argv[] ) {
   }
 
   if (opt.answer) {
-    transport.questionCallbacks.push_back( [&opt, &transport]( const std::string& sender_ip, const std::string& name, uint16_t qtype, uint16_t qclass, bool flushbit, const char* buffer, uint16_t buffer_size, int pos ) {
-      if (qtype == DNSQuestion::PTR && name.find( opt.service_name ) != std::string::npos) {
+    transport.questionViewCallbacks.push_back( [&opt, &transport]( const std::string& sender_ip, int64_t timestamp_ns, const DomainName& name, uint16_t qtype, uint16_t qclass, bool flushbit, const char* buffer, uint16_t buffer_size, int pos ) {
+      if (qtype == DNSQuestion::PTR && name.contains( opt.service_name )) {
         printf( "reply to the service question for %s!\n", opt.service_name.c_str() );
         std::vector<char> send_buf = makeAnswerBuffer<char>( opt.service_name, opt.type );
         transport.send( send_buf.data(), send_buf.size() );
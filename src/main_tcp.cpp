@@ -1,4 +1,7 @@
 #include <thread>
+#include <functional>
+#include <cstring>
+#include <unistd.h>
 #include "TCP.h"
 
 int main() {
@@ -12,6 +15,8 @@ int main() {
   };
   std::thread t( func );
 
+  sleep(1);
+
   // send some test messages:
   transport.send( "hi", strlen( "hi" ) );
   transport.send( "bye", strlen( "bye" ) );
@@ -0,0 +1,94 @@
+#include <cstring>
+#include <string>
+#include "Async.h"
+
+// coroutine API example:  a TCP echo server and many clients, plus a UDP echo, all on one thread
+#if HAS_COROUTINES==1
+
+static const uint16_t PORT = 12345;
+static const int CLIENTS = 100;
+static int done = 0;
+
+Task<void> echo( AsyncTCP conn ) {
+  char buffer[4096];
+  int64_t n;
+  while (0 < (n = co_await conn.async_read( buffer, sizeof( buffer ) ))) {
+    if (co_await conn.async_write( buffer, n ) < 0)
+      break;
+  }
+}
+
+Task<void> server( AsyncReactor& reactor, AsyncTCPListener& listener ) {
+  while (listener.valid()) {
+    AsyncTCP conn = co_await listener.async_accept();
+    if (conn.valid())
+      spawn( reactor, echo( std::move( conn ) ) );
+  }
+}
+
+Task<void> client( AsyncReactor& reactor, AsyncTCPListener& listener, int id ) {
+  AsyncTCP conn( reactor );
+  if (co_await conn.async_connect( "127.0.0.1", PORT ) != 0)
+    co_return;
+  std::string msg = "hi from client " + std::to_string( id );
+  co_await conn.async_write( msg.data(), msg.size() );
+
+  std::string reply( msg.size(), '\0' );
+  size_t got = 0;
+  while (got < reply.size()) {
+    int64_t n = co_await conn.async_read( &reply[got], reply.size() - got );
+    if (n <= 0)
+      break;
+    got += n;
+  }
+  if (reply != msg)
+    printf( "client %d: bad echo: %s\n", id, reply.c_str() );
+  if (++done == CLIENTS) {
+    printf( "TCP: %d clients echoed\n", done );
+    listener.close();  // no more work, so reactor.run() returns once the UDP echo is done too
+  }
+}
+
+Task<void> udpEcho( AsyncUDP& sock ) {
+  char buffer[2048];
+  AsyncUDP::Address from;
+  int64_t n = co_await sock.async_recv_from( buffer, sizeof( buffer ), from );
+  if (0 <= n)
+    co_await sock.async_send_to( buffer, n, from );
+}
+
+Task<void> udpClient( AsyncUDP& sock ) {
+  const char* msg = "udp hi";
+  co_await sock.async_send_to( msg, strlen( msg ), "127.0.0.1", PORT );
+  char buffer[2048];
+  AsyncUDP::Address from;
+  int64_t n = co_await sock.async_recv_from( buffer, sizeof( buffer ), from );
+  printf( "UDP: echoed: %.*s\n", (int)n, buffer );
+}
+
+int main() {
+  printf( "TCP/UDP coroutine example\n" );
+
+  AsyncReactor reactor;
+  AsyncTCPListener listener( reactor );
+  if (listener.listen( PORT ) != 0)
+    return 1;
+  AsyncUDP udp_server( reactor ), udp_client( reactor );
+  if (udp_server.bind( PORT ) != 0 || udp_client.bind() != 0)
+    return 1;
+
+  spawn( reactor, server( reactor, listener ) );
+  for (int i = 0; i < CLIENTS; ++i)
+    spawn( reactor, client( reactor, listener, i ) );
+  spawn( reactor, udpEcho( udp_server ) );
+  spawn( reactor, udpClient( udp_client ) );
+
+  return reactor.run();
+}
+
+#else
+int main() {
+  printf( "coroutines need C++20 (and posix or asio)\n" );
+  return 0;
+}
+#endif
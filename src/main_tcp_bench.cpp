@@ -0,0 +1,388 @@
+// TCP loopback benchmark:  latency (ping-pong round trips) and throughput (streaming), reported as JSON.
+// Goes through the same TCP class API as the demos, so it measures whichever backend the build uses (posix, io_uring, asio).
+//
+//   pingpong:  each connection sends a message, the server echoes it back on the same connection (TCP::reply),
+//              and the next message goes out once the echo arrives.  latency = round trip time.  (posix only:  asio builds default to stream)
+//   stream:    each connection sends back to back for --duration.  latency = one way (send() call to server callback,
+//              including any time spent queued), throughput = bytes the server received.
+#include <thread>
+#include <functional>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include "TCP.h"
+#if IS_POSIX==1 && HAS_ASIO==0
+#include <netinet/tcp.h>
+#endif
+
+// command line options:
+struct CommandLineOptions {
+  // standard args
+  std::string processname;
+  std::vector<std::string> args;
+  bool VERBOSE=false;
+
+  ////////////////////////////////////////////////////////////////////
+  // custom args (add a new parse conditional to handle the --xxxx ):
+#if IS_POSIX==1 && HAS_ASIO==0
+  std::string mode = "pingpong";
+#else
+  std::string mode = "stream";  // pingpong needs TCP::reply() (posix)
+#endif
+  size_t size = 64;
+  int connections = 1;
+  double duration = 5.0;
+  uint16_t port = 12345;
+  Framing framing = Framing::U32;
+  bool batch = false;
+  int busy_poll_us = 0;
+  ////////////////////////////////////////////////////////////////////
+
+  void usage() {
+    printf( "%s - TCP loopback latency / throughput benchmark (JSON results on stdout)\n", processname.c_str() );
+    printf( "Usage:\n" );
+    printf( "%s --help            (this help)\n", processname.c_str() );
+    printf( "%s --verbose         (output verbose information)\n", processname.c_str() );
+#if IS_POSIX==1 && HAS_ASIO==0
+    printf( "%s --mode <m>        (pingpong (default) or stream)\n", processname.c_str() );
+#else
+    printf( "%s --mode <m>        (stream only:  pingpong needs the posix build)\n", processname.c_str() );
+#endif
+    printf( "%s --size <bytes>    (message size, default 64, min %d)\n", processname.c_str(), (int)MIN_SIZE );
+    printf( "%s --connections <n> (concurrent connections, default 1)\n", processname.c_str() );
+    printf( "%s --duration <sec>  (how long to run, default 5)\n", processname.c_str() );
+    printf( "%s --port <port>     (server port, default 12345)\n", processname.c_str() );
+    printf( "%s --framing <f>     (u32 (default) or varint)\n", processname.c_str() );
+    printf( "%s --batch           (posix: queue sends, gathered into sendmsg() batches)\n", processname.c_str() );
+    printf( "%s --busy-poll <us>  (posix: listeners spin this long before sleeping, see BusyPoll)\n", processname.c_str() );
+    printf( "\n" );
+  };
+
+  // parse the options
+  void parse_args( int argc, char* argv[] ) {
+    processname = argv[0];
+
+    /////////////////////////////////////
+    // scan command line args:
+    const std::vector<std::string> ARGV(argv + 1, argv + argc); // 1st 1 is process name...
+    const int ARGC = ARGV.size();
+    for (int i = 0; i < ARGC; ++i) {
+      if (ARGV[i] == "--help") {
+        usage();
+        exit( -1 );
+      }
+      if (ARGV[i] == "--verbose") {
+        VERBOSE=true;
+        continue;
+      }
+      if (ARGV[i] == "--mode" && i + 1 < ARGC) {
+        i+=1;
+        mode=ARGV[i];
+        VERBOSE && fprintf( stderr, "Parsing Args: setting mode=%s\n", mode.c_str() );
+        continue;
+      }
+      if (ARGV[i] == "--size" && i + 1 < ARGC) {
+        i+=1;
+        size=(size_t)std::stoull( ARGV[i] );
+        VERBOSE && fprintf( stderr, "Parsing Args: setting size=%zu\n", size );
+        continue;
+      }
+      if (ARGV[i] == "--connections" && i + 1 < ARGC) {
+        i+=1;
+        connections=std::stoi( ARGV[i] );
+        VERBOSE && fprintf( stderr, "Parsing Args: setting connections=%d\n", connections );
+        continue;
+      }
+      if (ARGV[i] == "--duration" && i + 1 < ARGC) {
+        i+=1;
+        duration=std::stod( ARGV[i] );
+        VERBOSE && fprintf( stderr, "Parsing Args: setting duration=%f\n", duration );
+        continue;
+      }
+      if (ARGV[i] == "--port" && i + 1 < ARGC) {
+        i+=1;
+        port=(uint16_t)std::stoi( ARGV[i] );
+        VERBOSE && fprintf( stderr, "Parsing Args: setting port=%d\n", (int)port );
+        continue;
+      }
+      if (ARGV[i] == "--framing" && i + 1 < ARGC) {
+        i+=1;
+        framing = ARGV[i] == "varint" ? Framing::VARINT : Framing::U32;
+        VERBOSE && fprintf( stderr, "Parsing Args: setting framing=%s\n", ARGV[i].c_str() );
+        continue;
+      }
+      if (ARGV[i] == "--busy-poll" && i + 1 < ARGC) {
+        i+=1;
+        busy_poll_us=std::stoi( ARGV[i] );
+        VERBOSE && fprintf( stderr, "Parsing Args: setting busy_poll_us=%d\n", busy_poll_us );
+        continue;
+      }
+      if (ARGV[i] == "--batch") {
+        batch=true;
+        VERBOSE && fprintf( stderr, "Parsing Args: setting batch=%d\n", batch );
+        continue;
+      }
+      args.push_back( ARGV[i] );
+    }
+
+#if IS_POSIX==1 && HAS_ASIO==0
+    bool known_mode = mode == "pingpong" || mode == "stream";
+#else
+    bool known_mode = mode == "stream";  // pingpong needs TCP::reply()
+#endif
+    if (args.size() != 0 || !known_mode || size < MIN_SIZE || connections < 1 || duration <= 0) {
+      usage();
+      exit( -1 );
+    }
+  }
+
+  // every message starts with a header:  [connection id:u32][sequence:u64][send time ns:u64]
+  static const size_t MIN_SIZE = 4 + 8 + 8;
+};
+
+static uint64_t nowNs() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static void writeHeader( char* msg, uint32_t id, uint64_t seq, uint64_t t ) {
+  memcpy( msg, &id, 4 );
+  memcpy( msg + 4, &seq, 8 );
+  memcpy( msg + 12, &t, 8 );
+}
+
+static void readHeader( const char* msg, uint32_t& id, uint64_t& seq, uint64_t& t ) {
+  memcpy( &id, msg, 4 );
+  memcpy( &seq, msg + 4, 8 );
+  memcpy( &t, msg + 12, 8 );
+}
+
+static const char* backendName() {
+#if HAS_ASIO==1
+  return "asio";
+#elif HAS_IO_URING==1
+  return "io_uring";
+#elif HAS_EPOLL==1
+  return "epoll";
+#elif IS_POSIX==1
+  return "posix";
+#else
+  return "winsock";
+#endif
+}
+
+// a client connection:  its own TCP (so its own pooled socket) when streaming.
+// pingpong reads the echo back on the connection it sent on, so it uses a plain socket instead
+struct Client {
+  TCP transport;
+  int sock = -1;
+  std::vector<uint64_t> samples;  // round trips, ns (only touched by the client's thread)
+  uint64_t errors = 0;
+};
+
+static void setupTransport( TCP& transport, const CommandLineOptions& options, uint16_t port ) {
+  transport.verbose = false;
+  transport.recvCallbacks.clear();
+  transport.framing = options.framing;
+  transport.port = port;
+  transport.busy_poll.enabled = 0 < options.busy_poll_us;
+  transport.busy_poll.budget = std::chrono::microseconds( options.busy_poll_us );
+#if IS_POSIX==1 && HAS_ASIO==0
+  transport.pool.options.batch = options.batch;
+#endif
+}
+
+static void startListener( TCP& transport ) {
+  std::thread t( [&transport]() { transport.recv(); } );
+  t.detach();
+}
+
+#if IS_POSIX==1 && HAS_ASIO==0
+// pingpong client socket, to the server on localhost.  returns -1 on failure
+static int connectClient( uint16_t port ) {
+  int sock = ::socket( AF_INET, SOCK_STREAM, 0 );
+  if (sock < 0)
+    return -1;
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons( port );
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  if (::connect( sock, (sockaddr*)&addr, sizeof(addr) ) < 0) {
+    fprintf( stderr, "Connection to port %d failed.  Error code: %s\n", (int)port, strerror(errno) );
+    ::close( sock );
+    return -1;
+  }
+  int opt = 1;
+  ::setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(opt) );
+  timeval timeout = { 1, 0 };  // a lost (or very late) echo counts as an error
+  ::setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout) );
+  return sock;
+}
+
+// send one framed message, and wait for its echo (seq) to come back.  returns the round trip in ns,
+// 0 on failure (errno EAGAIN:  no echo in time, the connection is still usable)
+static uint64_t roundTrip( int sock, RingBuffer& ring, Framing framing, const std::vector<char>& frame, uint64_t seq ) {
+#if defined( MSG_NOSIGNAL )
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0;
+#endif
+  for (size_t sent = 0; sent < frame.size(); ) {
+    ssize_t n = ::send( sock, frame.data() + sent, frame.size() - sent, flags );
+    if (n < 0 && errno != EINTR)
+      return 0;
+    sent += 0 < n ? n : 0;
+  }
+  uint64_t latency = 0;
+  while (latency == 0) {
+    if (!ring.reserve( 4096 ))
+      return 0;
+    ssize_t n = ::recv( sock, ring.writePtr(), ring.writable(), 0 );
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n == 0)
+        errno = ECONNRESET;
+      return 0;
+    }
+    ring.commit( n );
+    deliverFrames( framing, ring, 64 * 1024 * 1024, [&]( const char* buffer, size_t buffer_size ) {
+      uint32_t id; uint64_t echoed, t;
+      if (buffer_size < CommandLineOptions::MIN_SIZE)
+        return;
+      readHeader( buffer, id, echoed, t );
+      if (echoed == seq)  // (an earlier one, late after a timeout, is skipped)
+        latency = std::max<uint64_t>( 1, nowNs() - t );
+    });
+  }
+  return latency;
+}
+#endif
+
+static uint64_t percentile( const std::vector<uint64_t>& sorted, double p ) {
+  if (sorted.size() == 0)
+    return 0;
+  return sorted[std::min( sorted.size() - 1, (size_t)(p * sorted.size()) )];
+}
+
+int main( int argc, char* argv[] ) {
+  CommandLineOptions options;
+  options.parse_args( argc, argv );
+  const bool pingpong = options.mode == "pingpong";
+
+  std::vector<std::unique_ptr<Client>> clients;
+  for (int i = 0; i < options.connections; ++i) {
+    clients.emplace_back( new Client );
+    setupTransport( clients.back()->transport, options, options.port );
+  }
+
+  // server:  pingpong echoes every message back on its connection, stream just measures arrivals.
+  TCP server;
+  setupTransport( server, options, options.port );
+  std::atomic<uint64_t> received_bytes( 0 ), received_msgs( 0 );
+  std::mutex one_way_mutex;
+  std::vector<uint64_t> one_way;  // stream latencies, ns
+  server.recvCallbacks.push_back( [&]( int conn, const char* buffer, size_t buffer_size ) {
+    received_bytes += buffer_size;
+    received_msgs += 1;
+    if (pingpong) {
+#if IS_POSIX==1 && HAS_ASIO==0
+      server.reply( conn, buffer, buffer_size );
+#endif
+    } else {
+      uint32_t id; uint64_t seq, t;
+      readHeader( buffer, id, seq, t );
+      std::lock_guard<std::mutex> lock( one_way_mutex );
+      one_way.push_back( nowNs() - t );
+    }
+  });
+  startListener( server );
+  std::this_thread::sleep_for( std::chrono::seconds( 1 ) );  // let the listener come up
+
+  // run every connection on its own thread until the deadline
+  const uint64_t start = nowNs();
+  const uint64_t deadline = start + (uint64_t)(options.duration * 1e9);
+  std::atomic<uint64_t> sent_bytes( 0 );
+  std::vector<std::thread> threads;
+  for (int i = 0; i < options.connections; ++i) {
+    threads.emplace_back( [&, i]() {
+      Client& client = *clients[i];
+#if IS_POSIX==1 && HAS_ASIO==0
+      if (pingpong) {
+        client.sock = connectClient( options.port );
+        if (client.sock < 0) {
+          ++client.errors;
+          return;
+        }
+        RingBuffer ring( options.size + 4096 );
+        std::vector<char> frame( MAX_FRAME_HEADER + options.size, 'x' );
+        size_t header_size = encodeFrameHeader( options.framing, options.size, frame.data() );
+        frame.resize( header_size + options.size );
+        for (uint64_t seq = 1; nowNs() < deadline; ++seq) {
+          writeHeader( frame.data() + header_size, (uint32_t)i, seq, nowNs() );
+          uint64_t latency = roundTrip( client.sock, ring, options.framing, frame, seq );
+          if (latency == 0) {
+            ++client.errors;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+              continue;
+            break;  // the connection is gone
+          }
+          sent_bytes += options.size;
+          client.samples.push_back( latency );
+        }
+        ::close( client.sock );
+        return;
+      }
+#endif
+      std::vector<char> msg( options.size, 'x' );
+      for (uint64_t seq = 1; nowNs() < deadline; ++seq) {
+        writeHeader( msg.data(), (uint32_t)i, seq, nowNs() );
+        if (client.transport.send( msg.data(), msg.size() ) != 0) {
+          ++client.errors;
+          continue;
+        }
+        sent_bytes += msg.size();
+      }
+      client.transport.flush();
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+
+  // snapshot the counters at the deadline, then give in-flight messages a moment to land before collecting latencies
+  const double elapsed = (nowNs() - start) / 1e9;
+  const uint64_t bytes = pingpong ? sent_bytes.load() : received_bytes.load();
+  const uint64_t msgs = received_msgs.load();
+  std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+
+  std::vector<uint64_t> samples;
+  uint64_t errors = 0;
+  if (pingpong) {
+    for (auto& client : clients) {
+      samples.insert( samples.end(), client->samples.begin(), client->samples.end() );
+      errors += client->errors;
+    }
+  } else {
+    std::lock_guard<std::mutex> lock( one_way_mutex );
+    samples = one_way;
+    for (auto& client : clients)
+      errors += client->errors;
+  }
+  std::sort( samples.begin(), samples.end() );
+
+  printf( "{\"mode\": \"%s\", \"backend\": \"%s\", \"framing\": \"%s\", \"batch\": %s, \"busy_poll_us\": %d, \"size\": %zu, \"connections\": %d, "
+          "\"duration_s\": %.3f, \"messages\": %llu, \"errors\": %llu, \"msgs_per_s\": %.1f, \"mb_per_s\": %.3f, "
+          "\"latency_us\": {\"samples\": %zu, \"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}}\n",
+          options.mode.c_str(), backendName(), options.framing == Framing::VARINT ? "varint" : "u32",
+          options.batch ? "true" : "false", options.busy_poll_us, options.size, options.connections,
+          elapsed, (unsigned long long)msgs, (unsigned long long)errors, msgs / elapsed, bytes / elapsed / 1e6,
+          samples.size(), percentile( samples, 0.5 ) / 1e3, percentile( samples, 0.99 ) / 1e3, percentile( samples, 0.999 ) / 1e3,
+          samples.size() ? samples.back() / 1e3 : 0.0 );
+  fflush( stdout );
+
+  // the listeners never return, so don't wait for them
+  std::_Exit( 0 );
+}
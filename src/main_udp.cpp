@@ -1,4 +1,6 @@
 #include <thread>
+#include <functional>
+#include <cstring>
 #include "UDP.h"
 
 int main() {
@@ -25,3 +25,17 @@
 #else
 #define HAS_ASIO 0
 #endif
+
+// Check for epoll (Linux)
+#if defined(__linux__)
+#define HAS_EPOLL 1
+#else
+#define HAS_EPOLL 0
+#endif
+
+// Check for io_uring (Linux, opt in at build time: cmake -DIO_URING=ON, which defines USE_IO_URING)
+#if defined(__linux__) && defined(USE_IO_URING)
+#define HAS_IO_URING 1
+#else
+#define HAS_IO_URING 0
+#endif
@@ -2,6 +2,12 @@
 #define SUBA_NET_UTILS
 
 #include <string>
+#include <cstdio>
+#include <cstdint>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 inline bool isLittleEndian()
 {
@@ -25,8 +31,20 @@ inline T swapEndian( T val ) {
     }
   return val;
 }
+// pin the calling thread to one cpu.  returns 0 on success (Linux only, elsewhere it's a no-op that fails)
+inline int pinThread( int cpu ) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO( &set );
+  CPU_SET( cpu, &set );
+  return pthread_setaffinity_np( pthread_self(), sizeof(set), &set );
+#else
+  return 1;
+#endif
+}
+
 //for (int x = sizeof(DNSHeader); x < bytesReceived; ++x)
-void hexDump(const char* data, size_t len) {
+inline void hexDump(const char* data, size_t len) {
   const size_t width = 16;
   for (size_t j = 0; j < len; j += width) {
     for (size_t x = j; x < (j + width); ++x)
@@ -38,7 +56,7 @@ void hexDump(const char* data, size_t len) {
   }
 }
 
-void cppArrayDump(const char* data, size_t len) {
+inline void cppArrayDump(const char* data, size_t len) {
   printf( "{ " );
   const size_t width = 16;
   for (size_t j = 0; j < len; j += width) {